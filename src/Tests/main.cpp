@@ -1,6 +1,11 @@
 #include "x86box/x86box.h"
 #include <windows.h>
 
+#include <atomic>
+#include <map>
+#include <thread>
+#include <vector>
+
 using namespace x86box;
 
 class BasicMemoryHandler : public x86box::IMemoryHandler
@@ -47,6 +52,41 @@ public:
     }
 };
 
+Operand makeReg(RegisterIndex reg, OperandSize size = OperandSize::SIZE_32)
+{
+    Operand op = {};
+    op.type = OperandType::REG;
+    op.size = size;
+    op.reg.reg = reg;
+    return op;
+}
+
+Operand makeImm(uint64_t val, OperandSize size = OperandSize::SIZE_32)
+{
+    Operand op = {};
+    op.type = OperandType::IMM;
+    op.size = size;
+    op.imm.val.u64 = val;
+    return op;
+}
+
+Operand makeMem(RegisterIndex base, int32_t disp, OperandSize size = OperandSize::SIZE_32)
+{
+    Operand op = {};
+    op.type = OperandType::MEMORY;
+    op.size = size;
+    op.mem.addressSize = OperandSize::SIZE_AUTO;
+    op.mem.regBase = base;
+    op.mem.disp.i32 = disp;
+    return op;
+}
+
+void schedule(x86box::ICodeGenerator *gen, MnemonicType mnemonic, const Operand& op0 = {}, const Operand& op1 = {})
+{
+    Operand ops[4] = { op0, op1 };
+    gen->schedule(Prefix::NONE, mnemonic, ops);
+}
+
 class BasicTranslation : public x86box::ITranslator
 {
 public:
@@ -103,6 +143,142 @@ public:
     }
 };
 
+// Counts zcx down to zero in a self-chained unit, then halts.
+class LoopTranslation : public x86box::ITranslator
+{
+public:
+    enum : uintptr_t
+    {
+        k_LoopIP = 0x00500000,
+        k_ExitIP = 0x00500010,
+    };
+
+    virtual bool process(x86box::ICodeGenerator *gen) override
+    {
+        if (gen->getVirtualIP() == k_LoopIP)
+        {
+            // sub zcx, 1
+            {
+                Operand ops[4] = {};
+
+                ops[0].type = OperandType::REG;
+                ops[0].size = OperandSize::SIZE_32;
+                ops[0].reg.reg = RegisterIndex::GP_REG1; // zcx
+
+                ops[1].type = OperandType::IMM;
+                ops[1].size = OperandSize::SIZE_32;
+                ops[1].imm.val.u32 = 1;
+
+                gen->schedule(Prefix::NONE, MnemonicType::I_SUB, ops);
+            }
+
+            // jne k_LoopIP
+            {
+                Operand ops[4] = {};
+
+                ops[0].type = OperandType::IMM;
+                ops[0].size = OperandSize::SIZE_32;
+                ops[0].imm.val.u32 = k_LoopIP;
+
+                gen->schedule(Prefix::NONE, MnemonicType::I_JNE, ops);
+            }
+
+            // jmp k_ExitIP
+            {
+                Operand ops[4] = {};
+
+                ops[0].type = OperandType::IMM;
+                ops[0].size = OperandSize::SIZE_32;
+                ops[0].imm.val.u32 = k_ExitIP;
+
+                gen->schedule(Prefix::NONE, MnemonicType::I_JMP, ops);
+            }
+
+            return true;
+        }
+        else if (gen->getVirtualIP() == k_ExitIP)
+        {
+            Operand ops[4] = {};
+
+            gen->schedule(Prefix::NONE, MnemonicType::I_HLT, ops);
+
+            return true;
+        }
+
+        // Unmapped.
+        return false;
+    }
+};
+
+// Loads the value stored at its own vIP into zax, then overwrites it with
+// 7 through zcx.
+class SelfModifyingTranslation : public x86box::ITranslator
+{
+public:
+    virtual bool process(x86box::ICodeGenerator *gen) override
+    {
+        uintptr_t vIP = gen->getVirtualIP();
+
+        schedule(gen, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG0), makeImm(*(uint32_t*)vIP));
+        schedule(gen, MnemonicType::I_MOV, makeMem(RegisterIndex::GP_REG1, 0), makeImm(7));
+        schedule(gen, MnemonicType::I_HLT);
+
+        gen->addGuestRange(vIP, sizeof(uint32_t));
+
+        return true;
+    }
+};
+
+// Blocks of instructions keyed by their vIP, filled in by each test.
+class BlockTranslation : public x86box::ITranslator
+{
+    struct Entry
+    {
+        Prefix prefix;
+        MnemonicType mnemonic;
+        Operand ops[4];
+    };
+
+    std::map<uintptr_t, std::vector<Entry>> _blocks;
+    std::map<uintptr_t, std::vector<std::pair<uintptr_t, size_t>>> _ranges;
+
+public:
+    void add(uintptr_t vIP, MnemonicType mnemonic, const Operand& op0 = {}, const Operand& op1 = {}, Prefix prefix = Prefix::NONE)
+    {
+        Entry entry = { prefix, mnemonic, { op0, op1 } };
+        _blocks[vIP].push_back(entry);
+    }
+
+    // Guest memory the block at vIP reports it was translated from.
+    void addRange(uintptr_t vIP, uintptr_t start, size_t size)
+    {
+        _ranges[vIP].push_back({ start, size });
+    }
+
+    virtual bool process(x86box::ICodeGenerator *gen) override
+    {
+        auto itr = _blocks.find(gen->getVirtualIP());
+        if (itr == _blocks.end())
+            return false;
+
+        for (Entry& entry : itr->second)
+        {
+            gen->schedule(entry.prefix, entry.mnemonic, entry.ops);
+        }
+
+        auto ranges = _ranges.find(gen->getVirtualIP());
+        if (ranges != _ranges.end())
+        {
+            for (auto& range : ranges->second)
+            {
+                gen->addGuestRange(range.first, range.second);
+            }
+        }
+
+        return true;
+    }
+};
+
 template<typename A, typename B>
 void assertEq(const A a, const B b)
 {
@@ -134,6 +310,1084 @@ int main()
         }
     }
 
+    // Run a guest loop until it halts, units are compiled on demand.
+    {
+        LoopTranslation loopTranslation;
+        emulator->setTranslator(&loopTranslation);
+
+        VContext ctx = {};
+        ctx.gpRegs[1].val.u32 = 1000; // zcx
+        ctx.nextIP = LoopTranslation::k_LoopIP;
+
+        ExitInfo info = emulator->run(ctx, &memoryHandler);
+        if (info.reason != ExitReason::HALT)
+        {
+            printf("Unexpected exit reason.\n");
+            return -1;
+        }
+
+        assertEq(ctx.gpRegs[1].val.u32, 0u);
+        assertEq(info.vIP, (uintptr_t)LoopTranslation::k_ExitIP);
+
+        emulator->setTranslator(nullptr);
+    }
+
+    // A guest write to its own code is caught and the unit translated again.
+    {
+        IEmulator *emu = x86box::createEmulator();
+
+        SelfModifyingTranslation selfModifying;
+        emu->setTranslator(&selfModifying);
+
+        if (!emu->setCodeWriteDetection(true))
+        {
+            printf("Unable to detect code writes.\n");
+            return -1;
+        }
+
+        uint32_t *code = (uint32_t*)VirtualAlloc(nullptr, 0x1000, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        *code = 5;
+        uint8_t *stack = (uint8_t*)VirtualAlloc(nullptr, 0x10000, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+
+        VContext ctx = {};
+        ctx.gpRegs[1].val.ptr = code; // zcx
+        ctx.gpRegs[4].val.ptr = stack + 0x10000; // zsp
+        ctx.nextIP = (uintptr_t)code;
+
+        ExitInfo info = emu->run(ctx, &memoryHandler);
+        assertEq(info.reason, ExitReason::HALT);
+        assertEq(ctx.gpRegs[0].val.u32, 5u);
+        assertEq(*code, 7u);
+
+        ctx.nextIP = (uintptr_t)code;
+
+        info = emu->run(ctx, &memoryHandler);
+        assertEq(info.reason, ExitReason::HALT);
+        assertEq(ctx.gpRegs[0].val.u32, 7u);
+        assertEq(emu->getStatistics().codeWrites, 1u);
+
+        delete emu;
+        VirtualFree(code, 0, MEM_RELEASE);
+        VirtualFree(stack, 0, MEM_RELEASE);
+    }
+
+    // The write is caught while the guest has data on its stack, which is
+    // left as it was. Windows dispatches the fault below the guest stack
+    // pointer and only runs units with the reserve free there.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        assertEq(emu->setCodeWriteDetection(true), true);
+
+        uint8_t *code = (uint8_t*)VirtualAlloc(nullptr, 0x1000, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        uint8_t *stack = (uint8_t*)VirtualAlloc(nullptr, 0x10000, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        uintptr_t vIP = (uintptr_t)code;
+
+        BlockTranslation blocks;
+        blocks.add(vIP, MnemonicType::I_PUSH, makeReg(RegisterIndex::GP_REG3, OperandSize::SIZE_AUTO));
+        blocks.add(vIP, MnemonicType::I_PUSH, makeReg(RegisterIndex::GP_REG6, OperandSize::SIZE_AUTO));
+        blocks.add(vIP, MnemonicType::I_MOV, makeMem(RegisterIndex::GP_REG1, 0), makeImm(9));
+        blocks.add(vIP, MnemonicType::I_POP, makeReg(RegisterIndex::GP_REG0, OperandSize::SIZE_AUTO));
+        blocks.add(vIP, MnemonicType::I_POP, makeReg(RegisterIndex::GP_REG2, OperandSize::SIZE_AUTO));
+        blocks.add(vIP, MnemonicType::I_HLT);
+        blocks.addRange(vIP, vIP, 0x10);
+        emu->setTranslator(&blocks);
+
+        VContext ctx = {};
+        ExitInfo info;
+        // The write of the first run is processed when the second starts.
+        for (uint32_t run = 0; run < 2; run++)
+        {
+            ctx.gpRegs[1].val.ptr = code; // zcx
+            ctx.gpRegs[3].val.u32 = 0x1234; // zbx
+            ctx.gpRegs[6].val.u32 = 0x5678; // zsi
+            ctx.gpRegs[4].val.ptr = stack + 0x10000; // zsp
+            ctx.nextIP = vIP;
+
+            info = emu->run(ctx, &memoryHandler);
+            assertEq(info.reason, ExitReason::HALT);
+            assertEq(*(uint32_t*)code, 9u);
+            assertEq(ctx.gpRegs[0].val.u32, 0x5678u);
+            assertEq(ctx.gpRegs[2].val.u32, 0x1234u);
+            assertEq(ctx.gpRegs[4].val.ptr, (void*)(stack + 0x10000));
+            assertEq(emu->getStatistics().codeWrites, (uint64_t)run);
+        }
+
+#ifdef _WIN32
+        // Too close to the bottom of the stack.
+        ctx.gpRegs[4].val.ptr = stack + 0x100; // zsp
+        ctx.nextIP = vIP;
+
+        info = emu->run(ctx, &memoryHandler);
+        assertEq(info.reason, ExitReason::STACK_RESERVE);
+        assertEq(info.instructions, 0ull);
+        assertEq(info.vIP, vIP);
+#endif
+
+        delete emu;
+        VirtualFree(code, 0, MEM_RELEASE);
+        VirtualFree(stack, 0, MEM_RELEASE);
+    }
+
+    // Two guest threads share one emulator while their units are invalidated.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setThreadSafe(true);
+
+        LoopTranslation loopTranslation;
+        emu->setTranslator(&loopTranslation);
+
+        std::atomic<uint32_t> failures(0);
+        std::atomic<uint32_t> running(2);
+
+        auto guestThread = [&]()
+        {
+            for (int i = 0; i < 200; i++)
+            {
+                VContext ctx = {};
+                ctx.gpRegs[1].val.u32 = 100000; // zcx
+                ctx.nextIP = LoopTranslation::k_LoopIP;
+
+                ExitInfo info = emu->run(ctx, &memoryHandler);
+                if (info.reason != ExitReason::HALT || ctx.gpRegs[1].val.u32 != 0)
+                {
+                    failures++;
+                }
+            }
+            running--;
+        };
+
+        std::thread thread1(guestThread);
+        std::thread thread2(guestThread);
+
+        // Released units are only freed once both threads moved past them.
+        while (running != 0)
+        {
+            emu->invalidateRange(LoopTranslation::k_LoopIP, 0x20);
+            std::this_thread::yield();
+        }
+
+        thread1.join();
+        thread2.join();
+
+        assertEq(failures.load(), 0u);
+
+        delete emu;
+    }
+
+    // A compare kept lazily is replayed for the branch behind a chained exit,
+    // with either tier.
+    for (uint32_t threshold : { 0u, 16u })
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(threshold);
+
+        BlockTranslation blocks;
+        blocks.add(0x00600000, MnemonicType::I_CMP, makeReg(RegisterIndex::GP_REG0), makeReg(RegisterIndex::GP_REG1));
+        blocks.add(0x00600000, MnemonicType::I_JMP, makeImm(0x00600010));
+        blocks.add(0x00600010, MnemonicType::I_JB, makeImm(0x00600020));
+        blocks.add(0x00600010, MnemonicType::I_JMP, makeImm(0x00600030));
+        blocks.add(0x00600020, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00600020, MnemonicType::I_HLT);
+        blocks.add(0x00600030, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(2));
+        blocks.add(0x00600030, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        const uint32_t values[][3] =
+        {
+            // zax, zcx, zbx
+            { 1, 2, 1 },
+            { 2, 1, 2 },
+            { 5, 5, 2 },
+            { 0, 0xFFFFFFFF, 1 },
+        };
+
+        // The first run links the exit, the second one goes through it.
+        for (int run = 0; run < 2; run++)
+        {
+            for (const auto& value : values)
+            {
+                VContext ctx = {};
+                ctx.gpRegs[0].val.u32 = value[0]; // zax
+                ctx.gpRegs[1].val.u32 = value[1]; // zcx
+                ctx.nextIP = 0x00600000;
+
+                ExitInfo info = emu->run(ctx, &memoryHandler);
+                assertEq(info.reason, ExitReason::HALT);
+                assertEq(ctx.gpRegs[3].val.u32, value[2]);
+                // CF of the compare is what the host sees as well.
+                assertEq(ctx.flags & 1, (uintptr_t)(value[0] < value[1]));
+            }
+        }
+
+        delete emu;
+    }
+
+    // A repeated compare that runs zero times leaves the flags of the host to
+    // the branch after it.
+    for (uint32_t threshold : { 0u, 16u })
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(threshold);
+
+        BlockTranslation blocks;
+        blocks.add(0x00700000, MnemonicType::I_CMPS, makeMem(RegisterIndex::GP_REG6, 0, OperandSize::SIZE_8), makeMem(RegisterIndex::GP_REG7, 0, OperandSize::SIZE_8), Prefix::REP);
+        blocks.add(0x00700000, MnemonicType::I_JE, makeImm(0x00700010));
+        blocks.add(0x00700000, MnemonicType::I_JMP, makeImm(0x00700020));
+        blocks.add(0x00700010, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00700010, MnemonicType::I_HLT);
+        blocks.add(0x00700020, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(2));
+        blocks.add(0x00700020, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        uint8_t src[4] = { 1, 2, 3, 4 };
+        uint8_t dst[4] = { 5, 6, 7, 8 };
+
+        // ZF as the host left it.
+        for (uintptr_t flags : { (uintptr_t)0x40, (uintptr_t)0 })
+        {
+            VContext ctx = {};
+            ctx.flags = flags;
+            ctx.gpRegs[1].val.u32 = 0; // zcx
+            ctx.gpRegs[6].val.ptr = src; // zsi
+            ctx.gpRegs[7].val.ptr = dst; // zdi
+            ctx.nextIP = 0x00700000;
+
+            ExitInfo info = emu->run(ctx, &memoryHandler);
+            assertEq(info.reason, ExitReason::HALT);
+            assertEq(ctx.gpRegs[3].val.u32, flags ? 1u : 2u);
+            assertEq(ctx.gpRegs[6].val.ptr, (void*)src);
+        }
+
+        delete emu;
+    }
+
+    // Chained units with guest registers pinned, pinning is switched every
+    // time the budget hands control back to the host.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setInstructionBudget(500);
+
+        BlockTranslation blocks;
+        blocks.add(0x00800000, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeReg(RegisterIndex::GP_REG0));
+        blocks.add(0x00800000, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG6), makeImm(3));
+        blocks.add(0x00800000, MnemonicType::I_SUB, makeReg(RegisterIndex::GP_REG1), makeImm(1));
+        blocks.add(0x00800000, MnemonicType::I_JMP, makeImm(0x00800010));
+        blocks.add(0x00800010, MnemonicType::I_XOR, makeReg(RegisterIndex::GP_REG7), makeReg(RegisterIndex::GP_REG3));
+        blocks.add(0x00800010, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG2), makeImm(2));
+        blocks.add(0x00800010, MnemonicType::I_CMP, makeReg(RegisterIndex::GP_REG1), makeImm(0));
+        blocks.add(0x00800010, MnemonicType::I_JNE, makeImm(0x00800000));
+        blocks.add(0x00800010, MnemonicType::I_JMP, makeImm(0x00800020));
+        blocks.add(0x00800020, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        uint32_t expectedBx = 0, expectedDi = 0;
+        for (uint32_t i = 0; i < 1000; i++)
+        {
+            expectedBx += 7;
+            expectedDi ^= expectedBx;
+        }
+
+        VContext ctx = {};
+        ctx.gpRegs[0].val.u32 = 7; // zax
+        ctx.gpRegs[1].val.u32 = 1000; // zcx
+        ctx.nextIP = 0x00800000;
+
+        // Not available on every host, the results are the same either way.
+        uint32_t slices = 0;
+        ExitInfo info;
+        do
+        {
+            emu->setRegisterPinning(slices % 2 == 0);
+            info = emu->run(ctx, &memoryHandler);
+            slices++;
+        } while (info.reason == ExitReason::BUDGET);
+
+        assertEq(info.reason, ExitReason::HALT);
+        assertEq(slices > 2, true);
+        assertEq(ctx.gpRegs[0].val.u32, 7u);
+        assertEq(ctx.gpRegs[1].val.u32, 0u);
+        assertEq(ctx.gpRegs[2].val.u32, 2000u);
+        assertEq(ctx.gpRegs[3].val.u32, expectedBx);
+        assertEq(ctx.gpRegs[6].val.u32, 3000u);
+        assertEq(ctx.gpRegs[7].val.u32, expectedDi);
+
+        delete emu;
+    }
+
+    // The optimizing tier forwards a store to the load after it, unless
+    // another store may have written the same place in between.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(0);
+
+        BlockTranslation blocks;
+        blocks.add(0x00900000, MnemonicType::I_MOV, makeMem(RegisterIndex::GP_REG2, 0), makeReg(RegisterIndex::GP_REG0));
+        blocks.add(0x00900000, MnemonicType::I_MOV, makeMem(RegisterIndex::GP_REG6, 0), makeReg(RegisterIndex::GP_REG1));
+        blocks.add(0x00900000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeMem(RegisterIndex::GP_REG2, 0));
+        blocks.add(0x00900000, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00900000, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        uint32_t slots[2] = {};
+        for (int run = 0; run < 2; run++)
+        {
+            for (bool alias : { false, true })
+            {
+                VContext ctx = {};
+                ctx.gpRegs[0].val.u32 = 10; // zax
+                ctx.gpRegs[1].val.u32 = 20; // zcx
+                ctx.gpRegs[2].val.ptr = &slots[0]; // zdx
+                ctx.gpRegs[6].val.ptr = alias ? &slots[0] : &slots[1]; // zsi
+                ctx.nextIP = 0x00900000;
+
+                ExitInfo info = emu->run(ctx, &memoryHandler);
+                assertEq(info.reason, ExitReason::HALT);
+                assertEq(ctx.gpRegs[3].val.u32, alias ? 21u : 11u);
+                assertEq(slots[0], alias ? 20u : 10u);
+            }
+        }
+
+        delete emu;
+    }
+
+    // Constants are folded only where nothing reads the flags the folded
+    // instruction would have set.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(0);
+
+        BlockTranslation blocks;
+        blocks.add(0x00910000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(0xFFFFFFFF));
+        blocks.add(0x00910000, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00910000, MnemonicType::I_JB, makeImm(0x00910010));
+        blocks.add(0x00910000, MnemonicType::I_JMP, makeImm(0x00910020));
+        blocks.add(0x00910010, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG2), makeImm(1));
+        blocks.add(0x00910010, MnemonicType::I_HLT);
+        blocks.add(0x00910020, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG2), makeImm(2));
+        blocks.add(0x00910020, MnemonicType::I_HLT);
+        // An 8 bit shift by 32 masks the count to zero and keeps the flags of
+        // the add in front of it.
+        blocks.add(0x00910030, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(0xFFFFFFFF));
+        blocks.add(0x00910030, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00910030, MnemonicType::I_SHL, makeReg(RegisterIndex::GP_REG3, OperandSize::SIZE_8), makeImm(32, OperandSize::SIZE_8));
+        blocks.add(0x00910030, MnemonicType::I_JB, makeImm(0x00910010));
+        blocks.add(0x00910030, MnemonicType::I_JMP, makeImm(0x00910020));
+        emu->setTranslator(&blocks);
+
+        for (int run = 0; run < 2; run++)
+        {
+            for (uintptr_t vIP : { (uintptr_t)0x00910000, (uintptr_t)0x00910030 })
+            {
+                VContext ctx = {};
+                ctx.nextIP = vIP;
+
+                ExitInfo info = emu->run(ctx, &memoryHandler);
+                assertEq(info.reason, ExitReason::HALT);
+                assertEq(ctx.gpRegs[3].val.u32, 0u);
+                assertEq(ctx.gpRegs[2].val.u32, 1u);
+                // CF and ZF.
+                assertEq(ctx.flags & 0x41, (uintptr_t)0x41);
+            }
+        }
+
+        delete emu;
+    }
+
+    // A 32 bit move clears the upper half, a full size copy of its result
+    // must not be propagated back to the unextended source.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(0);
+
+        BlockTranslation blocks;
+        blocks.add(0x00920000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG1), makeReg(RegisterIndex::GP_REG0));
+        blocks.add(0x00920000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG2, OperandSize::SIZE_AUTO), makeReg(RegisterIndex::GP_REG1, OperandSize::SIZE_AUTO));
+        blocks.add(0x00920000, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG2, OperandSize::SIZE_AUTO), makeImm(1, OperandSize::SIZE_8));
+        blocks.add(0x00920000, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        for (int run = 0; run < 2; run++)
+        {
+            VContext ctx = {};
+            ctx.gpRegs[0].val.ptr = (void*)~(uintptr_t)0; // zax
+            ctx.nextIP = 0x00920000;
+
+            ExitInfo info = emu->run(ctx, &memoryHandler);
+            assertEq(info.reason, ExitReason::HALT);
+            assertEq((uintptr_t)ctx.gpRegs[1].val.ptr, (uintptr_t)0xFFFFFFFF);
+            assertEq((uintptr_t)ctx.gpRegs[2].val.ptr, (uintptr_t)0xFFFFFFFF + 1);
+        }
+
+        delete emu;
+    }
+
+    // Writes overwritten later in the unit are still live on the side exit of
+    // a branch in front of the overwrite.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(0);
+
+        BlockTranslation blocks;
+        blocks.add(0x00930000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00930000, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG6), makeImm(4));
+        blocks.add(0x00930000, MnemonicType::I_CMP, makeReg(RegisterIndex::GP_REG0), makeReg(RegisterIndex::GP_REG1));
+        blocks.add(0x00930000, MnemonicType::I_JE, makeImm(0x00930010));
+        blocks.add(0x00930000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(2));
+        blocks.add(0x00930000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG6), makeImm(0));
+        blocks.add(0x00930000, MnemonicType::I_JMP, makeImm(0x00930020));
+        blocks.add(0x00930010, MnemonicType::I_HLT);
+        blocks.add(0x00930020, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        for (int run = 0; run < 2; run++)
+        {
+            for (bool equal : { true, false })
+            {
+                VContext ctx = {};
+                ctx.gpRegs[0].val.u32 = 3; // zax
+                ctx.gpRegs[1].val.u32 = equal ? 3 : 4; // zcx
+                ctx.nextIP = 0x00930000;
+
+                ExitInfo info = emu->run(ctx, &memoryHandler);
+                assertEq(info.reason, ExitReason::HALT);
+                assertEq(info.vIP, (uintptr_t)(equal ? 0x00930010 : 0x00930020));
+                assertEq(ctx.gpRegs[3].val.u32, equal ? 1u : 2u);
+                assertEq(ctx.gpRegs[6].val.u32, equal ? 4u : 0u);
+            }
+        }
+
+        delete emu;
+    }
+
+    // Peephole rewrites of the optimizing tier, a lea folded into the load
+    // after it, a load of what was just stored and a 32 bit move to itself
+    // that still clears the upper half.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(0);
+
+        const int32_t ptrSize = (int32_t)sizeof(uintptr_t);
+
+        // The stack pointer can only be the base of the merged address.
+        Operand stackSlot = makeMem(RegisterIndex::GP_REG2, 0, OperandSize::SIZE_AUTO);
+        stackSlot.mem.regIndex = RegisterIndex::GP_REG0;
+
+        BlockTranslation blocks;
+        blocks.add(0x00940000, MnemonicType::I_PUSH, makeReg(RegisterIndex::GP_REG1, OperandSize::SIZE_AUTO));
+        blocks.add(0x00940000, MnemonicType::I_LEA, makeReg(RegisterIndex::GP_REG0, OperandSize::SIZE_AUTO), makeMem(RegisterIndex::GP_REG4, ptrSize, OperandSize::SIZE_AUTO));
+        blocks.add(0x00940000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG0, OperandSize::SIZE_AUTO), stackSlot);
+        blocks.add(0x00940000, MnemonicType::I_LEA, makeReg(RegisterIndex::GP_REG6, OperandSize::SIZE_AUTO), makeMem(RegisterIndex::GP_REG7, ptrSize, OperandSize::SIZE_AUTO));
+        blocks.add(0x00940000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG6, OperandSize::SIZE_AUTO), makeMem(RegisterIndex::GP_REG6, ptrSize, OperandSize::SIZE_AUTO));
+        blocks.add(0x00940000, MnemonicType::I_MOV, makeMem(RegisterIndex::GP_REG7, 0), makeReg(RegisterIndex::GP_REG1));
+        blocks.add(0x00940000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG2), makeMem(RegisterIndex::GP_REG7, 0));
+        blocks.add(0x00940000, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeReg(RegisterIndex::GP_REG3));
+        blocks.add(0x00940000, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        for (int run = 0; run < 2; run++)
+        {
+            uintptr_t stack[8] = {};
+            uintptr_t data[4] = { 0, 0, 0x1234, 0 };
+
+            VContext ctx = {};
+            ctx.gpRegs[1].val.u32 = 77; // zcx
+            ctx.gpRegs[2].val.ptr = (void*)(uintptr_t)-ptrSize; // zdx
+            ctx.gpRegs[3].val.ptr = (void*)~(uintptr_t)0xFFFFFFFE; // zbx
+            ctx.gpRegs[4].val.ptr = &stack[4]; // zsp
+            ctx.gpRegs[7].val.ptr = data; // zdi
+            ctx.nextIP = 0x00940000;
+
+            ExitInfo info = emu->run(ctx, &memoryHandler);
+            assertEq(info.reason, ExitReason::HALT);
+            assertEq((uintptr_t)ctx.gpRegs[0].val.ptr, (uintptr_t)77);
+            assertEq(ctx.gpRegs[4].val.ptr, (void*)&stack[3]);
+            assertEq((uintptr_t)ctx.gpRegs[6].val.ptr, (uintptr_t)0x1234);
+            assertEq(data[0], (uintptr_t)77);
+            assertEq((uintptr_t)ctx.gpRegs[2].val.ptr, (uintptr_t)77);
+            assertEq((uintptr_t)ctx.gpRegs[3].val.ptr, (uintptr_t)1);
+        }
+
+        delete emu;
+    }
+
+    // Mnemonics are translated by name, far jumps share theirs with the near
+    // form and pushad touches registers the unit can not see, both stay
+    // unmapped.
+    {
+        IEmulator *emu = x86box::createEmulator();
+
+        BlockTranslation blocks;
+        blocks.add(0x00950000, MnemonicType::I_CMP, makeReg(RegisterIndex::GP_REG0), makeReg(RegisterIndex::GP_REG1));
+        blocks.add(0x00950000, MnemonicType::I_ADC, makeReg(RegisterIndex::GP_REG3), makeImm(10));
+        blocks.add(0x00950000, MnemonicType::I_MOVZX, makeReg(RegisterIndex::GP_REG2), makeReg(RegisterIndex::GP_REG1, OperandSize::SIZE_8));
+        blocks.add(0x00950000, MnemonicType::I_HLT);
+        blocks.add(0x00950010, MnemonicType::I_JMP_FAR, makeImm(0x00950000));
+        blocks.add(0x00950020, MnemonicType::I_PUSHAD);
+        blocks.add(0x00950020, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        VContext ctx = {};
+        ctx.gpRegs[0].val.u32 = 1; // zax
+        ctx.gpRegs[1].val.u32 = 0x1FF; // zcx
+        ctx.nextIP = 0x00950000;
+
+        ExitInfo info = emu->run(ctx, &memoryHandler);
+        assertEq(info.reason, ExitReason::HALT);
+        assertEq(ctx.gpRegs[3].val.u32, 11u);
+        assertEq(ctx.gpRegs[2].val.u32, 0xFFu);
+
+        for (uintptr_t vIP : { (uintptr_t)0x00950010, (uintptr_t)0x00950020 })
+        {
+            TranslatorUnit *unit = emu->createUnit(vIP);
+            assertEq(unit->generate(&blocks), false);
+            assertEq(unit->isGenerated(), false);
+        }
+
+        delete emu;
+    }
+
+#ifdef _AMD64_
+    // Pinned units pass the context on in r15, units using it as a guest
+    // register move the context elsewhere while they run.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        assertEq(emu->setRegisterPinning(true), true);
+        emu->setInstructionBudget(50);
+
+        BlockTranslation blocks;
+        blocks.add(0x00960a00, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG15, OperandSize::SIZE_64), makeReg(RegisterIndex::GP_REG0, OperandSize::SIZE_64));
+        blocks.add(0x00960a00, MnemonicType::I_JMP, makeImm(0x00960a10));
+        blocks.add(0x00960a10, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00960a10, MnemonicType::I_SUB, makeReg(RegisterIndex::GP_REG1), makeImm(1));
+        blocks.add(0x00960a10, MnemonicType::I_JNE, makeImm(0x00960a00));
+        blocks.add(0x00960a10, MnemonicType::I_JMP, makeImm(0x00960a20));
+        blocks.add(0x00960a20, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG14, OperandSize::SIZE_64), makeReg(RegisterIndex::GP_REG15, OperandSize::SIZE_64));
+        blocks.add(0x00960a20, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG15), makeImm(1));
+        blocks.add(0x00960a20, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        VContext ctx = {};
+        ctx.gpRegs[0].val.u64 = 3; // rax
+        ctx.gpRegs[1].val.u32 = 100; // rcx
+        ctx.gpRegs[15].val.u64 = 0x100000000ull; // r15
+        ctx.nextIP = 0x00960a00;
+
+        ExitInfo info;
+        do
+        {
+            info = emu->run(ctx, &memoryHandler);
+        } while (info.reason == ExitReason::BUDGET);
+
+        assertEq(info.reason, ExitReason::HALT);
+        assertEq(ctx.gpRegs[3].val.u32, 100u);
+        assertEq(ctx.gpRegs[14].val.u64, 0x100000000ull + 300);
+        // The 32 bit add clears the upper half.
+        assertEq(ctx.gpRegs[15].val.u64, 301ull);
+
+        delete emu;
+    }
+#endif
+
+#ifdef _AMD64_
+    // Units above 4 GB are found without a lock and the same low 32 bits in
+    // another 4 GB region do not collide. Non canonical addresses can not
+    // hold code.
+    {
+        IEmulator *emu = x86box::createEmulator();
+
+        const uintptr_t vIPs[] =
+        {
+            0x0000000000960b00ull,
+            0x0000000100960b00ull,
+            0x00007FFF00960b00ull,
+            0xFFFF800000960b00ull,
+        };
+        const uintptr_t nonCanonical = 0x0001000000960b00ull;
+
+        BlockTranslation blocks;
+        for (uint32_t i = 0; i < 4; i++)
+        {
+            blocks.add(vIPs[i], MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeImm(i + 1));
+            if (i + 1 < 4)
+            {
+                blocks.add(vIPs[i], MnemonicType::I_JMP, makeImm(vIPs[i + 1], OperandSize::SIZE_64));
+            }
+        }
+        blocks.add(vIPs[3], MnemonicType::I_SUB, makeReg(RegisterIndex::GP_REG1), makeImm(1));
+        blocks.add(vIPs[3], MnemonicType::I_JNE, makeImm(vIPs[0], OperandSize::SIZE_64));
+        blocks.add(vIPs[3], MnemonicType::I_JMP, makeImm(nonCanonical, OperandSize::SIZE_64));
+        blocks.add(nonCanonical, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        for (int run = 0; run < 2; run++)
+        {
+            VContext ctx = {};
+            ctx.gpRegs[1].val.u32 = 5; // zcx
+            ctx.nextIP = vIPs[0];
+
+            ExitInfo info = emu->run(ctx, &memoryHandler);
+            assertEq(info.reason, ExitReason::UNMAPPED);
+            assertEq(info.vIP, nonCanonical);
+            assertEq(ctx.gpRegs[3].val.u32, 50u);
+        }
+
+        for (uintptr_t vIP : vIPs)
+        {
+            assertEq(emu->findUnit(vIP)->getVirtualIP(), vIP);
+        }
+        assertEq(emu->findUnit(nonCanonical) == nullptr, true);
+        assertEq(emu->createUnit(nonCanonical) == nullptr, true);
+
+        delete emu;
+    }
+#endif
+
+    // Indirect jumps and returns probe the target cache, a target seen
+    // before hits and a new one misses and is filled in.
+    {
+        IEmulator *emu = x86box::createEmulator();
+
+        BlockTranslation blocks;
+        blocks.add(0x00960000, MnemonicType::I_JMP, makeReg(RegisterIndex::GP_REG0, OperandSize::SIZE_AUTO));
+        blocks.add(0x00960010, MnemonicType::I_PUSH, makeReg(RegisterIndex::GP_REG0, OperandSize::SIZE_AUTO));
+        blocks.add(0x00960010, MnemonicType::I_RET);
+        blocks.add(0x00960020, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00960020, MnemonicType::I_HLT);
+        blocks.add(0x00960030, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(2));
+        blocks.add(0x00960030, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        for (uintptr_t vIP : { (uintptr_t)0x00960000, (uintptr_t)0x00960010 })
+        {
+            for (uintptr_t target : { (uintptr_t)0x00960020, (uintptr_t)0x00960030 })
+            {
+                for (int run = 0; run < 2; run++)
+                {
+                    uintptr_t stack[4] = {};
+
+                    VContext ctx = {};
+                    ctx.gpRegs[0].val.ptr = (void*)target; // zax
+                    ctx.gpRegs[4].val.ptr = &stack[2]; // zsp
+                    ctx.nextIP = vIP;
+
+                    Statistics before = emu->getStatistics();
+
+                    ExitInfo info = emu->run(ctx, &memoryHandler);
+                    assertEq(info.reason, ExitReason::HALT);
+                    assertEq(ctx.gpRegs[3].val.u32, target == 0x00960020 ? 1u : 2u);
+                    assertEq(ctx.gpRegs[4].val.ptr, (void*)&stack[2]);
+
+                    Statistics after = emu->getStatistics();
+                    assertEq(after.indirectHits - before.indirectHits, run == 0 ? 0u : 1u);
+                    assertEq(after.indirectMisses - before.indirectMisses, run == 0 ? 1u : 0u);
+                }
+            }
+
+            // Drops the targets with the units, the return misses on them first.
+            emu->releaseAllUnits();
+        }
+
+        delete emu;
+    }
+
+    // A return is predicted from the call in front of it, one to somewhere
+    // else is mispredicted and still continues where the guest says.
+    {
+        IEmulator *emu = x86box::createEmulator();
+
+        BlockTranslation blocks;
+        blocks.add(0x00960100, MnemonicType::I_CALL, makeImm(0x00960120), makeImm(0x00960110));
+        blocks.add(0x00960110, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00960110, MnemonicType::I_HLT);
+        blocks.add(0x00960120, MnemonicType::I_MOV, makeMem(RegisterIndex::GP_REG4, 0, OperandSize::SIZE_AUTO), makeReg(RegisterIndex::GP_REG1, OperandSize::SIZE_AUTO));
+        blocks.add(0x00960120, MnemonicType::I_RET);
+        blocks.add(0x00960130, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(2));
+        blocks.add(0x00960130, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        for (int run = 0; run < 2; run++)
+        {
+            for (uintptr_t returnIP : { (uintptr_t)0x00960110, (uintptr_t)0x00960130 })
+            {
+                uintptr_t stack[4] = {};
+
+                VContext ctx = {};
+                ctx.gpRegs[1].val.ptr = (void*)returnIP; // zcx
+                ctx.gpRegs[4].val.ptr = &stack[2]; // zsp
+                ctx.nextIP = 0x00960100;
+
+                Statistics before = emu->getStatistics();
+
+                ExitInfo info = emu->run(ctx, &memoryHandler);
+                assertEq(info.reason, ExitReason::HALT);
+                assertEq(info.vIP, returnIP);
+                assertEq(ctx.gpRegs[3].val.u32, returnIP == 0x00960110 ? 1u : 2u);
+                assertEq(ctx.gpRegs[4].val.ptr, (void*)&stack[2]);
+
+                Statistics after = emu->getStatistics();
+                assertEq(after.returnHits - before.returnHits, returnIP == 0x00960110 ? 1u : 0u);
+                assertEq(after.returnMisses - before.returnMisses, returnIP == 0x00960110 ? 0u : 1u);
+            }
+        }
+
+        delete emu;
+    }
+
+    // A hot loop is stitched into a trace, the branch it rarely takes stays
+    // a side exit that leaves with the state of the blocks up to it.
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(0);
+
+        BlockTranslation blocks;
+        blocks.add(0x00960200, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00960200, MnemonicType::I_CMP, makeReg(RegisterIndex::GP_REG3), makeReg(RegisterIndex::GP_REG6));
+        blocks.add(0x00960200, MnemonicType::I_JE, makeImm(0x00960220));
+        blocks.add(0x00960200, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG2), makeImm(2));
+        blocks.add(0x00960200, MnemonicType::I_JMP, makeImm(0x00960210));
+        blocks.add(0x00960210, MnemonicType::I_SUB, makeReg(RegisterIndex::GP_REG1), makeImm(1));
+        blocks.add(0x00960210, MnemonicType::I_JNE, makeImm(0x00960200));
+        blocks.add(0x00960210, MnemonicType::I_JMP, makeImm(0x00960230));
+        blocks.add(0x00960220, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG7), makeImm(1));
+        blocks.add(0x00960220, MnemonicType::I_JMP, makeImm(0x00960210));
+        blocks.add(0x00960230, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        // Taken once late in the loop, once after the trace exists and never.
+        for (uint32_t coldAt : { 500u, 10u, 0u })
+        {
+            VContext ctx = {};
+            ctx.gpRegs[1].val.u32 = 1000; // zcx
+            ctx.gpRegs[6].val.u32 = coldAt; // zsi
+            ctx.nextIP = 0x00960200;
+
+            ExitInfo info = emu->run(ctx, &memoryHandler);
+            assertEq(info.reason, ExitReason::HALT);
+            assertEq(ctx.gpRegs[1].val.u32, 0u);
+            assertEq(ctx.gpRegs[3].val.u32, 1000u);
+            assertEq(ctx.gpRegs[7].val.u32, coldAt != 0 ? 1u : 0u);
+            assertEq(ctx.gpRegs[2].val.u32, coldAt != 0 ? 1998u : 2000u);
+        }
+
+        delete emu;
+    }
+
+    // Invalidating part of the guest memory only drops the units translated
+    // from a byte inside it, ranges that end where it starts are kept.
+    {
+        IEmulator *emu = x86box::createEmulator();
+
+        BlockTranslation blocks;
+        blocks.add(0x00960300, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00960300, MnemonicType::I_HLT);
+        blocks.addRange(0x00960300, 0x00960300, 0x10);
+        blocks.addRange(0x00960300, 0x00961000, 0x10);
+        // Covers its first byte.
+        blocks.add(0x00960320, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(2));
+        blocks.add(0x00960320, MnemonicType::I_HLT);
+        blocks.add(0x00960340, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(3));
+        blocks.add(0x00960340, MnemonicType::I_HLT);
+        blocks.addRange(0x00960340, 0x00960340, 0x10);
+        emu->setTranslator(&blocks);
+
+        const uintptr_t vIPs[] = { 0x00960300, 0x00960320, 0x00960340 };
+
+        auto runAll = [&]()
+        {
+            for (uint32_t i = 0; i < 3; i++)
+            {
+                VContext ctx = {};
+                ctx.nextIP = vIPs[i];
+
+                ExitInfo info = emu->run(ctx, &memoryHandler);
+                assertEq(info.reason, ExitReason::HALT);
+                assertEq(ctx.gpRegs[3].val.u32, i + 1);
+            }
+        };
+
+        runAll();
+
+        assertEq(emu->invalidateRange(0x00960310, 0x10), 0u);
+        assertEq(emu->invalidateRange(0x00960321, 0x1F), 0u);
+        assertEq(emu->invalidateRange(0x00961010, 0x100), 0u);
+
+        // Only the second range of the first unit.
+        assertEq(emu->invalidateRange(0x0096100F, 0x100), 1u);
+        assertEq(emu->findUnit(vIPs[0]) == nullptr, true);
+        assertEq(emu->findUnit(vIPs[1]) != nullptr, true);
+        assertEq(emu->findUnit(vIPs[2]) != nullptr, true);
+
+        assertEq(emu->invalidateRange(0x00960000, 0x1000), 2u);
+        assertEq(emu->findUnit(vIPs[1]) == nullptr, true);
+        assertEq(emu->findUnit(vIPs[2]) == nullptr, true);
+
+        // Translated again on the next run.
+        runAll();
+        assertEq(emu->invalidateRange(0x0096034F, 1), 1u);
+
+        delete emu;
+    }
+
+    // Registers only written by a unit are not loaded, partial writes keep
+    // the rest of the register and ones only read are left as they were.
+    for (uint32_t threshold : { 0u, 16u })
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(threshold);
+
+        BlockTranslation blocks;
+        blocks.add(0x00960400, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(5));
+        blocks.add(0x00960400, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG0, OperandSize::SIZE_8), makeReg(RegisterIndex::GP_REG1, OperandSize::SIZE_8));
+        blocks.add(0x00960400, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG2), makeReg(RegisterIndex::GP_REG6));
+        blocks.add(0x00960400, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG7, OperandSize::SIZE_16), makeImm(0x1234, OperandSize::SIZE_16));
+        blocks.add(0x00960400, MnemonicType::I_HLT);
+        emu->setTranslator(&blocks);
+
+        for (int run = 0; run < 2; run++)
+        {
+            VContext ctx = {};
+            ctx.gpRegs[0].val.u32 = 0x11223344; // zax
+            ctx.gpRegs[1].val.u32 = 0x55667788; // zcx
+            ctx.gpRegs[2].val.u32 = 100; // zdx
+            ctx.gpRegs[3].val.ptr = (void*)~(uintptr_t)0; // zbx
+            ctx.gpRegs[5].val.u32 = 0x0BADF00D; // zbp
+            ctx.gpRegs[6].val.u32 = 23; // zsi
+            ctx.gpRegs[7].val.u32 = 0xAABBCCDD; // zdi
+            ctx.nextIP = 0x00960400;
+
+            ExitInfo info = emu->run(ctx, &memoryHandler);
+            assertEq(info.reason, ExitReason::HALT);
+            assertEq(ctx.gpRegs[0].val.u32, 0x11223388u);
+            assertEq(ctx.gpRegs[1].val.u32, 0x55667788u);
+            assertEq(ctx.gpRegs[2].val.u32, 123u);
+            assertEq((uintptr_t)ctx.gpRegs[3].val.ptr, (uintptr_t)5);
+            assertEq(ctx.gpRegs[5].val.u32, 0x0BADF00Du);
+            assertEq(ctx.gpRegs[6].val.u32, 23u);
+            assertEq(ctx.gpRegs[7].val.u32, 0xAABB1234u);
+        }
+
+        delete emu;
+    }
+
+    // Code saved to the translation cache by one emulator is used by the
+    // next one, the units of a batch after the first one included. Files
+    // that are corrupt or were written for another layout are rejected.
+    {
+        const char *cachePath = "x86box_tests.tc";
+        remove(cachePath);
+
+        BlockTranslation blocks;
+        blocks.add(0x00960500, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00960500, MnemonicType::I_JMP, makeImm(0x00960510));
+        blocks.add(0x00960510, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeReg(RegisterIndex::GP_REG1));
+        blocks.add(0x00960510, MnemonicType::I_JMP, makeImm(0x00960520));
+        blocks.add(0x00960520, MnemonicType::I_SHL, makeReg(RegisterIndex::GP_REG3), makeImm(1, OperandSize::SIZE_8));
+        blocks.add(0x00960520, MnemonicType::I_HLT);
+
+        const BatchEntry batch[] =
+        {
+            { 0x00960500, &blocks },
+            { 0x00960510, &blocks },
+            { 0x00960520, &blocks },
+        };
+
+        // Compiles the batch and runs through it, returns the units served
+        // from the cache.
+        auto runCached = [&](bool expectOpen) -> uint64_t
+        {
+            IEmulator *emu = x86box::createEmulator();
+            emu->setTranslator(&blocks);
+            assertEq(emu->setTranslationCache(cachePath), expectOpen);
+            assertEq(emu->generateBatch(batch, 3), 3u);
+
+            VContext ctx = {};
+            ctx.gpRegs[1].val.u32 = 10; // zcx
+            ctx.nextIP = 0x00960500;
+
+            ExitInfo info = emu->run(ctx, &memoryHandler);
+            assertEq(info.reason, ExitReason::HALT);
+            assertEq(ctx.gpRegs[3].val.u32, 22u);
+
+            Statistics stats = emu->getStatistics();
+            assertEq(stats.translationCacheHits + stats.translationCacheMisses, 3u);
+
+            // Saved once more when the cache is closed.
+            assertEq(emu->flushTranslationCache(), true);
+            delete emu;
+
+            return stats.translationCacheHits;
+        };
+
+        auto readFile = [&]()
+        {
+            std::vector<uint8_t> data;
+            FILE *fp = fopen(cachePath, "rb");
+            assertEq(fp != nullptr, true);
+            int c;
+            while ((c = fgetc(fp)) != EOF)
+            {
+                data.push_back((uint8_t)c);
+            }
+            fclose(fp);
+            return data;
+        };
+
+        auto writeFile = [&](const std::vector<uint8_t>& data)
+        {
+            FILE *fp = fopen(cachePath, "wb");
+            assertEq(fp != nullptr, true);
+            assertEq(fwrite(data.data(), 1, data.size(), fp), data.size());
+            fclose(fp);
+        };
+
+        assertEq(runCached(true), 0u);
+        assertEq(runCached(true), 3u);
+
+        std::vector<uint8_t> saved = readFile();
+        assertEq(saved.size() > 32, true);
+
+        // Last byte of the code.
+        std::vector<uint8_t> corrupt = saved;
+        corrupt.back() ^= 0xFF;
+        writeFile(corrupt);
+        assertEq(runCached(false), 0u);
+
+        // The fingerprint follows magic, version and pointer size in the
+        // header, the checksum only covers what comes after it.
+        std::vector<uint8_t> foreign = saved;
+        foreign[16] ^= 0xFF;
+        writeFile(foreign);
+        assertEq(runCached(false), 0u);
+
+        // Rewritten by the emulator that rejected it.
+        assertEq(runCached(true), 3u);
+
+        remove(cachePath);
+    }
+
+    // A loop of chained units larger than the code cache limit, units are
+    // evicted while others still link to them. Blocks evicted after the
+    // first run are translated differently for the second one, an exit
+    // still pointing at their old code would add the old value.
+    {
+        const uint32_t numBlocks = 32;
+        const uint32_t numLoops = 20;
+
+        IEmulator *emu = x86box::createEmulator();
+        emu->setCodeCacheLimit(4096);
+
+        auto fill = [&](BlockTranslation& blocks, const std::vector<bool>& changed)
+        {
+            for (uint32_t i = 0; i < numBlocks; i++)
+            {
+                uintptr_t vIP = 0x00960600 + i * 0x10;
+                blocks.add(vIP, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeImm(changed[i] ? (i + 1) * 100 : i + 1));
+                if (i + 1 < numBlocks)
+                {
+                    blocks.add(vIP, MnemonicType::I_JMP, makeImm(vIP + 0x10));
+                }
+                else
+                {
+                    blocks.add(vIP, MnemonicType::I_SUB, makeReg(RegisterIndex::GP_REG1), makeImm(1));
+                    blocks.add(vIP, MnemonicType::I_JNE, makeImm(0x00960600));
+                    blocks.add(vIP, MnemonicType::I_JMP, makeImm(0x00960800));
+                }
+            }
+            blocks.add(0x00960800, MnemonicType::I_HLT);
+        };
+
+        auto runLoop = [&]()
+        {
+            VContext ctx = {};
+            ctx.gpRegs[1].val.u32 = numLoops; // zcx
+            ctx.nextIP = 0x00960600;
+
+            ExitInfo info = emu->run(ctx, &memoryHandler);
+            assertEq(info.reason, ExitReason::HALT);
+            return ctx.gpRegs[3].val.u32;
+        };
+
+        std::vector<bool> changed(numBlocks, false);
+
+        BlockTranslation blocks;
+        fill(blocks, changed);
+        emu->setTranslator(&blocks);
+
+        assertEq(runLoop(), numLoops * (numBlocks * (numBlocks + 1) / 2));
+
+        Statistics stats = emu->getStatistics();
+        assertEq(stats.evictedUnits > 0, true);
+
+        uint32_t expected = 0;
+        uint32_t numChanged = 0;
+        for (uint32_t i = 0; i < numBlocks; i++)
+        {
+            changed[i] = emu->findUnit(0x00960600 + i * 0x10) == nullptr;
+            expected += changed[i] ? (i + 1) * 100 : i + 1;
+            numChanged += changed[i] ? 1 : 0;
+        }
+        assertEq(numChanged > 0 && numChanged < numBlocks, true);
+
+        BlockTranslation changedBlocks;
+        fill(changedBlocks, changed);
+        emu->setTranslator(&changedBlocks);
+
+        assertEq(runLoop(), numLoops * expected);
+
+        delete emu;
+    }
+
+    // A batch keeps going past units that fail to translate or generate,
+    // only the units it created for them are released, the ones the host
+    // created before stay with it.
+    for (uint32_t threshold : { 0u, 16u })
+    {
+        IEmulator *emu = x86box::createEmulator();
+        emu->setTierUpThreshold(threshold);
+
+        BlockTranslation blocks;
+        blocks.add(0x00960900, MnemonicType::I_MOV, makeReg(RegisterIndex::GP_REG3), makeImm(1));
+        blocks.add(0x00960900, MnemonicType::I_JMP, makeImm(0x00960910));
+        blocks.add(0x00960910, MnemonicType::I_ADD, makeReg(RegisterIndex::GP_REG3), makeImm(2));
+        blocks.add(0x00960910, MnemonicType::I_HLT);
+        // Unmapped, translated but not generated.
+        blocks.add(0x00960920, MnemonicType::I_JMP_FAR, makeImm(0x00960900));
+        blocks.add(0x00960930, MnemonicType::I_JMP_FAR, makeImm(0x00960900));
+        emu->setTranslator(&blocks);
+
+        TranslatorUnit *hostUnit = emu->createUnit(0x00960910);
+        TranslatorUnit *hostFailing = emu->createUnit(0x00960930);
+
+        const BatchEntry batch[] =
+        {
+            { 0x00960900, &blocks },
+            { 0x00960920, &blocks },
+            { 0x00960910, &blocks },
+            { 0x00960930, &blocks },
+            // Nothing to translate.
+            { 0x00960940, &blocks },
+        };
+
+        assertEq(emu->generateBatch(batch, 5), 2u);
+
+        assertEq(emu->findUnit(0x00960900)->isGenerated(), true);
+        assertEq(emu->findUnit(0x00960910), hostUnit);
+        assertEq(hostUnit->isGenerated(), true);
+        assertEq(emu->findUnit(0x00960920) == nullptr, true);
+        assertEq(emu->findUnit(0x00960930), hostFailing);
+        assertEq(hostFailing->isGenerated(), false);
+        assertEq(emu->findUnit(0x00960940) == nullptr, true);
+
+        VContext ctx = {};
+        ctx.nextIP = 0x00960900;
+
+        ExitInfo info = emu->run(ctx, &memoryHandler);
+        assertEq(info.reason, ExitReason::HALT);
+        assertEq(ctx.gpRegs[3].val.u32, 3u);
+
+        delete emu;
+    }
+
     uint64_t tickStart = GetTickCount64();
     uint64_t tickLast = tickStart;
     uint64_t numExec = 0;
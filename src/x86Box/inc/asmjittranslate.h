@@ -2,7 +2,7 @@
 
 #include <vector>
 #include <unordered_map>
-#include <map>
+#include <array>
 
 #include "x86box/mnemonic.h"
 #include "x86box/operand.h"
@@ -10,11 +10,13 @@
 
 namespace x86box {
 
+    uint32_t getOperandSizeBytes(OperandSize size);
     asmjit::Operand convertOperandImm(const Operand& op);
     asmjit::X86Reg convertReg(RegisterIndex regIdx, OperandSize size, OperandPosition pos = OperandPosition::LOW);
     asmjit::Operand convertOperandReg(const Operand& op);
     asmjit::Operand convertOperandMem(const Operand& op);
     asmjit::Operand convertOperand(const Operand& op);
     uint32_t convertMnemonic(MnemonicType mnemonic);
+    bool isBranchInstruction(uint32_t instrId);
 
 }
@@ -0,0 +1,97 @@
+#ifndef _X86BOX_COMPILEPOOL_H_
+#define _X86BOX_COMPILEPOOL_H_
+#pragma once
+
+#include "x86box/common.h"
+#include "x86box/instruction.h"
+#include "jittranslatorunit.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace x86box {
+
+class JitEmulator;
+class JitCodeGenerator;
+
+// Compiles already translated instruction streams on worker threads.
+// Results are only installed by the dispatcher, the workers never touch
+// units or links. Without workers jobs are compiled on the calling thread.
+class CompilePool
+{
+public:
+    enum { k_DefaultThreads = 1 };
+
+    struct Job
+    {
+        JitTranslatorUnit *unit;
+        uintptr_t vIP;
+        uint64_t serial;
+        CompileTier tier;
+        // Only baked into the code, the worker never dereferences it.
+        uintptr_t *execCounter;
+        std::vector<Instruction> source;
+    };
+
+    struct Result
+    {
+        JitTranslatorUnit *unit;
+        uintptr_t vIP;
+        uint64_t serial;
+        bool compiled;
+        JitTranslatorUnit::Code code;
+    };
+
+private:
+    JitEmulator *_emulator;
+    std::vector<std::thread> _threads;
+    uint32_t _threadCount;
+    std::mutex _lock;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+    std::deque<Job> _jobs;
+    std::vector<Result> _results;
+    // Jobs taken by a worker but not finished yet.
+    uint32_t _active;
+    bool _shutdown;
+
+public:
+    CompilePool(JitEmulator *emulator);
+    ~CompilePool();
+
+    // Takes effect for the next job, queued jobs are kept.
+    void setThreadCount(uint32_t count);
+
+    uint32_t getThreadCount() const
+    {
+        return _threadCount;
+    }
+
+    // Starts the workers on first use.
+    void enqueue(Job&& job);
+
+    // Moves finished compiles into results.
+    void takeResults(std::vector<Result>& results);
+
+    // Blocks until a result is available, false if nothing is in flight.
+    bool waitForResults();
+
+    // Joins the workers, queued jobs are dropped.
+    void shutdown();
+
+private:
+    // Called with the lock held.
+    void startWorkers();
+    void stopWorkers();
+    Result compileJob(Job& job, JitCodeGenerator& generator);
+    // On the calling thread, with a generator borrowed from the emulator.
+    Result compileHere(Job& job);
+    void workerLoop();
+};
+
+}
+
+#endif // _X86BOX_COMPILEPOOL_H_
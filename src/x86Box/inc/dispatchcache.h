@@ -0,0 +1,98 @@
+#ifndef _X86BOX_DISPATCHCACHE_H_
+#define _X86BOX_DISPATCHCACHE_H_
+#pragma once
+
+#include "x86box/common.h"
+
+#include <string.h>
+
+namespace x86box {
+
+class JitTranslatorUnit;
+
+// Direct-mapped vIP -> unit table, sits in front of the unit map so the
+// common case is a single load and compare.
+class DispatchCache
+{
+public:
+    enum { k_NumEntries = 4096 };
+
+    struct Entry
+    {
+        uintptr_t vIP;
+        JitTranslatorUnit *unit;
+    };
+
+private:
+    alignas(64) Entry _entries[k_NumEntries];
+    uint64_t _hits;
+    uint64_t _misses;
+
+public:
+    DispatchCache()
+    {
+        flush();
+        resetStatistics();
+    }
+
+    static size_t indexOf(uintptr_t vIP)
+    {
+        // Guest blocks are rarely page aligned, mix in the page bits so
+        // units at the same page offset don't collide.
+        return (size_t)((vIP ^ (vIP >> 12)) & (k_NumEntries - 1));
+    }
+
+    JitTranslatorUnit* lookup(uintptr_t vIP)
+    {
+        const Entry& entry = _entries[indexOf(vIP)];
+        if (entry.vIP == vIP && entry.unit != nullptr)
+        {
+            _hits++;
+            return entry.unit;
+        }
+        _misses++;
+        return nullptr;
+    }
+
+    void insert(uintptr_t vIP, JitTranslatorUnit *unit)
+    {
+        Entry& entry = _entries[indexOf(vIP)];
+        entry.vIP = vIP;
+        entry.unit = unit;
+    }
+
+    void invalidate(uintptr_t vIP)
+    {
+        Entry& entry = _entries[indexOf(vIP)];
+        if (entry.vIP == vIP)
+        {
+            entry.vIP = 0;
+            entry.unit = nullptr;
+        }
+    }
+
+    void flush()
+    {
+        memset(_entries, 0, sizeof(_entries));
+    }
+
+    void resetStatistics()
+    {
+        _hits = 0;
+        _misses = 0;
+    }
+
+    uint64_t hits() const
+    {
+        return _hits;
+    }
+
+    uint64_t misses() const
+    {
+        return _misses;
+    }
+};
+
+}
+
+#endif // _X86BOX_DISPATCHCACHE_H_
@@ -0,0 +1,104 @@
+#ifndef _X86BOX_INDIRECTBRANCHCACHE_H_
+#define _X86BOX_INDIRECTBRANCHCACHE_H_
+#pragma once
+
+#include "x86box/common.h"
+
+namespace x86box {
+
+// vIP -> chain entry table probed inline by the code emitted for indirect
+// exits (ret, jmp/call through a register or memory). A miss returns to
+// the dispatcher which fills the table.
+class IndirectBranchCache
+{
+public:
+    enum { k_NumEntries = 1024 };
+
+    // Never a valid block start, keeps empty entries from matching.
+    static constexpr uintptr_t k_InvalidIP = ~(uintptr_t)0;
+
+    struct Entry
+    {
+        uintptr_t vIP;
+        const void *code;
+    };
+
+private:
+    alignas(64) Entry _entries[k_NumEntries];
+    // Bumped by the emitted code, pointer sized so a single add covers it.
+    uintptr_t _hits;
+    uintptr_t _misses;
+
+public:
+    IndirectBranchCache()
+    {
+        flush();
+        resetStatistics();
+    }
+
+    static size_t indexOf(uintptr_t vIP)
+    {
+        return (size_t)((vIP ^ (vIP >> 12)) & (k_NumEntries - 1));
+    }
+
+    void insert(uintptr_t vIP, const void *code)
+    {
+        Entry& entry = _entries[indexOf(vIP)];
+        entry.vIP = vIP;
+        entry.code = code;
+    }
+
+    void invalidate(uintptr_t vIP)
+    {
+        Entry& entry = _entries[indexOf(vIP)];
+        if (entry.vIP == vIP)
+        {
+            entry.vIP = k_InvalidIP;
+            entry.code = nullptr;
+        }
+    }
+
+    void flush()
+    {
+        for (Entry& entry : _entries)
+        {
+            entry.vIP = k_InvalidIP;
+            entry.code = nullptr;
+        }
+    }
+
+    void resetStatistics()
+    {
+        _hits = 0;
+        _misses = 0;
+    }
+
+    const Entry* entries() const
+    {
+        return _entries;
+    }
+
+    uintptr_t* hitCounter()
+    {
+        return &_hits;
+    }
+
+    uintptr_t* missCounter()
+    {
+        return &_misses;
+    }
+
+    uint64_t hits() const
+    {
+        return _hits;
+    }
+
+    uint64_t misses() const
+    {
+        return _misses;
+    }
+};
+
+}
+
+#endif // _X86BOX_INDIRECTBRANCHCACHE_H_
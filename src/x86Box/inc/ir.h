@@ -0,0 +1,131 @@
+#ifndef _X86BOX_IR_H_
+#define _X86BOX_IR_H_
+#pragma once
+
+#include "x86box/common.h"
+#include "x86box/instruction.h"
+
+#include <vector>
+
+namespace x86box {
+
+// Value numbered view of the scheduled instructions of a unit. Units are
+// superblocks, side exits never come back, so every value of a guest
+// register has a single definition and no merges are needed. The
+// instructions stay the representation, passes rewrite them in place and
+// the generator lowers the result as usual.
+class IRUnit
+{
+public:
+    enum { k_NumRegs = 16 };
+    enum { k_AllRegs = 0xFFFF };
+
+    enum Effects : uint8_t
+    {
+        k_EffectFlagsRead = 1u << 0,
+        k_EffectFlagsWrite = 1u << 1,
+        // Every status flag is written.
+        k_EffectFlagsKill = 1u << 2,
+        k_EffectMemRead = 1u << 3,
+        k_EffectMemWrite = 1u << 4,
+        // Leaves the unit, the guest state is live.
+        k_EffectExit = 1u << 5,
+        // Never falls through.
+        k_EffectNoReturn = 1u << 6,
+        // Understood by the analysis, anything else is kept as is.
+        k_EffectModeled = 1u << 7,
+    };
+
+    struct Value
+    {
+        // Values with the same lower 32 bits share the root.
+        uint32_t root;
+        // Register the value was first defined in.
+        uint8_t home;
+        // Upper half of the host register is zero.
+        bool narrow;
+        bool isConst;
+        uint32_t constant;
+    };
+
+    struct Inst
+    {
+        uint8_t effects;
+        // Guest registers read and the ones fully overwritten.
+        uint16_t uses;
+        uint16_t defs;
+        // Register values before the instruction.
+        uint32_t in[k_NumRegs];
+        // Value left in the register of the first operand, 0 if none.
+        uint32_t def;
+        // Needed after the instruction.
+        uint16_t liveOut;
+        bool flagsLiveOut;
+    };
+
+private:
+    // Memory read through an address, valid until the next write.
+    struct Load_t
+    {
+        Operand op;
+        uint32_t base;
+        uint32_t index;
+        uint32_t value;
+    };
+
+    std::vector<Instruction> *_instrs = nullptr;
+    std::vector<Inst> _insts;
+    std::vector<Value> _values;
+    std::vector<Load_t> _loads;
+
+public:
+    // Numbers the values and computes liveness, again after every rewrite
+    // that should be seen by the next pass.
+    void analyse(std::vector<Instruction>& instrs);
+
+    size_t size() const
+    {
+        return _insts.size();
+    }
+
+    Instruction& instr(size_t i)
+    {
+        return (*_instrs)[i];
+    }
+
+    const Inst& inst(size_t i) const
+    {
+        return _insts[i];
+    }
+
+    const Value& value(uint32_t id) const
+    {
+        return _values[id];
+    }
+
+    // Register holding v before instruction i, or one with the same lower
+    // 32 bits unless exact. -1 if none, the stack pointer is never used.
+    int32_t findRegister(size_t i, uint32_t v, bool exact) const;
+
+    // Turns the instruction into a nop, it still counts as a guest
+    // instruction for the budget.
+    void remove(size_t i);
+
+    static Operand makeReg(uint32_t id, OperandSize size);
+    static Operand makeImm(uint32_t val, OperandSize size);
+
+    // Guest register of a gp register operand, -1 for anything else.
+    static int32_t getRegId(const Operand& op);
+
+private:
+    uint32_t newValue(uint8_t home, bool narrow);
+    uint32_t newConst(uint8_t home, uint32_t constant);
+    uint32_t findLoad(const Operand& op, const uint32_t *regs) const;
+    void addLoad(const Operand& op, const uint32_t *regs, uint32_t value);
+    void analyseValues();
+    void analyseLiveness();
+};
+
+}
+
+#endif // _X86BOX_IR_H_
@@ -6,24 +6,92 @@
 #include "x86box/codegenerator.h"
 #include "x86box/vcontext.h"
 #include "x86box/memoryhandler.h"
+#include "jittranslatorunit.h"
+
+#include "ir.h"
+#include "lazyflags.h"
+#include "shadowstack.h"
+#include "translationcache.h"
 
 #include "asmjit/asmjit.h"
 
+#include <atomic>
 #include <vector>
 #include <unordered_set>
 
 namespace x86box {
 
+class JitEmulator;
+class CompileScope;
+
+enum InterruptFlags : uint32_t
+{
+    k_InterruptStop = 1u << 0,
+    // Background compiles are waiting to be installed.
+    k_InterruptInstall = 1u << 1,
+    // A watched code page was written to.
+    k_InterruptCodeWrite = 1u << 2,
+};
+
 struct VContextInternal
 {
     // Public.
     uint8_t _data[sizeof(VContext) - VContext::k_InternalSize];
     // Private.
     IMemoryHandler *memoryHandler;
+    // Instructions left, chained exits return to the host once exhausted.
+    intptr_t budget;
+    // Any bit makes chained exits return to the dispatcher.
+    std::atomic<uint32_t> interrupt;
+    uint32_t halted;
+    // Host stack pointer while the guest stack is active.
+    uintptr_t hostStack;
+    // Spill slot for computing indirect branch targets.
+    uintptr_t scratch;
+    // Set by the dispatcher, hot units only return to it if enabled.
+    uint32_t profiling;
+    uint32_t hotRequested;
+    ShadowStack shadowStack;
+    LazyFlags lazyFlags;
+};
+
+static_assert(sizeof(VContextInternal) <= sizeof(VContext), "VContext::k_InternalSize too small");
+
+// Embedded address, the immediate ends at the label.
+struct AddressReloc_t
+{
+    asmjit::Label end;
+    AddressKind kind;
+    uint32_t index;
+};
+
+// Labels the unit resolves once the code is relocated.
+struct JitLayout
+{
+    // Past the prolog, chained units jump here with the context in the
+    // first argument register.
+    asmjit::Label chainEntry;
+    // Restores the host frame and returns to the caller.
+    asmjit::Label returnPath;
+    // Stores the guest state and flags the context as halted.
+    asmjit::Label haltPath;
+    // Built from more than one block by the trace builder.
+    bool isTrace;
+    std::vector<AddressReloc_t> relocs;
 };
 
 class JitCodeGenerator : public ICodeGenerator
 {
+public:
+    // One unit of compileBatch, code.func stays null if it failed.
+    struct BatchJob_t
+    {
+        JitCodeGenerator *generator;
+        uintptr_t *execCounter;
+        JitTranslatorUnit::Code code;
+    };
+
+private:
     struct RegHasher
     {
         size_t operator()(const asmjit::x86::Reg& reg) const
@@ -33,32 +101,220 @@ class JitCodeGenerator : public ICodeGenerator
         }
     };
 
+    enum class FlagsSource
+    {
+        // Not written since the entry, the context is still current.
+        ENTRY,
+        // Only in the host flags, stored through pushfd.
+        HOST,
+        // Those of `cmp dst, src`.
+        COMPARE,
+        // dst holds dst - src, the source is added back when stored.
+        SUBTRACT,
+        // Those of `test dst, src`.
+        TEST,
+        // Those of the logic result in dst.
+        LOGIC,
+    };
+
+    // Where the guest status flags are at a point of the body.
+    struct FlagsState_t
+    {
+        FlagsSource source = FlagsSource::ENTRY;
+        asmjit::x86::Gp dst;
+        // Register or immediate.
+        asmjit::Operand src;
+    };
+
+    struct BranchExit_t
+    {
+        uintptr_t targetIP;
+        // Guest instructions executed up to and including the branch.
+        uint32_t instrCount;
+        asmjit::Label label;
+        // Index into returnSites for calls.
+        int32_t returnSite = -1;
+        FlagsState_t flags;
+    };
+
+    enum class IndirectKind
+    {
+        JMP,
+        CALL,
+        RET,
+    };
+
+    struct IndirectExit_t
+    {
+        IndirectKind kind;
+        // Branch target for jmp/call, unused for ret.
+        Operand target;
+        // Pushed by call.
+        uintptr_t returnIP;
+        // Released by ret imm16.
+        uint32_t stackAdjust;
+        uint32_t instrCount;
+        asmjit::Label label;
+        int32_t returnSite = -1;
+        FlagsState_t flags;
+    };
+
+    struct HaltExit_t
+    {
+        uintptr_t vIP;
+        uint32_t instrCount;
+        asmjit::Label label;
+        FlagsState_t flags;
+    };
+
+    // Guest blocks a trace is made of, the scheduled instructions from
+    // begin up to the next block belong to vIP.
+    struct Block_t
+    {
+        uintptr_t vIP;
+        size_t begin;
+    };
+
     struct GeneratorContext_t
     {
         uint32_t flagsIn = 0;
         uint32_t flagsOut = 0;
+        // Some flag is live on entry.
+        bool flagsLoad = false;
+        // Only status flags are touched, other bits stay in the context.
+        bool flagsLazy = true;
+        FlagsState_t flags;
         std::unordered_set<asmjit::x86::Reg, RegHasher> regsRead;
         std::unordered_set<asmjit::x86::Reg, RegHasher> regsModified;
         asmjit::x86::Gp regContextBase;
         asmjit::FuncDetail funcDetail;
         asmjit::FuncFrame funcFrame;
+        std::vector<BranchExit_t> exits;
+        std::vector<IndirectExit_t> indirectExits;
+        std::vector<HaltExit_t> haltExits;
+        // Return addresses of calls, linked like branch exits so the shadow
+        // stack can record where the matching ret continues.
+        std::vector<uintptr_t> returnSites;
+        // Guest stack pointer lives in the host stack pointer.
+        bool usesStack = false;
+        // Guest registers kept in their host registers between chained
+        // units, loaded on entry from the host and stored on return to it.
+        uint32_t pinnedRegs = 0;
+        uint32_t instrCount = 0;
+        // Block of the instruction being generated.
+        uintptr_t blockIP = 0;
+        uint32_t instrIndex = 0;
+        // Bumped on entry of units that can become a trace head.
+        uintptr_t *execCounter = nullptr;
+        uint32_t hotThreshold = 0;
+        asmjit::Label hotPath;
+        asmjit::Label hotResume;
+        // Exit slots the stubs point at, sized before any stub is emitted.
+        ArenaArray<JitTranslatorUnit::Exit> *exitSlots = nullptr;
+        JitLayout layout;
     };
 
 private:
+    JitEmulator *_emulator;
+    uintptr_t _virtualIP;
+    uintptr_t _blockIP;
     std::vector<Instruction> _scheduled;
+    // The optimizer already rewrote _scheduled.
+    bool _optimized;
+    std::vector<Block_t> _blocks;
+    std::vector<JitTranslatorUnit::GuestRange> _ranges;
+    // Per instruction flags stored by exits, kept for the capacity.
+    std::vector<uint32_t> _flagsScratch;
+    IRUnit _ir;
 
 public:
-    JitCodeGenerator();
+    JitCodeGenerator(JitEmulator *emulator, uintptr_t vIP);
+
+    // Address of the block being translated.
+    virtual uintptr_t getVirtualIP() const override
+    {
+        return _blockIP;
+    }
 
     virtual bool schedule(const Prefix& prefix, const MnemonicType mnemonic, Operand operands[4]) override;
+    virtual void addGuestRange(uintptr_t start, size_t size) override;
+
+    // Reported ranges plus the first byte of blocks that reported none, false
+    // if the arena is out of memory.
+    bool getGuestRanges(ArenaArray<JitTranslatorUnit::GuestRange>& ranges) const;
 
-    bool generate(asmjit::x86::Builder& builder);
+    // Trace building, instructions scheduled after this belong to vIP.
+    void beginBlock(uintptr_t vIP);
+    // Makes the branch behind exitIndex of the last block fall through into
+    // the next block, fails if the branch can not be turned around.
+    bool stitchBlock(size_t exitIndex);
+
+    // Generates the scheduled instructions with the given tier and adds the
+    // code to the runtime, safe to call from a worker thread.
+    bool compile(CompileTier tier, uintptr_t *execCounter, JitTranslatorUnit::Code& code);
+    // Same for the generators of all jobs, the code goes out in one
+    // allocation shared through JitEmulator::shareCode. Units found in the
+    // translation cache are loaded on their own. Returns how many compiled.
+    static size_t compileBatch(CompileTier tier, std::vector<BatchJob_t>& jobs);
+
+    const std::vector<Instruction>& getScheduled() const
+    {
+        return _scheduled;
+    }
+
+    // Drops what was scheduled, used when the translator fails midway.
+    void discard();
+    // Empty again for translating vIP, keeps the capacity of its buffers.
+    void reset(uintptr_t vIP);
 
 private:
-    bool generateInstruction(GeneratorContext_t& ctx, asmjit::x86::Builder& builder, const Instruction& instr);
+    // Executions after which the profiled code of the tier asks to be recompiled.
+    uint32_t getHotThreshold(CompileTier tier) const;
+    // Everything the generated code depends on besides the embedded addresses.
+    void buildCacheKey(CompileTier tier, bool profiled, std::vector<uint8_t>& key) const;
+    bool loadCached(TranslationCache& cache, const std::vector<uint8_t>& key, uintptr_t *execCounter, JitTranslatorUnit::Code& code);
+    // The code of the unit starts at offset start of the holder.
+    void storeCached(TranslationCache& cache, std::vector<uint8_t>& key, const asmjit::CodeHolder& holder, size_t start, const JitLayout& layout, const JitTranslatorUnit::Code& code);
+    // Emits the unit at the end of the emitter, the function begins at start.
+    bool generateInto(CompileScope& scope, CompileTier tier, uintptr_t *execCounter, ArenaArray<JitTranslatorUnit::Exit>& exits, JitLayout& layout);
+    const void* resolveAddress(AddressKind kind, uint32_t index, uintptr_t *execCounter, ArenaArray<JitTranslatorUnit::Exit> *exits);
+    // Loads an address into reg and records where it went.
+    void emitAddress(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const asmjit::x86::Gp& reg, AddressKind kind, uint32_t index = 0);
+
+    bool generate(asmjit::x86::Builder& builder, ArenaArray<JitTranslatorUnit::Exit>& exits, uintptr_t *execCounter, JitLayout& layout);
+    bool generateBaseline(asmjit::x86::Assembler& assembler, ArenaArray<JitTranslatorUnit::Exit>& exits, uintptr_t *execCounter, JitLayout& layout);
+    bool beginContext(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uintptr_t *execCounter, uint32_t hotThreshold);
+    bool generateBody(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter);
+    bool generateStubs(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, ArenaArray<JitTranslatorUnit::Exit>& exits);
+    bool generateInstruction(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const Instruction& instr);
     bool analyseContextUsage(GeneratorContext_t& ctx, asmjit::x86::Builder& builder, asmjit::CBNode *nodeStart, asmjit::CBNode *nodeEnd);
-    bool generateContextEntry(GeneratorContext_t& ctx, asmjit::x86::Builder& builder, asmjit::CBNode *nodePos);
-    bool generateContextExit(GeneratorContext_t& ctx, asmjit::x86::Builder& builder, asmjit::CBNode *nodePos);
+    // Baseline tier, the same analysis straight from the scheduled
+    // instructions so nothing has to be emitted first.
+    bool analyseInstructions(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter);
+    // Backward liveness over the scheduled instructions, the flags are only
+    // loaded on entry if a bit is read or stored by an exit before written.
+    void analyseFlags(GeneratorContext_t& ctx);
+    // Read registers are loaded on entry, modified ones stored on exit.
+    void addContextRegs(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uint32_t regsRead, uint32_t regsModified);
+    bool selectContextBase(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter);
+    bool generateContextEntry(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter);
+    bool generateContextExit(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter);
+    bool generateContextStore(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const FlagsState_t& flags);
+    bool generateFlagsLoad(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter);
+    // After the registers are stored, clobbers the flags.
+    bool generateFlagsStore(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const FlagsState_t& flags);
+    // Follows the status flags through an instruction of the body.
+    void trackFlags(FlagsState_t& flags, uint32_t instrId, const asmjit::Operand *ops, bool repeated);
+    bool generateHalt(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uintptr_t vIP, uint32_t instrCount, const FlagsState_t& flags);
+    bool generateBudgetCheck(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uint32_t instrCount);
+    bool generateHaltExits(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter);
+    bool generateHotPath(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter);
+    bool generateBranchExits(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, ArenaArray<JitTranslatorUnit::Exit>& exits);
+    bool generateIndirectExits(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, ArenaArray<JitTranslatorUnit::Exit>& exits);
+    bool generateShadowPush(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uint32_t returnIndex);
+    bool generateShadowReturn(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uint32_t instrCount);
+    bool generateIndirectTarget(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const IndirectExit_t& exit);
+    bool generateIndirectDispatch(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter);
 };
 
 }
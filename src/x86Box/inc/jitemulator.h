@@ -4,19 +4,79 @@
 
 #include "x86box/common.h"
 #include "x86box/emulator.h"
-#include "x86box/translatorunit.h"
+#include "jittranslatorunit.h"
+#include "dispatchcache.h"
+#include "indirectbranchcache.h"
+#include "optimizer.h"
+#include "shadowstack.h"
+#include "compilepool.h"
+#include "translationcache.h"
+#include "rangeindex.h"
+#include "unittable.h"
+#include "writewatch.h"
+#include "reclaimer.h"
 
 #include "asmjit/asmjit.h"
 
+#include <atomic>
+#include <mutex>
 #include <unordered_map>
+#include <vector>
 
 namespace x86box {
 
+struct VContextInternal;
+class JitCodeGenerator;
+
 class JitEmulator : public IEmulator
 {
 private:
     asmjit::JitRuntime _runtime;
-    std::unordered_map<uintptr_t, std::unique_ptr<TranslatorUnit>> _units;
+    // Exit slots and guest ranges of the units, outlives all of them.
+    UnitArena _unitArena;
+    UnitTable _units;
+    DispatchCache _dispatchCache;
+    IndirectBranchCache _indirectCache;
+    ShadowStackState _shadowStackState;
+    // Exits of generated units keyed by the vIP they lead to.
+    std::unordered_map<uintptr_t, std::vector<JitTranslatorUnit::Exit*>> _exitsByTarget;
+    RangeIndex _rangeIndex;
+    ITranslator *_translator;
+    uint64_t _instructionBudget;
+    // JitRuntime is not thread safe, the compile pool adds code concurrently.
+    std::mutex _runtimeLock;
+    // Batched functions and the allocation they live in, plus how many of
+    // them still reference each allocation. Guarded by _runtimeLock.
+    std::unordered_map<void*, void*> _sharedFuncs;
+    std::unordered_map<void*, size_t> _sharedRefs;
+    uint32_t _tierUpThreshold;
+    uint64_t _nextSerial;
+    CompilePool _compilePool;
+    TranslationCache _translationCache;
+    // Code held by linked units.
+    std::atomic<size_t> _codeBytes;
+    size_t _codeCacheLimit;
+    // Size the code has to grow past before the next eviction sweep.
+    std::atomic<size_t> _evictThreshold;
+    // Advanced by every dispatch, orders units by their last use.
+    std::atomic<uint64_t> _useClock;
+    uint64_t _evictedUnits;
+    // Write protection of translated code, off unless asked for.
+    WriteWatch _writeWatch;
+    uint64_t _codeWrites;
+    // Generators not in use, borrowed by units while translating.
+    std::vector<std::unique_ptr<JitCodeGenerator>> _generators;
+    // Contexts inside run, interrupted once background compiles finish.
+    std::mutex _activeLock;
+    std::vector<VContextInternal*> _activeContexts;
+    // Several threads may run, see setThreadSafe.
+    bool _threadSafe;
+    // Guest registers stay in host registers between chained units.
+    bool _pinRegisters;
+    // Held by whoever changes units, links or the caches while thread safe.
+    std::recursive_mutex _unitsLock;
+    Reclaimer _reclaimer;
+    Optimizer _optimizer;
 
 public:
     JitEmulator();
@@ -27,11 +87,121 @@ public:
         return (void*)&_runtime;
     }
 
-    virtual TranslatorUnit* findUnit(uintptr_t vIP) override;
-    virtual TranslatorUnit* createUnit(uintptr_t vIP) override;
+    virtual JitTranslatorUnit* findUnit(uintptr_t vIP) override;
+    virtual JitTranslatorUnit* createUnit(uintptr_t vIP) override;
 
     virtual void releaseUnit(TranslatorUnit *unit) override;
     virtual void releaseAllUnits() override;
+    virtual size_t invalidateRange(uintptr_t start, size_t size) override;
+    virtual size_t generateBatch(const BatchEntry *entries, size_t count) override;
+
+    virtual void setTranslator(ITranslator *translator) override;
+    virtual void setInstructionBudget(uint64_t budget) override;
+    virtual void setTierUpThreshold(uint32_t count) override;
+    virtual void setCompileThreads(uint32_t count) override;
+    virtual bool setTranslationCache(const char *path) override;
+    virtual bool flushTranslationCache() override;
+    virtual void setCodeCacheLimit(size_t bytes) override;
+    virtual bool setCodeWriteDetection(bool enable) override;
+    virtual void setThreadSafe(bool enable) override;
+    virtual bool setRegisterPinning(bool enable) override;
+
+    virtual ExitInfo run(VContext& ctx, IMemoryHandler *memoryHandler) override;
+    virtual void requestStop(VContext& ctx) override;
+
+    virtual Statistics getStatistics() const override;
+    virtual void resetStatistics() override;
+
+    enum { k_DefaultTierUpThreshold = 16 };
+
+    uint32_t getTierUpThreshold() const
+    {
+        return _tierUpThreshold;
+    }
+
+    Optimizer& getOptimizer()
+    {
+        return _optimizer;
+    }
+
+    bool isRegisterPinning() const
+    {
+        return _pinRegisters;
+    }
+
+    asmjit::Error addCode(void **func, asmjit::CodeHolder *code);
+    // Functions placed inside the allocation at base, the allocation is
+    // released along with the last of them.
+    void shareCode(void *base, const std::vector<void*>& funcs);
+    void releaseCode(void *func);
+    // Releases code that another thread may still be running, along with
+    // the exit slots its stubs jump through.
+    void retireCode(void *func, ArenaArray<JitTranslatorUnit::Exit>& exits);
+
+    uint64_t nextSerial()
+    {
+        return ++_nextSerial;
+    }
+
+    // Dispatcher thread only, the compile pool brings its own.
+    JitCodeGenerator* acquireGenerator(uintptr_t vIP);
+    void releaseGenerator(JitCodeGenerator *generator);
+
+    // Called by the compile pool, possibly from a worker thread.
+    void onCodeReady();
+
+    void linkUnit(JitTranslatorUnit *unit);
+    void unlinkUnit(JitTranslatorUnit *unit);
+
+    // Adds or removes the guest ranges of the unit in the range index.
+    void indexUnit(JitTranslatorUnit *unit);
+    void unindexUnit(JitTranslatorUnit *unit);
+
+    IndirectBranchCache& getIndirectBranchCache()
+    {
+        return _indirectCache;
+    }
+
+    ShadowStackState& getShadowStackState()
+    {
+        return _shadowStackState;
+    }
+
+    TranslationCache& getTranslationCache()
+    {
+        return _translationCache;
+    }
+
+    WriteWatch& getWriteWatch()
+    {
+        return _writeWatch;
+    }
+
+    UnitArena& getUnitArena()
+    {
+        return _unitArena;
+    }
+
+private:
+    // Locked only while thread safe, may be taken recursively.
+    std::unique_lock<std::recursive_mutex> lockUnits();
+    // Tracks the contexts inside run, the first one gets interrupted by
+    // the write watch.
+    void setActive(VContextInternal *ctx, bool active);
+    JitTranslatorUnit* compileUnit(uintptr_t vIP);
+    // Replaces the unit at vIP with a trace along its hottest exits.
+    JitTranslatorUnit* buildTrace(uintptr_t vIP);
+    void requestTierUp(JitTranslatorUnit *unit);
+    // Queues the static successors of a unit that have no code yet.
+    void prefetchSuccessors(JitTranslatorUnit *unit);
+    void installCompiled();
+    // Waits for a unit queued by prefetching, returns whatever is at vIP after.
+    JitTranslatorUnit* waitForUnit(uintptr_t vIP);
+    // Releases the least recently used units until the code fits the limit
+    // again, keep is about to run.
+    void evictUnits(JitTranslatorUnit *keep);
+    // Invalidates the units on pages the write watch caught being written.
+    void processCodeWrites();
 };
 
 }
@@ -0,0 +1,194 @@
+#ifndef _X86BOX_JITTRANSLATORUNIT_H_
+#define _X86BOX_JITTRANSLATORUNIT_H_
+#pragma once
+
+#include "x86box/common.h"
+#include "x86box/translatorunit.h"
+#include "x86box/instruction.h"
+#include "unitarena.h"
+
+#include <atomic>
+#include <vector>
+
+namespace x86box {
+
+class JitCodeGenerator;
+
+// The unit as the emulator and the code generator see it, the public
+// header only has what the host calls.
+class JitTranslatorUnit : public TranslatorUnit
+{
+public:
+    typedef void(*fnJitFunction)(VContext& ctx);
+
+    // Exit to a statically known guest address, the emitted code jumps
+    // indirectly through `target` which either points back at the return
+    // path of this unit or at the chain entry of the unit for targetIP.
+    struct Exit
+    {
+        uintptr_t targetIP;
+        const void *target;
+        const void *unlinked;
+        // Times the branch was taken, guides trace building.
+        uintptr_t hits;
+        // Continuation of a call recorded on the shadow stack, never taken directly.
+        bool isReturnSite;
+    };
+
+    struct GuestRange
+    {
+        uintptr_t start;
+        size_t size;
+    };
+
+    // Output of a compile, may be produced on another thread and swapped in
+    // with install. The exits are in the arena of the emulator, whoever
+    // drops the code gives them back.
+    struct Code
+    {
+        fnJitFunction func = nullptr;
+        const void *chainEntry = nullptr;
+        ArenaArray<Exit> exits;
+        bool isTrace = false;
+        CompileTier tier = CompileTier::OPTIMIZING;
+        size_t codeSize = 0;
+    };
+
+private:
+    IEmulator * _parent;
+    uintptr_t _virtualIP;
+    // Read without the emulator lock by other guest threads.
+    std::atomic<fnJitFunction> _func;
+    const void *_chainEntry;
+    ArenaArray<Exit> _exits;
+    // Entries into the unit, counted until it is hot enough for a trace.
+    uintptr_t _execCount;
+    bool _isTrace;
+    CompileTier _tier;
+    // Changes with every install so stale background compiles are dropped.
+    uint64_t _serial;
+    // Baseline units are translated again with it for their tier-up.
+    ITranslator *_translator;
+    // Translated, code is being compiled elsewhere.
+    bool _pending;
+    size_t _codeSize;
+    // Guest bytes translated, indexed by the emulator.
+    ArenaArray<GuestRange> _ranges;
+    // Dispatcher clock of the last known use, chained entries are only
+    // noticed through the counters when sampled.
+    std::atomic<uint64_t> _lastUse;
+    uintptr_t _lastActivity;
+
+public:
+    JitTranslatorUnit(IEmulator* emulator, uintptr_t vIP);
+    virtual ~JitTranslatorUnit();
+
+    virtual uintptr_t getVirtualIP() const override
+    {
+        return _virtualIP;
+    }
+
+    virtual bool generate(ITranslator *translator, CompileTier tier = CompileTier::OPTIMIZING) override;
+
+    // Only translates into generator, the caller compiles what was
+    // scheduled and hands the result to install.
+    bool prepare(ITranslator *translator, JitCodeGenerator *generator);
+
+    // Releases the current code and links the new one.
+    void install(Code& code);
+
+    bool isPending() const
+    {
+        return _pending;
+    }
+
+    virtual bool isGenerated() const override;
+
+    fnJitFunction getFunction() const
+    {
+        return _func.load(std::memory_order_acquire);
+    }
+
+    const void* getChainEntry() const
+    {
+        return _chainEntry;
+    }
+
+    ArenaArray<Exit>& getExits()
+    {
+        return _exits;
+    }
+
+    uintptr_t getExecutionCount() const
+    {
+        return _execCount;
+    }
+
+    uintptr_t* getExecutionCounter()
+    {
+        return &_execCount;
+    }
+
+    bool isTrace() const
+    {
+        return _isTrace;
+    }
+
+    CompileTier getTier() const
+    {
+        return _tier;
+    }
+
+    uint64_t getSerial() const
+    {
+        return _serial;
+    }
+
+    // nullptr unless the unit is baseline code.
+    ITranslator* getTranslator() const
+    {
+        return _translator;
+    }
+
+    // The translator goes away, the unit stays baseline code.
+    void forgetTranslator()
+    {
+        _translator = nullptr;
+    }
+
+    const ArenaArray<GuestRange>& getGuestRanges() const
+    {
+        return _ranges;
+    }
+
+    // Bytes of the installed code.
+    size_t getCodeSize() const
+    {
+        return _codeSize;
+    }
+
+    uint64_t getLastUse() const
+    {
+        return _lastUse.load(std::memory_order_relaxed);
+    }
+
+    void markUsed(uint64_t clock)
+    {
+        _lastUse.store(clock, std::memory_order_relaxed);
+    }
+
+    // True if the unit was entered or left through an exit since the last
+    // sample.
+    bool sampleActivity();
+
+    virtual bool execute(VContext& ctx, IMemoryHandler *memoryHandler) override;
+
+    virtual void reset() override;
+
+private:
+    void setGuestRanges(ArenaArray<GuestRange>& ranges);
+};
+
+}
+
+#endif // _X86BOX_JITTRANSLATORUNIT_H_
@@ -0,0 +1,39 @@
+#ifndef _X86BOX_LAZYFLAGS_H_
+#define _X86BOX_LAZYFLAGS_H_
+#pragma once
+
+#include "x86box/common.h"
+
+namespace x86box {
+
+// Guest EFLAGS bits.
+enum EFlags : uint32_t
+{
+    k_FlagCF = 1u << 0,
+    k_FlagPF = 1u << 2,
+    k_FlagAF = 1u << 4,
+    k_FlagZF = 1u << 6,
+    k_FlagSF = 1u << 7,
+    k_FlagOF = 1u << 11,
+    k_FlagsStatus = k_FlagCF | k_FlagPF | k_FlagAF | k_FlagZF | k_FlagSF | k_FlagOF,
+};
+
+// Status flags kept as the operands of the compare that produces them,
+// units store these instead of going through pushfd and replay the compare
+// on entry instead of a popfd. VContext::flags holds the remaining bits
+// while active.
+struct LazyFlags
+{
+    uint32_t active;
+    // Status flags are those of `cmp dst, src` at 32 bits.
+    uint32_t dst;
+    uint32_t src;
+};
+
+// Merges the status flags into flags and clears the lazy state, for when
+// the context goes back to the host.
+void materializeFlags(uintptr_t& flags, LazyFlags& lazy);
+
+}
+
+#endif // _X86BOX_LAZYFLAGS_H_
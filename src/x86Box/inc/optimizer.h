@@ -0,0 +1,48 @@
+#ifndef _X86BOX_OPTIMIZER_H_
+#define _X86BOX_OPTIMIZER_H_
+#pragma once
+
+#include "x86box/common.h"
+#include "x86box/instruction.h"
+#include "x86box/statistics.h"
+#include "ir.h"
+#include "asmjit/asmjit.h"
+
+#include <atomic>
+#include <vector>
+
+namespace x86box {
+
+// Runs the passes of the optimizing tier over the scheduled instructions
+// of a unit before they are lowered. Called from the compile workers as
+// well, the counters are shared.
+class Optimizer
+{
+public:
+    enum { k_NumPasses = (size_t)OptimizerPass::COUNT };
+    // Passes over the instructions, the peephole pass comes after them.
+    enum { k_NumIRPasses = (size_t)OptimizerPass::PEEPHOLE };
+
+    // Returns the number of instructions rewritten or removed.
+    typedef size_t(*fnPass)(IRUnit& ir);
+
+private:
+    std::atomic<uint64_t> _passTime[k_NumPasses];
+    std::atomic<uint64_t> _passChanges[k_NumPasses];
+
+public:
+    Optimizer();
+
+    // Rewrites instrs in place, the number of instructions does not change.
+    void run(IRUnit& ir, std::vector<Instruction>& instrs);
+
+    // Host instructions emitted from node to the end of the builder.
+    void runPeephole(asmjit::x86::Builder& builder, asmjit::CBNode *node);
+
+    void getStatistics(Statistics& stats) const;
+    void resetStatistics();
+};
+
+}
+
+#endif // _X86BOX_OPTIMIZER_H_
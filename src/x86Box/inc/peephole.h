@@ -0,0 +1,20 @@
+#ifndef _X86BOX_PEEPHOLE_H_
+#define _X86BOX_PEEPHOLE_H_
+#pragma once
+
+#include "x86box/common.h"
+#include "asmjit/asmjit.h"
+
+namespace x86box {
+
+// Rewrites pairs of adjacent host instructions emitted for the body of a
+// unit, from node to the end of the builder. Anything that is not an
+// instruction ends the window, labels such as the ones placed after
+// addresses for relocation stay where they are. Registers hold the same
+// values after each pair as before, only the way there changes. Returns the
+// number of instructions rewritten or removed.
+size_t optimizeNodes(asmjit::x86::Builder& builder, asmjit::CBNode *node);
+
+}
+
+#endif // _X86BOX_PEEPHOLE_H_
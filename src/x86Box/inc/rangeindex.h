@@ -0,0 +1,114 @@
+#ifndef _X86BOX_RANGEINDEX_H_
+#define _X86BOX_RANGEINDEX_H_
+#pragma once
+
+#include "x86box/common.h"
+#include "slaballocator.h"
+
+#include <algorithm>
+#include <map>
+#include <vector>
+
+namespace x86box {
+
+class JitTranslatorUnit;
+
+// Guest byte ranges covered by units, answers which units overlap a range
+// that was written to.
+class RangeIndex
+{
+    struct Range
+    {
+        uintptr_t end;
+        JitTranslatorUnit *unit;
+    };
+
+    typedef SlabNodeAllocator<std::pair<const uintptr_t, Range>> Allocator;
+
+    // Nodes come from slabs, indexing a unit does not hit the heap once the
+    // index is warm.
+    Allocator::Pool _nodes;
+    // Keyed by start, ranges of different units may overlap.
+    std::multimap<uintptr_t, Range, std::less<uintptr_t>, Allocator> _ranges;
+    // Longest range so far, bounds how far back a query has to start.
+    size_t _maxSize;
+
+public:
+    RangeIndex()
+        : _ranges(std::less<uintptr_t>(), Allocator(&_nodes)),
+        _maxSize(0)
+    {
+    }
+
+    static uintptr_t endOf(uintptr_t start, size_t size)
+    {
+        return size > UINTPTR_MAX - start ? UINTPTR_MAX : start + size;
+    }
+
+    void insert(uintptr_t start, size_t size, JitTranslatorUnit *unit)
+    {
+        _ranges.insert({ start, { endOf(start, size), unit } });
+        _maxSize = std::max(_maxSize, size);
+    }
+
+    void remove(uintptr_t start, JitTranslatorUnit *unit)
+    {
+        auto range = _ranges.equal_range(start);
+        for (auto it = range.first; it != range.second; )
+        {
+            if (it->second.unit == unit)
+                it = _ranges.erase(it);
+            else
+                ++it;
+        }
+
+        if (_ranges.empty())
+        {
+            _maxSize = 0;
+        }
+    }
+
+    // Whether any unit has a byte in [start, start + size).
+    bool overlaps(uintptr_t start, size_t size) const
+    {
+        uintptr_t end = endOf(start, size);
+        uintptr_t first = start > _maxSize ? start - _maxSize : 0;
+
+        for (auto it = _ranges.lower_bound(first); it != _ranges.end() && it->first < end; ++it)
+        {
+            if (it->second.end > start)
+                return true;
+        }
+
+        return false;
+    }
+
+    // Every unit with at least one byte in [start, start + size).
+    void query(uintptr_t start, size_t size, std::vector<JitTranslatorUnit*>& units) const
+    {
+        uintptr_t end = endOf(start, size);
+        uintptr_t first = start > _maxSize ? start - _maxSize : 0;
+
+        for (auto it = _ranges.lower_bound(first); it != _ranges.end() && it->first < end; ++it)
+        {
+            if (it->second.end > start)
+            {
+                units.push_back(it->second.unit);
+            }
+        }
+
+        // A unit made of several blocks can match more than once.
+        std::sort(units.begin(), units.end());
+        units.erase(std::unique(units.begin(), units.end()), units.end());
+    }
+
+    void clear()
+    {
+        _ranges.clear();
+        _maxSize = 0;
+    }
+};
+
+}
+
+#endif // _X86BOX_RANGEINDEX_H_
@@ -0,0 +1,74 @@
+#ifndef _X86BOX_RECLAIMER_H_
+#define _X86BOX_RECLAIMER_H_
+#pragma once
+
+#include "x86box/common.h"
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace x86box {
+
+// Quiescent state based reclamation for units and code shared by several
+// guest threads. A participant refreshes its epoch every time it passes
+// through the dispatcher, where it holds no unit or code. Anything retired
+// is freed once every participant refreshed after the retire.
+class Reclaimer
+{
+public:
+    struct Participant
+    {
+        std::atomic<uint64_t> epoch;
+    };
+
+private:
+    struct Retired
+    {
+        uint64_t epoch;
+        std::function<void()> free;
+    };
+
+    std::atomic<uint64_t> _epoch;
+    // Guards the participants, the retired list is left to the caller.
+    std::mutex _lock;
+    std::vector<Participant*> _participants;
+    std::deque<Retired> _retired;
+
+public:
+    Reclaimer();
+    ~Reclaimer();
+
+    Reclaimer(const Reclaimer&) = delete;
+    Reclaimer& operator=(const Reclaimer&) = delete;
+
+    void enter(Participant& participant);
+    void leave(Participant& participant);
+
+    // Nothing loaded before this is used after it.
+    void quiescent(Participant& participant)
+    {
+        participant.epoch.store(_epoch.load(std::memory_order_acquire), std::memory_order_release);
+    }
+
+    // Call once the object is unreachable for anyone who passes a
+    // quiescent point from now on. Retiring and collecting must be
+    // serialized by the caller, free runs inside collect.
+    void retire(std::function<void()> free);
+
+    // Frees what no participant can still hold, returns how many.
+    size_t collect();
+    // Frees everything, only with no participants left.
+    void drain();
+
+    size_t pending() const
+    {
+        return _retired.size();
+    }
+};
+
+}
+
+#endif // _X86BOX_RECLAIMER_H_
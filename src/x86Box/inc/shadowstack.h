@@ -0,0 +1,41 @@
+#ifndef _X86BOX_SHADOWSTACK_H_
+#define _X86BOX_SHADOWSTACK_H_
+#pragma once
+
+#include "x86box/common.h"
+
+namespace x86box {
+
+// Return prediction, guest calls push where the matching ret should
+// continue on the host and ret jumps there if the guest agrees.
+struct ShadowStackEntry
+{
+    uintptr_t returnIP;
+    const void *continuation;
+    // Entries from before a unit was released are stale.
+    uintptr_t epoch;
+    uintptr_t _pad;
+};
+
+// Lives in the private part of the context, wraps around on overflow.
+struct ShadowStack
+{
+    enum { k_NumEntries = 16 };
+
+    uint32_t top;
+    uint32_t _pad;
+    ShadowStackEntry entries[k_NumEntries];
+};
+
+// Emulator wide state the emitted code checks entries against.
+struct ShadowStackState
+{
+    // Starts at 1 so zeroed entries never match.
+    uintptr_t epoch = 1;
+    uintptr_t hits = 0;
+    uintptr_t misses = 0;
+};
+
+}
+
+#endif // _X86BOX_SHADOWSTACK_H_
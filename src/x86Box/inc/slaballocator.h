@@ -0,0 +1,154 @@
+#ifndef _X86BOX_SLABALLOCATOR_H_
+#define _X86BOX_SLABALLOCATOR_H_
+#pragma once
+
+#include "x86box/common.h"
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace x86box {
+
+// Objects of a single type carved from slabs of N slots. Destroyed objects
+// leave their slot on a free list for the next one, slabs are only given
+// back on destruction. Not thread safe.
+template<typename T, size_t N = 256>
+class SlabAllocator
+{
+    union Slot
+    {
+        Slot *next;
+        alignas(T) uint8_t storage[sizeof(T)];
+    };
+
+    std::vector<std::unique_ptr<Slot[]>> _slabs;
+    Slot *_free;
+
+public:
+    SlabAllocator()
+        : _free(nullptr)
+    {
+    }
+
+    SlabAllocator(const SlabAllocator&) = delete;
+    SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+    template<typename... Args>
+    T* create(Args&&... args)
+    {
+        if (!_free)
+        {
+            grow();
+        }
+
+        Slot *slot = _free;
+        _free = slot->next;
+
+        return new (slot->storage) T(std::forward<Args>(args)...);
+    }
+
+    void destroy(T *obj)
+    {
+        obj->~T();
+
+        Slot *slot = reinterpret_cast<Slot*>(obj);
+        slot->next = _free;
+        _free = slot;
+    }
+
+private:
+    void grow()
+    {
+        Slot *slab = new Slot[N];
+        _slabs.emplace_back(slab);
+
+        // Lowest address first out.
+        for (size_t i = N; i-- > 0; )
+        {
+            slab[i].next = _free;
+            _free = &slab[i];
+        }
+    }
+};
+
+template<size_t Size>
+struct SlabBlock
+{
+    alignas(std::max_align_t) uint8_t bytes[Size];
+};
+
+// Standard allocator for the nodes of a node based container, single
+// objects come from a slab of Size byte blocks shared by its copies.
+// Anything else goes to the heap.
+template<typename T, size_t Size = 64>
+class SlabNodeAllocator
+{
+    template<typename U, size_t S>
+    friend class SlabNodeAllocator;
+
+public:
+    typedef T value_type;
+    typedef SlabAllocator<SlabBlock<Size>> Pool;
+
+    template<typename U>
+    struct rebind
+    {
+        typedef SlabNodeAllocator<U, Size> other;
+    };
+
+private:
+    Pool *_pool;
+
+    static bool fits(size_t n)
+    {
+        return n == 1 && sizeof(T) <= Size && alignof(T) <= alignof(SlabBlock<Size>);
+    }
+
+public:
+    explicit SlabNodeAllocator(Pool *pool)
+        : _pool(pool)
+    {
+    }
+
+    template<typename U>
+    SlabNodeAllocator(const SlabNodeAllocator<U, Size>& other)
+        : _pool(other._pool)
+    {
+    }
+
+    T* allocate(size_t n)
+    {
+        if (!fits(n))
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+
+        return reinterpret_cast<T*>(_pool->create());
+    }
+
+    void deallocate(T *obj, size_t n)
+    {
+        if (!fits(n))
+        {
+            ::operator delete(obj);
+            return;
+        }
+
+        _pool->destroy(reinterpret_cast<SlabBlock<Size>*>(obj));
+    }
+
+    bool operator==(const SlabNodeAllocator& other) const
+    {
+        return _pool == other._pool;
+    }
+
+    bool operator!=(const SlabNodeAllocator& other) const
+    {
+        return _pool != other._pool;
+    }
+};
+
+}
+
+#endif // _X86BOX_SLABALLOCATOR_H_
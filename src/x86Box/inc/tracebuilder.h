@@ -0,0 +1,56 @@
+#ifndef _X86BOX_TRACEBUILDER_H_
+#define _X86BOX_TRACEBUILDER_H_
+#pragma once
+
+#include "x86box/common.h"
+#include "x86box/translator.h"
+#include "jittranslatorunit.h"
+
+#include <vector>
+
+namespace x86box {
+
+class JitEmulator;
+
+// Follows the most taken exits of hot units and replays the translator
+// for each block into a single generator, the branches between them are
+// turned into fall throughs and the cold sides stay as exits.
+class TraceBuilder : public ITranslator
+{
+public:
+    // Entries before a unit asks the dispatcher for a trace.
+    enum { k_HotThreshold = 64 };
+    enum { k_MaxBlocks = 8 };
+
+    struct Step
+    {
+        uintptr_t vIP;
+        // Exit continuing into the next step, -1 ends the trace.
+        int32_t exitIndex;
+    };
+
+private:
+    JitEmulator *_emulator;
+    ITranslator *_translator;
+    std::vector<Step> _path;
+
+public:
+    TraceBuilder(JitEmulator *emulator, ITranslator *translator);
+
+    // Picks the path starting at head, false if there is nothing to stitch.
+    bool select(JitTranslatorUnit *head);
+
+    // Keeps only the first count steps.
+    void truncate(size_t count);
+
+    const std::vector<Step>& getPath() const
+    {
+        return _path;
+    }
+
+    virtual bool process(ICodeGenerator *gen) override;
+};
+
+}
+
+#endif // _X86BOX_TRACEBUILDER_H_
@@ -0,0 +1,134 @@
+#ifndef _X86BOX_TRANSLATIONCACHE_H_
+#define _X86BOX_TRANSLATIONCACHE_H_
+#pragma once
+
+#include "x86box/common.h"
+#include "x86box/instruction.h"
+#include "x86box/translatorunit.h"
+
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace x86box {
+
+// Absolute addresses the generated code embeds, everything else in it is
+// position independent.
+enum class AddressKind : uint8_t
+{
+    EXEC_COUNTER = 0,
+    // Index is the exit.
+    EXIT_HITS,
+    EXIT_TARGET,
+    SHADOW_EPOCH,
+    SHADOW_HITS,
+    SHADOW_MISSES,
+    INDIRECT_ENTRIES,
+    INDIRECT_HITS,
+    INDIRECT_MISSES,
+    COUNT,
+};
+
+// Generated code keyed by the scheduled instruction stream it came from,
+// backed by a file so later processes can skip the compile. Entries hold
+// the code with the embedded addresses cleared, they are filled in again
+// for the emulator loading them.
+class TranslationCache
+{
+public:
+    // Bump whenever the generated code changes shape.
+    enum { k_Version = 8 };
+
+    struct Reloc
+    {
+        // Of the pointer sized immediate.
+        uint32_t offset;
+        AddressKind kind;
+        uint32_t index;
+    };
+
+    struct CachedExit
+    {
+        uintptr_t targetIP;
+        bool isReturnSite;
+    };
+
+    struct Entry
+    {
+        std::vector<uint8_t> key;
+        CompileTier tier;
+        bool isTrace;
+        // Label offsets from the start of the code.
+        uint32_t chainEntry;
+        uint32_t returnPath;
+        std::vector<CachedExit> exits;
+        std::vector<Reloc> relocs;
+        std::vector<uint8_t> code;
+    };
+
+private:
+    std::mutex _lock;
+    std::string _path;
+    // Code that is not compatible with the running emulator is ignored.
+    uint64_t _fingerprint;
+    std::unordered_map<uint64_t, Entry> _entries;
+    bool _dirty;
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+
+public:
+    TranslationCache();
+    ~TranslationCache();
+
+    // Loads the entries in path, a missing file starts out empty. False if
+    // the file exists but was rejected, it is rewritten on the next save.
+    bool open(const char *path, uint64_t fingerprint);
+    // Saves and drops all entries.
+    void close();
+    // Writes the entries to the file if anything was added.
+    bool save();
+
+    bool isOpen();
+
+    // Copies the entry matching key, false if there is none.
+    bool lookup(const std::vector<uint8_t>& key, Entry& entry);
+    void insert(Entry&& entry);
+
+    // Canonical encoding of an instruction, unused operand bytes are left out.
+    static void appendInstruction(std::vector<uint8_t>& key, const Instruction& instr);
+
+    template<typename T>
+    static void append(std::vector<uint8_t>& out, const T& value)
+    {
+        const uint8_t *data = reinterpret_cast<const uint8_t*>(&value);
+        out.insert(out.end(), data, data + sizeof(T));
+    }
+
+    // FNV-1a.
+    static uint64_t hash(const uint8_t *data, size_t size);
+
+    uint64_t hits() const
+    {
+        return _hits;
+    }
+
+    uint64_t misses() const
+    {
+        return _misses;
+    }
+
+    void resetStatistics()
+    {
+        _hits = 0;
+        _misses = 0;
+    }
+
+private:
+    bool load();
+};
+
+}
+
+#endif // _X86BOX_TRANSLATIONCACHE_H_
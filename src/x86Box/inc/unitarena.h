@@ -0,0 +1,236 @@
+#ifndef _X86BOX_UNITARENA_H_
+#define _X86BOX_UNITARENA_H_
+#pragma once
+
+#include "x86box/common.h"
+
+#include <memory>
+#include <mutex>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <type_traits>
+#include <vector>
+
+namespace x86box {
+
+class UnitArena;
+
+// Elements in a UnitArena, a plain handle that is given back by whoever
+// owns it. Nothing is constructed, only trivially copyable types.
+template<typename T>
+class ArenaArray
+{
+    friend class UnitArena;
+
+    T *_data;
+    uint32_t _size;
+
+public:
+    ArenaArray()
+        : _data(nullptr),
+        _size(0)
+    {
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    bool empty() const
+    {
+        return _size == 0;
+    }
+
+    T* begin()
+    {
+        return _data;
+    }
+
+    T* end()
+    {
+        return _data + _size;
+    }
+
+    const T* begin() const
+    {
+        return _data;
+    }
+
+    const T* end() const
+    {
+        return _data + _size;
+    }
+
+    T& operator[](size_t idx)
+    {
+        return _data[idx];
+    }
+
+    const T& operator[](size_t idx) const
+    {
+        return _data[idx];
+    }
+};
+
+// What units keep next to their code, the exit slots and the guest ranges.
+// Blocks are carved from chunks in powers of two and go on a free list of
+// their size when given back, so generating a unit stops hitting the heap
+// once the arena is warm. Chunks are only freed on destruction. Thread
+// safe, the compile workers allocate the exits of their units.
+class UnitArena
+{
+public:
+    enum
+    {
+        k_ChunkSize = 64 * 1024,
+        k_MinBlockBits = 5,
+        // Larger arrays come from the heap.
+        k_MaxBlockBits = 14,
+        k_NumClasses = k_MaxBlockBits - k_MinBlockBits + 1,
+    };
+
+private:
+    struct FreeBlock
+    {
+        FreeBlock *next;
+    };
+
+    std::mutex _lock;
+    std::vector<std::unique_ptr<uint8_t[]>> _chunks;
+    uint8_t *_cursor;
+    size_t _left;
+    FreeBlock *_free[k_NumClasses];
+
+public:
+    UnitArena()
+        : _cursor(nullptr),
+        _left(0)
+    {
+        for (FreeBlock*& head : _free)
+        {
+            head = nullptr;
+        }
+    }
+
+    UnitArena(const UnitArena&) = delete;
+    UnitArena& operator=(const UnitArena&) = delete;
+
+    // Zeroed, whatever the array held before is given back first. False if
+    // out of memory.
+    template<typename T>
+    bool allocate(ArenaArray<T>& array, size_t count)
+    {
+        static_assert(std::is_trivially_copyable<T>::value, "Arena elements are not constructed");
+
+        release(array);
+        if (count == 0)
+            return true;
+
+        void *block = allocateBlock(count * sizeof(T));
+        if (!block)
+            return false;
+
+        memset(block, 0, count * sizeof(T));
+        array._data = static_cast<T*>(block);
+        array._size = (uint32_t)count;
+        return true;
+    }
+
+    template<typename T>
+    void release(ArenaArray<T>& array)
+    {
+        if (array._data)
+        {
+            releaseBlock(array._data, array._size * sizeof(T));
+        }
+
+        array._data = nullptr;
+        array._size = 0;
+    }
+
+private:
+    static uint32_t getClass(size_t bytes)
+    {
+        uint32_t bits = k_MinBlockBits;
+        while (((size_t)1 << bits) < bytes)
+        {
+            bits++;
+        }
+        return bits - k_MinBlockBits;
+    }
+
+    static size_t getClassSize(uint32_t cls)
+    {
+        return (size_t)1 << (cls + k_MinBlockBits);
+    }
+
+    void* allocateBlock(size_t bytes)
+    {
+        if (bytes > getClassSize(k_NumClasses - 1))
+            return malloc(bytes);
+
+        uint32_t cls = getClass(bytes);
+        size_t size = getClassSize(cls);
+
+        std::lock_guard<std::mutex> lock(_lock);
+
+        FreeBlock *block = _free[cls];
+        if (block)
+        {
+            _free[cls] = block->next;
+            return block;
+        }
+
+        if (_left < size)
+        {
+            uint8_t *chunk = new (std::nothrow) uint8_t[k_ChunkSize];
+            if (!chunk)
+                return nullptr;
+
+            // What is left of the previous one is handed out in smaller blocks.
+            for (uint32_t i = k_NumClasses; i-- > 0 && _left != 0; )
+            {
+                while (_left >= getClassSize(i))
+                {
+                    pushFree(i, _cursor);
+                    _cursor += getClassSize(i);
+                    _left -= getClassSize(i);
+                }
+            }
+
+            _chunks.emplace_back(chunk);
+            _cursor = chunk;
+            _left = k_ChunkSize;
+        }
+
+        void *res = _cursor;
+        _cursor += size;
+        _left -= size;
+        return res;
+    }
+
+    void releaseBlock(void *block, size_t bytes)
+    {
+        if (bytes > getClassSize(k_NumClasses - 1))
+        {
+            free(block);
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(_lock);
+        pushFree(getClass(bytes), block);
+    }
+
+    void pushFree(uint32_t cls, void *block)
+    {
+        FreeBlock *head = static_cast<FreeBlock*>(block);
+        head->next = _free[cls];
+        _free[cls] = head;
+    }
+};
+
+}
+
+#endif // _X86BOX_UNITARENA_H_
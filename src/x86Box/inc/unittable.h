@@ -0,0 +1,292 @@
+#ifndef _X86BOX_UNITTABLE_H_
+#define _X86BOX_UNITTABLE_H_
+#pragma once
+
+#include "x86box/common.h"
+#include "jittranslatorunit.h"
+#include "slaballocator.h"
+#include "reclaimer.h"
+
+#include <atomic>
+#include <stdlib.h>
+#include <vector>
+
+namespace x86box {
+
+// Owns the units of an emulator keyed by vIP, they and the leaves live in
+// slabs so creating one does not hit the heap once the cache is warm. A
+// root indexed by the bits above the low 512 MB points at directories, each
+// one points at leaves holding a slot per byte of 512 guest bytes, a single
+// host page of slots. A lookup is three dependent loads and no hashing for
+// any canonical address. Directories stay until the table goes away, only
+// leaves come and go.
+//
+// Lookups in the directory never block, changes have to be serialized by
+// the owner. With a reclaimer set erased units and emptied leaves are only
+// freed once no reader can hold them anymore.
+class UnitTable
+{
+public:
+    enum
+    {
+        // Sparse code costs a leaf per 512 bytes instead of per page.
+        k_LeafBits = 9,
+        k_LeafSize = 1 << k_LeafBits,
+        // A directory covers 512 MB.
+        k_DirectoryBits = 20,
+        k_NumLeaves = 1 << k_DirectoryBits,
+        // Canonical addresses sign extend bit 47, the 48 bits below it are
+        // unique.
+        k_AddressBits = sizeof(uintptr_t) == 8 ? 48 : 32,
+        k_RootBits = k_AddressBits - k_DirectoryBits - k_LeafBits,
+        k_NumDirectories = 1 << k_RootBits,
+    };
+
+    struct Leaf
+    {
+        std::atomic<JitTranslatorUnit*> units[k_LeafSize];
+        // Slots in use, the leaf is freed once none are.
+        uint32_t count;
+        // Position in _leaves.
+        uint32_t index;
+        uint64_t number;
+    };
+
+    struct Directory
+    {
+        std::atomic<Leaf*> leaves[k_NumLeaves];
+    };
+
+private:
+    // Zeroed by calloc as are the directories, pages of them that are never
+    // touched are never committed either.
+    std::atomic<Directory*> *_root;
+    // Allocated leaves, walked instead of the directories.
+    std::vector<Leaf*> _leaves;
+    size_t _size;
+    SlabAllocator<JitTranslatorUnit> _allocator;
+    SlabAllocator<Leaf, 16> _leafAllocator;
+    Reclaimer *_reclaimer;
+
+public:
+    UnitTable()
+        : _root(static_cast<std::atomic<Directory*>*>(calloc(k_NumDirectories, sizeof(std::atomic<Directory*>)))),
+        _size(0),
+        _reclaimer(nullptr)
+    {
+    }
+
+    ~UnitTable()
+    {
+        clear();
+
+        for (uint32_t i = 0; i < k_NumDirectories; i++)
+        {
+            free(_root[i].load(std::memory_order_relaxed));
+        }
+        free(_root);
+    }
+
+    UnitTable(const UnitTable&) = delete;
+    UnitTable& operator=(const UnitTable&) = delete;
+
+    // Only while the table is not read concurrently.
+    void setReclaimer(Reclaimer *reclaimer)
+    {
+        _reclaimer = reclaimer;
+    }
+
+    // Anything else faults on the host before it could run.
+    static bool isCanonical(uintptr_t vIP)
+    {
+        if (k_AddressBits == sizeof(uintptr_t) * 8)
+            return true;
+
+        const uint32_t shift = 64 - k_AddressBits;
+        return (uint64_t)((int64_t)((uint64_t)vIP << shift) >> shift) == (uint64_t)vIP;
+    }
+
+    JitTranslatorUnit* find(uintptr_t vIP) const
+    {
+        if (!isCanonical(vIP))
+            return nullptr;
+
+        const Directory *directory = _root[getRootIndex(vIP)].load(std::memory_order_acquire);
+        if (!directory)
+            return nullptr;
+
+        const Leaf *leaf = directory->leaves[getLeafIndex(vIP)].load(std::memory_order_acquire);
+        if (!leaf)
+            return nullptr;
+
+        return leaf->units[vIP & (k_LeafSize - 1)].load(std::memory_order_acquire);
+    }
+
+    // There must not be a unit at vIP yet, nullptr if it is not canonical.
+    JitTranslatorUnit* emplace(uintptr_t vIP, IEmulator *emulator)
+    {
+        if (!isCanonical(vIP))
+            return nullptr;
+
+        Directory *directory = _root[getRootIndex(vIP)].load(std::memory_order_relaxed);
+        if (!directory)
+        {
+            directory = static_cast<Directory*>(calloc(1, sizeof(Directory)));
+            if (!directory)
+                return nullptr;
+
+            _root[getRootIndex(vIP)].store(directory, std::memory_order_release);
+        }
+
+        Leaf *leaf = directory->leaves[getLeafIndex(vIP)].load(std::memory_order_relaxed);
+        if (!leaf)
+        {
+            leaf = _leafAllocator.create();
+            leaf->number = getLeafNumber(vIP);
+            leaf->index = (uint32_t)_leaves.size();
+            _leaves.push_back(leaf);
+            directory->leaves[getLeafIndex(vIP)].store(leaf, std::memory_order_release);
+        }
+
+        JitTranslatorUnit *res = _allocator.create(emulator, vIP);
+        _size++;
+
+        leaf->units[vIP & (k_LeafSize - 1)].store(res, std::memory_order_release);
+        leaf->count++;
+
+        return res;
+    }
+
+    void erase(uintptr_t vIP)
+    {
+        if (!isCanonical(vIP))
+            return;
+
+        Directory *directory = _root[getRootIndex(vIP)].load(std::memory_order_relaxed);
+        if (!directory)
+            return;
+
+        Leaf *leaf = directory->leaves[getLeafIndex(vIP)].load(std::memory_order_relaxed);
+        if (!leaf)
+            return;
+
+        JitTranslatorUnit *unit = leaf->units[vIP & (k_LeafSize - 1)].load(std::memory_order_relaxed);
+        if (!unit)
+            return;
+
+        leaf->units[vIP & (k_LeafSize - 1)].store(nullptr, std::memory_order_release);
+
+        if (--leaf->count == 0)
+        {
+            removeLeaf(leaf);
+        }
+
+        _size--;
+
+        // Out of the table first, the unit unlinks itself on destruction.
+        if (_reclaimer)
+        {
+            _reclaimer->retire([this, unit]()
+            {
+                _allocator.destroy(unit);
+            });
+            return;
+        }
+
+        _allocator.destroy(unit);
+    }
+
+    // Not while the table is read concurrently.
+    void clear()
+    {
+        std::vector<JitTranslatorUnit*> units;
+        forEach([&units](JitTranslatorUnit *unit)
+        {
+            units.push_back(unit);
+        });
+
+        for (Leaf *leaf : _leaves)
+        {
+            getSlot(leaf->number).store(nullptr, std::memory_order_relaxed);
+            _leafAllocator.destroy(leaf);
+        }
+        _leaves.clear();
+        _size = 0;
+
+        for (JitTranslatorUnit *unit : units)
+        {
+            _allocator.destroy(unit);
+        }
+    }
+
+    size_t size() const
+    {
+        return _size;
+    }
+
+    // fn must not insert or erase.
+    template<typename F>
+    void forEach(F&& fn) const
+    {
+        for (const Leaf *leaf : _leaves)
+        {
+            for (const std::atomic<JitTranslatorUnit*>& slot : leaf->units)
+            {
+                JitTranslatorUnit *unit = slot.load(std::memory_order_relaxed);
+                if (unit)
+                {
+                    fn(unit);
+                }
+            }
+        }
+    }
+
+private:
+    // Leaf number within the canonical 48 bits.
+    static uint64_t getLeafNumber(uintptr_t vIP)
+    {
+        return ((uint64_t)vIP & ((1ull << k_AddressBits) - 1)) >> k_LeafBits;
+    }
+
+    static size_t getRootIndex(uintptr_t vIP)
+    {
+        return (size_t)(getLeafNumber(vIP) >> k_DirectoryBits);
+    }
+
+    static size_t getLeafIndex(uintptr_t vIP)
+    {
+        return (size_t)(getLeafNumber(vIP) & (k_NumLeaves - 1));
+    }
+
+    // Directory slot of a leaf that exists.
+    std::atomic<Leaf*>& getSlot(uint64_t number)
+    {
+        Directory *directory = _root[number >> k_DirectoryBits].load(std::memory_order_relaxed);
+        return directory->leaves[number & (k_NumLeaves - 1)];
+    }
+
+    void removeLeaf(Leaf *leaf)
+    {
+        getSlot(leaf->number).store(nullptr, std::memory_order_release);
+
+        Leaf *last = _leaves.back();
+        _leaves[leaf->index] = last;
+        last->index = leaf->index;
+        _leaves.pop_back();
+
+        if (_reclaimer)
+        {
+            _reclaimer->retire([this, leaf]()
+            {
+                _leafAllocator.destroy(leaf);
+            });
+            return;
+        }
+
+        _leafAllocator.destroy(leaf);
+    }
+};
+
+}
+
+#endif // _X86BOX_UNITTABLE_H_
@@ -0,0 +1,93 @@
+#ifndef _X86BOX_WRITEWATCH_H_
+#define _X86BOX_WRITEWATCH_H_
+#pragma once
+
+#include "x86box/common.h"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+namespace x86box {
+
+// Write protects the host pages backing translated guest code. The fault
+// handler only flags the page, gives it back its original protection and
+// interrupts the context running in the owning emulator, the units on it
+// are released by the dispatcher. Pages that are not writable are left
+// alone.
+class WriteWatch
+{
+public:
+    enum
+    {
+        // Per emulator, ranges past that are translated but not watched.
+        k_MaxPages = 16384,
+        k_MaxWatches = 64,
+        // Free guest stack the fault needs below the stack pointer where it
+        // is dispatched on that stack.
+        k_StackReserve = 16 * 1024,
+    };
+
+private:
+    // Open addressed set of page addresses, the low bit flags a write.
+    // Only the dispatcher inserts and removes, the fault handler reads and
+    // sets the flag.
+    std::unique_ptr<std::atomic<uintptr_t>[]> _pages;
+    // Protection each slot had before it was watched, set before the slot.
+    std::unique_ptr<uint32_t[]> _protections;
+    std::atomic<std::atomic<uint32_t>*> _interrupt;
+    std::atomic<uint32_t> _written;
+    uint32_t _interruptBit;
+
+public:
+    WriteWatch();
+    ~WriteWatch();
+
+    // Installs the process wide handler on first use.
+    bool enable(uint32_t interruptBit);
+    // Restores the protection of every watched page.
+    void disable();
+
+    bool isEnabled() const
+    {
+        return _pages != nullptr;
+    }
+
+    // Protects the pages spanned by the range, false if some could not be.
+    bool watch(uintptr_t start, size_t size);
+    // Restores the page once no translated code is left on it.
+    void unwatch(uintptr_t page);
+
+    // Guest code runs on the guest stack, the fault handler needs another
+    // one on every thread that runs it. False if none could be set up.
+    bool prepareThread();
+    // False if the fault would be dispatched on a guest stack with less than
+    // k_StackReserve committed and writable bytes below sp.
+    bool hasStackReserve(uintptr_t sp) const;
+
+    // Set while the guest runs, written pages interrupt it.
+    void setInterrupt(std::atomic<uint32_t> *interrupt);
+
+    bool hasWrites() const
+    {
+        return _written.load(std::memory_order_acquire) != 0;
+    }
+
+    // Pages written since the last call, they are writable again and no
+    // longer watched.
+    void takeWrites(std::vector<uintptr_t>& pages);
+
+    static size_t pageSize();
+
+    // Called from the fault handler, true if the page was watched.
+    bool onWrite(uintptr_t address);
+
+private:
+    size_t find(uintptr_t page) const;
+    void release(size_t idx);
+    bool insert(uintptr_t page, uint32_t protection, uint32_t readOnly);
+};
+
+}
+
+#endif // _X86BOX_WRITEWATCH_H_
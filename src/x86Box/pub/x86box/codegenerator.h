@@ -7,10 +7,28 @@
 
 namespace x86box {
 
+// Branches with an immediate operand (jmp, jcc) take the absolute guest
+// target address and end the unit on that path, the exit can then be
+// chained directly to the unit generated for the target. A unit that does
+// not end in a branch stops IEmulator::run as if it executed hlt.
+//
+// jmp/call with a register or memory operand and ret leave through the
+// indirect branch cache. call takes the absolute return address as its
+// second operand (immediate) since instruction lengths are not known here.
 class ICodeGenerator
 {
 public:
+    virtual ~ICodeGenerator() = default;
+
+    // Guest address of the unit being translated.
+    virtual uintptr_t getVirtualIP() const = 0;
+
     virtual bool schedule(const Prefix& prefix, const MnemonicType mnemonic, Operand operands[4]) = 0;
+
+    // Guest bytes the scheduled instructions were decoded from, the unit is
+    // dropped by IEmulator::invalidateRange once any of them change. Blocks
+    // that report nothing only cover their first byte.
+    virtual void addGuestRange(uintptr_t start, size_t size) = 0;
 };
 
 }
@@ -7,20 +7,91 @@
 #include "translator.h"
 #include "translatorunit.h"
 #include "memoryhandler.h"
+#include "statistics.h"
+#include "exitinfo.h"
 
 namespace x86box {
 
 class TranslatorUnit;
 
+// Unit to compile with generateBatch, nullptr uses the translator set
+// with setTranslator. Baseline units translate again with it when they tier
+// up, it has to stay valid as long as they are baseline code.
+struct BatchEntry
+{
+    uintptr_t vIP;
+    ITranslator *translator;
+};
+
 class IEmulator
 {
 public:
+    // Joins the compile workers, emulators are deleted through this.
+    virtual ~IEmulator() = default;
+
     virtual void* getRuntime() const = 0;
 
     virtual TranslatorUnit* findUnit(uintptr_t vIP) = 0;
+    // nullptr if vIP is not a canonical address.
     virtual TranslatorUnit* createUnit(uintptr_t vIP) = 0;
     virtual void releaseUnit(TranslatorUnit *unit) = 0;
     virtual void releaseAllUnits() = 0;
+    // Releases every unit translated from a byte in [start, start + size),
+    // returns how many. Not while run is executing guest code unless the
+    // emulator is thread safe.
+    virtual size_t invalidateRange(uintptr_t start, size_t size) = 0;
+    // Translates the entries and emits their code into a single allocation,
+    // entry points are published together once all of it is in place. vIPs
+    // that already have code or fail to translate are skipped, returns how
+    // many units were generated.
+    virtual size_t generateBatch(const BatchEntry *entries, size_t count) = 0;
+
+    // Used by run to compile units on demand and again for their tier-up.
+    // Baseline units of the previous translator are not tiered up anymore.
+    virtual void setTranslator(ITranslator *translator) = 0;
+    // Zero means unlimited, checked at unit boundaries.
+    virtual void setInstructionBudget(uint64_t budget) = 0;
+    // Entries after which run recompiles a baseline unit with the optimizing
+    // tier in the background, zero compiles everything optimized up front.
+    virtual void setTierUpThreshold(uint32_t count) = 0;
+    // Worker threads for tier-ups and for compiling the successors of new
+    // units ahead of time, zero compiles everything on the calling thread.
+    virtual void setCompileThreads(uint32_t count) = 0;
+    // Reuses generated code across processes through the file at path,
+    // nullptr turns it off. False if an existing file was not usable, it is
+    // replaced once new code is saved.
+    virtual bool setTranslationCache(const char *path) = 0;
+    // Writes code added since the last save, also done on destruction.
+    virtual bool flushTranslationCache() = 0;
+    // Bytes of generated code kept around, the least recently used units
+    // are released once it is exceeded. Zero means unlimited.
+    virtual void setCodeCacheLimit(size_t bytes) = 0;
+    // Write protects the host pages guest code was translated from, writes
+    // to them invalidate the affected units before the next one is entered.
+    // Takes over the SIGSEGV handler (a vectored handler on Windows). False
+    // if the handler could not be installed. On Windows the fault is
+    // dispatched on the guest stack, units are only entered with 16 KB of
+    // committed writable memory below the guest stack pointer and the guest
+    // has to keep that much free while it runs.
+    virtual bool setCodeWriteDetection(bool enable) = 0;
+    // Lets several threads call run at once, each with its own context,
+    // over the same units. Lookups stay lock free, compiling and releasing
+    // units is serialized and released code is only freed once every
+    // running thread went back through its dispatcher. Off by default, only
+    // changed while nothing runs.
+    virtual void setThreadSafe(bool enable) = 0;
+    // Keeps the guest registers in host registers across chained units, the
+    // context is only written back when returning to the host. Releases all
+    // units, only changed while nothing runs. False on 32 bit hosts.
+    virtual bool setRegisterPinning(bool enable) = 0;
+
+    // Executes from ctx.nextIP until an exit condition is hit.
+    virtual ExitInfo run(VContext& ctx, IMemoryHandler *memoryHandler) = 0;
+    // Safe to call from another thread while run is active.
+    virtual void requestStop(VContext& ctx) = 0;
+
+    virtual Statistics getStatistics() const = 0;
+    virtual void resetStatistics() = 0;
 };
 
 } // x86box.
@@ -0,0 +1,36 @@
+#ifndef _X86BOX_EXITINFO_H_
+#define _X86BOX_EXITINFO_H_
+#pragma once
+
+#include "common.h"
+
+namespace x86box {
+
+enum class ExitReason : uint8_t
+{
+    NONE = 0,
+    // Guest executed hlt or a unit ended without a branch.
+    HALT,
+    // No unit exists for vIP and the translator could not produce one.
+    UNMAPPED,
+    // Instruction budget ran out.
+    BUDGET,
+    // requestStop was called on the context.
+    STOP_REQUEST,
+    // Code write detection needs more free stack below the guest stack
+    // pointer, nothing ran.
+    STACK_RESERVE,
+};
+
+struct ExitInfo
+{
+    ExitReason reason;
+    // Where execution would continue, for HALT the unit that halted.
+    uintptr_t vIP;
+    // Guest instructions executed, counted per unit.
+    uint64_t instructions;
+};
+
+}
+
+#endif // _X86BOX_EXITINFO_H_
@@ -0,0 +1,48 @@
+#ifndef _X86BOX_STATISTICS_H_
+#define _X86BOX_STATISTICS_H_
+#pragma once
+
+#include "common.h"
+
+namespace x86box {
+
+// Passes of the optimizing tier in the order they run.
+enum class OptimizerPass : uint8_t
+{
+    LOAD_ELIMINATION = 0,
+    CONSTANT_PROPAGATION,
+    COPY_PROPAGATION,
+    DEAD_CODE_ELIMINATION,
+    // Over the host instructions once they are emitted.
+    PEEPHOLE,
+    COUNT,
+};
+
+struct Statistics
+{
+    // Dispatch cache in front of the unit map.
+    uint64_t dispatchHits;
+    uint64_t dispatchMisses;
+    // Inline target cache probed by indirect exits.
+    uint64_t indirectHits;
+    uint64_t indirectMisses;
+    // Guest ret predicted by the shadow stack.
+    uint64_t returnHits;
+    uint64_t returnMisses;
+    // Compiles served from the translation cache.
+    uint64_t translationCacheHits;
+    uint64_t translationCacheMisses;
+    // Generated code currently held and units released to stay below the limit.
+    uint64_t codeBytes;
+    uint64_t evictedUnits;
+    // Watched code pages written to, each invalidated the units on it.
+    uint64_t codeWrites;
+    // Nanoseconds spent in each optimizer pass and the instructions it
+    // rewrote or removed, indexed by OptimizerPass.
+    uint64_t passTime[(size_t)OptimizerPass::COUNT];
+    uint64_t passChanges[(size_t)OptimizerPass::COUNT];
+};
+
+}
+
+#endif // _X86BOX_STATISTICS_H_
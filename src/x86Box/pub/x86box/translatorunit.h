@@ -12,32 +12,31 @@ namespace x86box {
 
 class IEmulator;
 
-class TranslatorUnit
+enum class CompileTier : uint8_t
 {
-    typedef void(*fnJitFunction)(VContext& ctx);
-
-private:
-    IEmulator * _parent;
-    uintptr_t _virtualIP;
-    std::unique_ptr<ICodeGenerator> _generator;
-    fnJitFunction _func;
+    // Single pass through the assembler, the context usage is analysed on
+    // the scheduled instructions.
+    BASELINE = 0,
+    // Builder plus context usage analysis.
+    OPTIMIZING,
+};
 
+class TranslatorUnit
+{
 public:
-    TranslatorUnit(IEmulator* emulator, uintptr_t vIP);
-    virtual ~TranslatorUnit();
+    virtual ~TranslatorUnit() = default;
 
-    virtual uintptr_t getVirtualIP() const
-    {
-        return _virtualIP;
-    }
+    virtual uintptr_t getVirtualIP() const = 0;
 
-    virtual bool generate(ITranslator *translator);
+    // Baseline code is translated again with translator once it is hot, it
+    // has to stay valid until the unit is reset or generated again.
+    virtual bool generate(ITranslator *translator, CompileTier tier = CompileTier::OPTIMIZING) = 0;
 
-    virtual bool isGenerated() const;
+    virtual bool isGenerated() const = 0;
 
-    virtual bool execute(VContext& ctx, IMemoryHandler *memoryHandler);
+    virtual bool execute(VContext& ctx, IMemoryHandler *memoryHandler) = 0;
 
-    virtual void reset();
+    virtual void reset() = 0;
 };
 
 }
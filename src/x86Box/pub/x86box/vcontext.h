@@ -10,7 +10,7 @@ namespace x86box {
 #pragma pack(push, 1)
 struct VContext
 {
-    enum { k_InternalSize = 0x100 };
+    enum { k_InternalSize = 0x400 };
 
     uintptr_t flags;
 #ifdef _AMD64_
@@ -18,6 +18,8 @@ struct VContext
 #else 
     GPReg gpRegs[8];
 #endif
+    // Guest address where execution continues, written by unit exits.
+    uintptr_t nextIP;
 
     uint8_t _reserved[k_InternalSize];
 };
@@ -2,22 +2,174 @@
 
 namespace x86box {
 
-static std::map<x86box::MnemonicType, uint32_t> mnemonicTranslateion =
+using asmjit::x86::Inst;
+namespace InstDB = asmjit::x86::InstDB;
+
+// Special registers the context of a unit holds, EFLAGS.
+const uint32_t k_ContextSpecialRegs = asmjit::x86::kSpecialReg_FLAGS_CF | asmjit::x86::kSpecialReg_FLAGS_PF |
+    asmjit::x86::kSpecialReg_FLAGS_AF | asmjit::x86::kSpecialReg_FLAGS_ZF | asmjit::x86::kSpecialReg_FLAGS_SF |
+    asmjit::x86::kSpecialReg_FLAGS_TF | asmjit::x86::kSpecialReg_FLAGS_IF | asmjit::x86::kSpecialReg_FLAGS_DF |
+    asmjit::x86::kSpecialReg_FLAGS_OF | asmjit::x86::kSpecialReg_FLAGS_AC | asmjit::x86::kSpecialReg_FLAGS_SYS;
+
+// Flags the guest must not set on the host.
+const uint32_t k_SystemFlags = asmjit::x86::kSpecialReg_FLAGS_TF | asmjit::x86::kSpecialReg_FLAGS_IF |
+    asmjit::x86::kSpecialReg_FLAGS_AC | asmjit::x86::kSpecialReg_FLAGS_SYS;
+
+const uint32_t k_GpOperands = InstDB::kOpGpbLo | InstDB::kOpGpbHi | InstDB::kOpGpw | InstDB::kOpGpd | InstDB::kOpGpq;
+
+#ifdef _M_X64
+const uint32_t k_HostArchMask = InstDB::kArchMaskX64;
+#else
+const uint32_t k_HostArchMask = InstDB::kArchMaskX86;
+#endif
+
+const size_t k_NumMnemonics = sizeof(MNEMONICS) / sizeof(MNEMONICS[0]);
+
+// Uses host state that is not part of the context without naming it in an
+// operand, or traps.
+bool isHostStateInstruction(uint32_t instrId)
 {
-    { MnemonicType::I_SUB, asmjit::x86::Inst::kIdSub },
-    { MnemonicType::I_ADD, asmjit::x86::Inst::kIdAdd },
-    { MnemonicType::I_MOV, asmjit::x86::Inst::kIdMov },
-    { MnemonicType::I_PUSH, asmjit::x86::Inst::kIdPush },
-    { MnemonicType::I_LEA, asmjit::x86::Inst::kIdLea },
-    { MnemonicType::I_CMP, asmjit::x86::Inst::kIdCmp },
-    { MnemonicType::I_TEST, asmjit::x86::Inst::kIdTest },
-    { MnemonicType::I_XOR, asmjit::x86::Inst::kIdXor },
-    { MnemonicType::I_AND, asmjit::x86::Inst::kIdAnd },
-    { MnemonicType::I_NOT, asmjit::x86::Inst::kIdNot },
-    { MnemonicType::I_NEG, asmjit::x86::Inst::kIdNeg },
-    { MnemonicType::I_SHL, asmjit::x86::Inst::kIdShl },
-    { MnemonicType::I_SHR, asmjit::x86::Inst::kIdShr },
-};
+    switch (instrId)
+    {
+    // FPU and vector state.
+    case Inst::kIdFemms:
+    case Inst::kIdFxsave:
+    case Inst::kIdFxrstor:
+    case Inst::kIdLdmxcsr:
+    case Inst::kIdStmxcsr:
+    // Segments and descriptor tables.
+    case Inst::kIdLfs:
+    case Inst::kIdLgs:
+    case Inst::kIdLss:
+    case Inst::kIdLar:
+    case Inst::kIdLsl:
+    case Inst::kIdVerr:
+    case Inst::kIdVerw:
+    case Inst::kIdSgdt:
+    case Inst::kIdSidt:
+    case Inst::kIdSldt:
+    case Inst::kIdSmsw:
+    case Inst::kIdStr:
+    // Ports, system calls and traps.
+    case Inst::kIdIn:
+    case Inst::kIdIns:
+    case Inst::kIdOut:
+    case Inst::kIdOuts:
+    case Inst::kIdInt:
+    case Inst::kIdInt3:
+    case Inst::kIdSyscall:
+    case Inst::kIdSysenter:
+    case Inst::kIdUd2:
+    // Could set the trap flag.
+    case Inst::kIdPopf:
+    case Inst::kIdPopfd:
+    case Inst::kIdPopfq:
+    // Every general purpose register without naming one, units only carry
+    // the registers they see.
+    case Inst::kIdPusha:
+    case Inst::kIdPushad:
+    case Inst::kIdPopa:
+    case Inst::kIdPopad:
+        return true;
+    }
+    return false;
+}
+
+// Host instruction of the same name if it does the same with the guest
+// state a unit carries, general purpose registers, flags and memory.
+uint32_t getHostInstruction(const char *name)
+{
+    uint32_t instrId = InstDB::idByName(name);
+    if (instrId == Inst::kIdNone)
+        return Inst::kIdNone;
+
+    const InstDB::InstInfo& info = InstDB::infoById(instrId);
+    if (info.hasFlag(InstDB::kFlagPrivileged | InstDB::kFlagFpu | InstDB::kFlagMmx | InstDB::kFlagVec |
+        InstDB::kFlagVex | InstDB::kFlagEvex))
+    {
+        return Inst::kIdNone;
+    }
+
+    // The FPU ones show up here as well.
+    const InstDB::ExecutionInfo& execInfo = info.executionInfo();
+    if (((execInfo.specialRegsR() | execInfo.specialRegsW()) & ~k_ContextSpecialRegs) ||
+        (execInfo.specialRegsW() & k_SystemFlags))
+    {
+        return Inst::kIdNone;
+    }
+
+    // Branches become exits, nothing else may leave the unit.
+    if (info.controlType() != Inst::kControlNone && instrId != Inst::kIdJmp && !isBranchInstruction(instrId))
+    {
+        return Inst::kIdNone;
+    }
+
+    if (isHostStateInstruction(instrId))
+    {
+        return Inst::kIdNone;
+    }
+
+    // Needs a form on this host without other registers.
+    const uint32_t otherOperands = (InstDB::kOpAllRegs & ~k_GpOperands) | InstDB::kOpVm;
+    for (const InstDB::InstSignature *sig = info.signatureData(); sig != info.signatureEnd(); sig++)
+    {
+        if (!(sig->archMask & k_HostArchMask))
+            continue;
+
+        bool gpOnly = true;
+        for (uint32_t n = 0; n < sig->opCount; n++)
+        {
+            if (InstDB::_opSignatureTable[sig->operands[n]].opFlags & otherOperands)
+                gpOnly = false;
+        }
+        if (gpOnly)
+            return instrId;
+    }
+
+    return Inst::kIdNone;
+}
+
+std::array<uint32_t, k_NumMnemonics> buildMnemonicTranslation()
+{
+    std::array<uint32_t, k_NumMnemonics> table;
+    for (size_t i = 0; i < k_NumMnemonics; i++)
+    {
+        table[i] = getHostInstruction(MNEMONICS[i]);
+    }
+
+    // Named like the near forms.
+    table[(size_t)MnemonicType::I_JMP_FAR] = Inst::kIdNone;
+    table[(size_t)MnemonicType::I_CALL_FAR] = Inst::kIdNone;
+
+    return table;
+}
+
+// Indexed by MnemonicType. Filled once on startup, asmjit keeps the names
+// in its own translation unit where constant evaluation can not reach them.
+static const std::array<uint32_t, k_NumMnemonics> mnemonicTranslation = buildMnemonicTranslation();
+
+uint32_t getOperandSizeBytes(OperandSize size)
+{
+    switch (size)
+    {
+    case OperandSize::SIZE_8:
+        return 1;
+    case OperandSize::SIZE_16:
+        return 2;
+    case OperandSize::SIZE_32:
+        return 4;
+    case OperandSize::SIZE_64:
+        return 8;
+    case OperandSize::SIZE_128:
+        return 16;
+    case OperandSize::SIZE_256:
+        return 32;
+    case OperandSize::SIZE_512:
+        return 64;
+    }
+    // Auto, let the other operands decide.
+    return 0;
+}
 
 asmjit::Operand convertOperandImm(const Operand& op)
 {
@@ -140,6 +292,7 @@ asmjit::Operand convertOperandMem(const Operand& op)
         mem.setIndex(convertReg(op.mem.regIndex, op.mem.addressSize));
     }
     mem.setOffsetLo32(op.mem.disp.i32);
+    mem.setSize(getOperandSizeBytes(op.size));
 
     return mem;
 }
@@ -158,13 +311,17 @@ asmjit::Operand convertOperand(const Operand& op)
     return asmjit::Operand();
 }
 
-uint32_t convertMnemonic(MnemonicType mnemonic)
+bool isBranchInstruction(uint32_t instrId)
 {
-    auto it = mnemonicTranslateion.find(mnemonic);
-    if(it != mnemonicTranslateion.end())
-        return it->second;
+    if (instrId == asmjit::x86::Inst::kIdJecxz)
+        return false;
+
+    return instrId >= asmjit::x86::Inst::kIdJa && instrId <= asmjit::x86::Inst::kIdJz;
+}
 
-    return asmjit::x86::Inst::kIdNone;
+uint32_t convertMnemonic(MnemonicType mnemonic)
+{
+    return mnemonicTranslation[(size_t)mnemonic];
 }
 
 }
@@ -0,0 +1,191 @@
+#include "compilepool.h"
+#include "jitcodegenerator.h"
+#include "jitemulator.h"
+
+namespace x86box {
+
+CompilePool::CompilePool(JitEmulator *emulator)
+    : _emulator(emulator),
+    _threadCount(k_DefaultThreads),
+    _active(0),
+    _shutdown(false)
+{
+}
+
+CompilePool::~CompilePool()
+{
+    shutdown();
+}
+
+void CompilePool::setThreadCount(uint32_t count)
+{
+    if (count == _threadCount)
+        return;
+
+    stopWorkers();
+    _threadCount = count;
+
+    std::unique_lock<std::mutex> lock(_lock);
+    if (!_jobs.empty())
+    {
+        startWorkers();
+    }
+
+    // Nobody would pick up what is left.
+    while (_threadCount == 0 && !_jobs.empty())
+    {
+        Job job = std::move(_jobs.front());
+        _jobs.pop_front();
+
+        lock.unlock();
+        Result result = compileHere(job);
+        lock.lock();
+
+        _results.push_back(std::move(result));
+    }
+}
+
+void CompilePool::enqueue(Job&& job)
+{
+    if (_threadCount == 0)
+    {
+        Result result = compileHere(job);
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _results.push_back(std::move(result));
+        }
+        _emulator->onCodeReady();
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (_shutdown)
+        return;
+
+    startWorkers();
+
+    _jobs.push_back(std::move(job));
+    _wake.notify_one();
+}
+
+void CompilePool::takeResults(std::vector<Result>& results)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    for (Result& result : _results)
+    {
+        results.push_back(std::move(result));
+    }
+    _results.clear();
+}
+
+bool CompilePool::waitForResults()
+{
+    std::unique_lock<std::mutex> lock(_lock);
+
+    _done.wait(lock, [this]() { return !_results.empty() || (_jobs.empty() && _active == 0) || _threads.empty(); });
+
+    return !_results.empty();
+}
+
+void CompilePool::startWorkers()
+{
+    while (_threads.size() < _threadCount)
+    {
+        _threads.emplace_back(&CompilePool::workerLoop, this);
+    }
+}
+
+void CompilePool::stopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _shutdown = true;
+        _wake.notify_all();
+    }
+
+    for (std::thread& thread : _threads)
+    {
+        thread.join();
+    }
+    _threads.clear();
+
+    std::lock_guard<std::mutex> lock(_lock);
+    _shutdown = false;
+}
+
+void CompilePool::shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        _jobs.clear();
+    }
+
+    stopWorkers();
+
+    std::lock_guard<std::mutex> lock(_lock);
+    _shutdown = true;
+}
+
+CompilePool::Result CompilePool::compileJob(Job& job, JitCodeGenerator& generator)
+{
+    generator.reset(job.vIP);
+    for (Instruction& instr : job.source)
+    {
+        generator.schedule(instr.prefix, instr.mnemonic, instr.operands);
+    }
+
+    Result result;
+    result.unit = job.unit;
+    result.vIP = job.vIP;
+    result.serial = job.serial;
+    result.compiled = generator.compile(job.tier, job.execCounter, result.code);
+
+    return result;
+}
+
+CompilePool::Result CompilePool::compileHere(Job& job)
+{
+    JitCodeGenerator *generator = _emulator->acquireGenerator(job.vIP);
+    Result result = compileJob(job, *generator);
+    _emulator->releaseGenerator(generator);
+
+    return result;
+}
+
+void CompilePool::workerLoop()
+{
+    // Reused for every job, it keeps the capacity of its buffers.
+    JitCodeGenerator generator(_emulator, 0);
+
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(_lock);
+            _wake.wait(lock, [this]() { return _shutdown || !_jobs.empty(); });
+
+            // Queued jobs stay for whoever runs next.
+            if (_shutdown)
+                return;
+
+            job = std::move(_jobs.front());
+            _jobs.pop_front();
+            _active++;
+        }
+
+        Result result = compileJob(job, generator);
+
+        {
+            std::lock_guard<std::mutex> lock(_lock);
+            _results.push_back(std::move(result));
+            _active--;
+            _done.notify_all();
+        }
+
+        _emulator->onCodeReady();
+    }
+}
+
+}
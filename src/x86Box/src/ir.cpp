@@ -0,0 +1,566 @@
+#include "ir.h"
+#include "asmjittranslate.h"
+
+#include <string.h>
+
+namespace x86box {
+
+const uint32_t k_RegSp = 4;
+const uint8_t k_NoHome = IRUnit::k_NumRegs;
+
+bool isFullSize(OperandSize size)
+{
+    return size == OperandSize::SIZE_32 || size == OperandSize::SIZE_64 || size == OperandSize::SIZE_AUTO;
+}
+
+uint16_t getRegBit(RegisterIndex reg)
+{
+    if (reg < RegisterIndex::GP_REG0 || reg > RegisterIndex::GP_REG15)
+        return 0;
+
+    return (uint16_t)(1u << getLocalRegisterId(reg));
+}
+
+// Registers forming the address of a memory operand.
+uint16_t getAddressRegs(const Operand& op)
+{
+    if (op.type != OperandType::MEMORY)
+        return 0;
+
+    return getRegBit(op.mem.regBase) | getRegBit(op.mem.regIndex);
+}
+
+uint16_t getOperandRegs(const Operand& op)
+{
+    if (op.type == OperandType::REG)
+        return getRegBit(op.reg.reg);
+
+    return getAddressRegs(op);
+}
+
+// Only gp registers, immediates and memory are understood.
+bool isSimpleOperand(const Operand& op)
+{
+    if (op.type == OperandType::REG)
+        return IRUnit::getRegId(op) != -1;
+
+    return true;
+}
+
+// Sign extended like the encodings of 32 bit instructions do.
+uint32_t getImmValue(const Operand& op)
+{
+    switch (op.size)
+    {
+    case OperandSize::SIZE_8:
+        return (uint32_t)(int32_t)op.imm.val.i8;
+    case OperandSize::SIZE_16:
+        return (uint32_t)(int32_t)op.imm.val.i16;
+    }
+    return op.imm.val.u32;
+}
+
+bool isExit(const Instruction& instr, bool& noReturn)
+{
+    switch (instr.mnemonic)
+    {
+    case MnemonicType::I_HLT:
+    case MnemonicType::I_RET:
+    case MnemonicType::I_CALL:
+    case MnemonicType::I_JMP:
+        noReturn = true;
+        return true;
+    }
+    noReturn = false;
+    return isBranchInstruction(convertMnemonic(instr.mnemonic));
+}
+
+// 32 bit result of the operation, false if it is not folded.
+bool evaluate(MnemonicType mnemonic, uint32_t a, uint32_t b, uint32_t& res)
+{
+    switch (mnemonic)
+    {
+    case MnemonicType::I_ADD:
+        res = a + b;
+        return true;
+    case MnemonicType::I_SUB:
+        res = a - b;
+        return true;
+    case MnemonicType::I_AND:
+        res = a & b;
+        return true;
+    case MnemonicType::I_XOR:
+        res = a ^ b;
+        return true;
+    case MnemonicType::I_SHL:
+        res = a << (b & 0x1F);
+        return true;
+    case MnemonicType::I_SHR:
+        res = a >> (b & 0x1F);
+        return true;
+    }
+    return false;
+}
+
+void IRUnit::analyse(std::vector<Instruction>& instrs)
+{
+    _instrs = &instrs;
+    _insts.resize(instrs.size());
+
+    analyseValues();
+    analyseLiveness();
+}
+
+uint32_t IRUnit::newValue(uint8_t home, bool narrow)
+{
+    uint32_t id = (uint32_t)_values.size();
+
+    Value value = {};
+    value.root = id;
+    value.home = home;
+    value.narrow = narrow;
+    _values.push_back(value);
+
+    return id;
+}
+
+uint32_t IRUnit::newConst(uint8_t home, uint32_t constant)
+{
+    uint32_t id = newValue(home, true);
+    _values[id].isConst = true;
+    _values[id].constant = constant;
+
+    return id;
+}
+
+uint32_t IRUnit::findLoad(const Operand& op, const uint32_t *regs) const
+{
+    uint32_t base = op.mem.regBase != RegisterIndex::NONE ? regs[getLocalRegisterId(op.mem.regBase)] : 0;
+    uint32_t index = op.mem.regIndex != RegisterIndex::NONE ? regs[getLocalRegisterId(op.mem.regIndex)] : 0;
+
+    for (const Load_t& load : _loads)
+    {
+        if (load.base != base || load.index != index)
+            continue;
+
+        const Operand& other = load.op;
+        if (other.size == op.size && other.mem.addressSize == op.mem.addressSize &&
+            other.mem.segment == op.mem.segment && other.mem.scale == op.mem.scale &&
+            other.mem.disp.i32 == op.mem.disp.i32)
+        {
+            return load.value;
+        }
+    }
+
+    return 0;
+}
+
+void IRUnit::addLoad(const Operand& op, const uint32_t *regs, uint32_t value)
+{
+    Load_t load;
+    load.op = op;
+    load.base = op.mem.regBase != RegisterIndex::NONE ? regs[getLocalRegisterId(op.mem.regBase)] : 0;
+    load.index = op.mem.regIndex != RegisterIndex::NONE ? regs[getLocalRegisterId(op.mem.regIndex)] : 0;
+    load.value = value;
+    _loads.push_back(load);
+}
+
+void IRUnit::analyseValues()
+{
+    _values.clear();
+    _loads.clear();
+
+    // Zero is no value.
+    newValue(k_NoHome, false);
+
+    uint32_t regs[k_NumRegs];
+    auto resetRegs = [&]()
+    {
+        for (uint32_t reg = 0; reg < k_NumRegs; reg++)
+        {
+            regs[reg] = newValue((uint8_t)reg, false);
+        }
+        _loads.clear();
+    };
+    resetRegs();
+
+    for (size_t i = 0; i < _insts.size(); i++)
+    {
+        const Instruction& instr = (*_instrs)[i];
+        const Operand& dst = instr.operands[0];
+        const Operand& src = instr.operands[1];
+
+        Inst& inst = _insts[i];
+        inst = {};
+        memcpy(inst.in, regs, sizeof(regs));
+
+        bool noReturn;
+        if (isExit(instr, noReturn))
+        {
+            inst.effects = k_EffectExit | k_EffectFlagsRead | k_EffectMemRead | k_EffectMemWrite;
+            inst.uses = k_AllRegs;
+            if (noReturn)
+            {
+                inst.effects |= k_EffectNoReturn;
+                resetRegs();
+            }
+            continue;
+        }
+
+        bool modeled = instr.prefix == Prefix::NONE &&
+            isSimpleOperand(dst) && isSimpleOperand(src) &&
+            instr.operands[2].type == OperandType::NONE && instr.operands[3].type == OperandType::NONE;
+
+        int32_t dstReg = getRegId(dst);
+        int32_t srcReg = getRegId(src);
+
+        // Leaves value in the destination register.
+        auto writeReg = [&](uint32_t value)
+        {
+            inst.def = value;
+            regs[dstReg] = value;
+            if (isFullSize(dst.size))
+                inst.defs |= 1u << dstReg;
+            else
+                inst.uses |= 1u << dstReg;
+        };
+        auto writeFresh = [&]()
+        {
+            writeReg(newValue((uint8_t)dstReg, dst.size == OperandSize::SIZE_32));
+        };
+        auto writeMem = [&]()
+        {
+            inst.effects |= k_EffectMemWrite;
+            _loads.clear();
+        };
+
+        if (modeled)
+        {
+            inst.effects = k_EffectModeled;
+            if (src.type == OperandType::MEMORY && instr.mnemonic != MnemonicType::I_LEA)
+                inst.effects |= k_EffectMemRead;
+
+            switch (instr.mnemonic)
+            {
+            case MnemonicType::I_NOP:
+                break;
+            case MnemonicType::I_MOV:
+                inst.uses |= getOperandRegs(src) | getAddressRegs(dst);
+                if (dstReg != -1)
+                {
+                    bool sameSize = src.size == dst.size;
+                    if (dst.size == OperandSize::SIZE_32 && src.type == OperandType::IMM)
+                    {
+                        writeReg(newConst((uint8_t)dstReg, getImmValue(src)));
+                    }
+                    else if (sameSize && srcReg != -1 && isFullSize(dst.size))
+                    {
+                        const Value& value = _values[regs[srcReg]];
+                        if (dst.size != OperandSize::SIZE_32 || value.narrow)
+                        {
+                            // Same value under another name.
+                            writeReg(regs[srcReg]);
+                        }
+                        else
+                        {
+                            // Zero extended, only the lower half is shared.
+                            uint32_t root = value.root;
+                            writeFresh();
+                            _values[inst.def].root = root;
+                        }
+                    }
+                    else if (sameSize && src.type == OperandType::MEMORY && isFullSize(dst.size))
+                    {
+                        // Reading the same address again yields the same value.
+                        uint32_t value = findLoad(src, regs);
+                        if (value == 0)
+                        {
+                            writeFresh();
+                            addLoad(src, inst.in, inst.def);
+                        }
+                        else
+                        {
+                            writeReg(value);
+                        }
+                    }
+                    else
+                    {
+                        writeFresh();
+                    }
+                }
+                else
+                {
+                    writeMem();
+
+                    // The stored value is what a load reads back.
+                    if (dst.size == OperandSize::SIZE_32 && src.type == OperandType::IMM)
+                    {
+                        addLoad(dst, regs, newConst(k_NoHome, getImmValue(src)));
+                    }
+                    else if (srcReg != -1 && src.size == dst.size && isFullSize(dst.size) &&
+                        (dst.size != OperandSize::SIZE_32 || _values[regs[srcReg]].narrow))
+                    {
+                        addLoad(dst, regs, regs[srcReg]);
+                    }
+                }
+                break;
+            case MnemonicType::I_LEA:
+                if (dstReg == -1 || !isFullSize(dst.size) || src.type != OperandType::MEMORY)
+                {
+                    modeled = false;
+                    break;
+                }
+                inst.uses |= getAddressRegs(src);
+                writeFresh();
+                break;
+            case MnemonicType::I_ADD:
+            case MnemonicType::I_SUB:
+            case MnemonicType::I_AND:
+            case MnemonicType::I_XOR:
+            {
+                inst.effects |= k_EffectFlagsWrite | k_EffectFlagsKill;
+                inst.uses |= getOperandRegs(src) | getAddressRegs(dst);
+
+                if (dstReg == -1)
+                {
+                    inst.effects |= k_EffectMemRead;
+                    writeMem();
+                    break;
+                }
+
+                bool zeroIdiom = (instr.mnemonic == MnemonicType::I_XOR || instr.mnemonic == MnemonicType::I_SUB) &&
+                    srcReg == dstReg && src.size == dst.size && dst.size == OperandSize::SIZE_32;
+                if (zeroIdiom)
+                {
+                    // Does not depend on the register.
+                    inst.uses &= ~(1u << dstReg);
+                    writeReg(newConst((uint8_t)dstReg, 0));
+                    break;
+                }
+
+                inst.uses |= 1u << dstReg;
+
+                const Value& a = _values[regs[dstReg]];
+                bool srcConst = src.type == OperandType::IMM ||
+                    (srcReg != -1 && src.size == OperandSize::SIZE_32 && _values[regs[srcReg]].isConst);
+                uint32_t b = src.type == OperandType::IMM ? getImmValue(src) : srcReg != -1 ? _values[regs[srcReg]].constant : 0;
+
+                uint32_t res;
+                if (dst.size == OperandSize::SIZE_32 && a.isConst && srcConst && evaluate(instr.mnemonic, a.constant, b, res))
+                {
+                    writeReg(newConst((uint8_t)dstReg, res));
+                }
+                else
+                {
+                    writeFresh();
+                }
+                break;
+            }
+            case MnemonicType::I_CMP:
+            case MnemonicType::I_TEST:
+                inst.effects |= k_EffectFlagsWrite | k_EffectFlagsKill;
+                inst.uses |= getOperandRegs(dst) | getOperandRegs(src);
+                if (dst.type == OperandType::MEMORY)
+                    inst.effects |= k_EffectMemRead;
+                break;
+            case MnemonicType::I_NOT:
+            case MnemonicType::I_NEG:
+            {
+                bool isNeg = instr.mnemonic == MnemonicType::I_NEG;
+                if (isNeg)
+                    inst.effects |= k_EffectFlagsWrite | k_EffectFlagsKill;
+
+                inst.uses |= getOperandRegs(dst);
+                if (dstReg == -1)
+                {
+                    inst.effects |= k_EffectMemRead;
+                    writeMem();
+                    break;
+                }
+
+                const Value& a = _values[regs[dstReg]];
+                if (dst.size == OperandSize::SIZE_32 && a.isConst)
+                    writeReg(newConst((uint8_t)dstReg, isNeg ? 0u - a.constant : ~a.constant));
+                else
+                    writeFresh();
+                break;
+            }
+            case MnemonicType::I_SHL:
+            case MnemonicType::I_SHR:
+            {
+                inst.uses |= getOperandRegs(dst) | getOperandRegs(src);
+
+                bool countConst = false;
+                uint32_t count = 0;
+                if (src.type == OperandType::IMM)
+                {
+                    countConst = true;
+                    count = src.imm.val.u8;
+                }
+                else if (srcReg == 1 && src.size == OperandSize::SIZE_8 && src.reg.pos == OperandPosition::LOW)
+                {
+                    countConst = _values[regs[srcReg]].isConst;
+                    count = _values[regs[srcReg]].constant & 0xFF;
+                }
+                else
+                {
+                    modeled = false;
+                    break;
+                }
+
+                // Only 64 bit shifts take six count bits, narrower ones mask
+                // with 0x1F like 32 bit ones do.
+                bool wide = dst.size == OperandSize::SIZE_64 || (dst.size == OperandSize::SIZE_AUTO && sizeof(void*) == 8);
+                uint32_t countMask = wide ? 0x3F : 0x1F;
+                if (src.type != OperandType::IMM || (count & countMask) != 0)
+                    inst.effects |= k_EffectFlagsWrite;
+                // A register count may be zero, the flags stay then.
+                if (src.type == OperandType::IMM && (count & countMask) != 0)
+                    inst.effects |= k_EffectFlagsKill;
+
+                if (dstReg == -1)
+                {
+                    inst.effects |= k_EffectMemRead;
+                    writeMem();
+                    break;
+                }
+
+                uint32_t res;
+                const Value& a = _values[regs[dstReg]];
+                if (countConst && (count & countMask) == 0 && isFullSize(dst.size))
+                {
+                    // Leaves the value alone, a 32 bit destination is still
+                    // zero extended.
+                    uint32_t root = a.root;
+                    if (dst.size != OperandSize::SIZE_32 || a.narrow)
+                    {
+                        writeReg(regs[dstReg]);
+                    }
+                    else
+                    {
+                        writeFresh();
+                        _values[inst.def].root = root;
+                    }
+                }
+                else if (dst.size == OperandSize::SIZE_32 && a.isConst && countConst && evaluate(instr.mnemonic, a.constant, count, res))
+                {
+                    writeReg(newConst((uint8_t)dstReg, res));
+                }
+                else
+                {
+                    writeFresh();
+                }
+                break;
+            }
+            case MnemonicType::I_PUSH:
+                inst.uses |= getOperandRegs(dst) | (1u << k_RegSp);
+                if (dst.type == OperandType::MEMORY)
+                    inst.effects |= k_EffectMemRead;
+                writeMem();
+                regs[k_RegSp] = newValue((uint8_t)k_RegSp, false);
+                break;
+            default:
+                modeled = false;
+                break;
+            }
+        }
+
+        if (!modeled)
+        {
+            // Could touch anything, nothing was recorded for it yet.
+            inst = {};
+            memcpy(inst.in, regs, sizeof(regs));
+            inst.effects = k_EffectFlagsRead | k_EffectFlagsWrite | k_EffectMemRead | k_EffectMemWrite;
+            inst.uses = k_AllRegs;
+            resetRegs();
+        }
+    }
+}
+
+void IRUnit::analyseLiveness()
+{
+    // Falling off the end leaves the unit.
+    uint32_t live = k_AllRegs;
+    bool flags = true;
+
+    for (size_t i = _insts.size(); i-- > 0;)
+    {
+        Inst& inst = _insts[i];
+        inst.liveOut = (uint16_t)live;
+        inst.flagsLiveOut = flags;
+
+        if (inst.effects & k_EffectExit)
+        {
+            live = k_AllRegs;
+            flags = true;
+            continue;
+        }
+
+        live = (live & ~inst.defs) | inst.uses;
+        if (inst.effects & k_EffectFlagsKill)
+            flags = false;
+        if (inst.effects & k_EffectFlagsRead)
+            flags = true;
+    }
+}
+
+int32_t IRUnit::findRegister(size_t i, uint32_t v, bool exact) const
+{
+    const Inst& inst = _insts[i];
+
+    int32_t found = -1;
+    for (uint32_t reg = 0; reg < k_NumRegs; reg++)
+    {
+        if (reg == k_RegSp)
+            continue;
+
+        if (inst.in[reg] == v)
+            return (int32_t)reg;
+
+        if (!exact && found == -1 && _values[inst.in[reg]].root == _values[v].root)
+            found = (int32_t)reg;
+    }
+
+    return found;
+}
+
+void IRUnit::remove(size_t i)
+{
+    Instruction& instr = (*_instrs)[i];
+    instr.prefix = Prefix::NONE;
+    instr.mnemonic = MnemonicType::I_NOP;
+    memset(instr.operands, 0, sizeof(instr.operands));
+}
+
+Operand IRUnit::makeReg(uint32_t id, OperandSize size)
+{
+    Operand op;
+    memset(&op, 0, sizeof(op));
+    op.type = OperandType::REG;
+    op.size = size;
+    op.reg.reg = (RegisterIndex)((uint32_t)RegisterIndex::GP_REG0 + id);
+    op.reg.pos = OperandPosition::LOW;
+
+    return op;
+}
+
+Operand IRUnit::makeImm(uint32_t val, OperandSize size)
+{
+    Operand op;
+    memset(&op, 0, sizeof(op));
+    op.type = OperandType::IMM;
+    op.size = size;
+    op.imm.val.u32 = val;
+
+    return op;
+}
+
+int32_t IRUnit::getRegId(const Operand& op)
+{
+    if (op.type != OperandType::REG || getRegBit(op.reg.reg) == 0)
+        return -1;
+
+    return (int32_t)getLocalRegisterId(op.reg.reg);
+}
+
+}
@@ -1,174 +1,1926 @@
 #include "jitcodegenerator.h"
+#include "jitemulator.h"
 #include "asmjittranslate.h"
+#include "tracebuilder.h"
 
 namespace x86box {
 
-JitCodeGenerator::JitCodeGenerator()
+// Registers of a 32 bit guest except esp, pinned units hand the context to
+// each other in r15.
+const uint32_t k_PinnedRegs = 0xEF;
+const uint32_t k_PinnedBase = asmjit::x86::Gp::kIdR15;
+
+JitCodeGenerator::JitCodeGenerator(JitEmulator *emulator, uintptr_t vIP)
+    : _emulator(emulator),
+    _virtualIP(vIP),
+    _blockIP(vIP),
+    _optimized(false)
+{
+}
+
+bool JitCodeGenerator::schedule(const Prefix& prefix, const MnemonicType mnemonic, Operand operands[4])
+{
+    _scheduled.emplace_back(prefix, mnemonic, operands);
+
+    return true;
+}
+
+void JitCodeGenerator::addGuestRange(uintptr_t start, size_t size)
+{
+    if (size == 0)
+        return;
+
+    _ranges.push_back({ start, size });
+}
+
+bool JitCodeGenerator::getGuestRanges(ArenaArray<JitTranslatorUnit::GuestRange>& ranges) const
+{
+    auto isReported = [this](uintptr_t vIP)
+    {
+        for (const JitTranslatorUnit::GuestRange& range : _ranges)
+        {
+            if (vIP >= range.start && vIP - range.start < range.size)
+                return true;
+        }
+        return false;
+    };
+
+    // Counted first, the arena hands out exactly that.
+    size_t count = _ranges.size();
+    if (_blocks.empty() && !isReported(_virtualIP))
+    {
+        count++;
+    }
+    for (const Block_t& block : _blocks)
+    {
+        if (!isReported(block.vIP))
+        {
+            count++;
+        }
+    }
+
+    if (!_emulator->getUnitArena().allocate(ranges, count))
+        return false;
+
+    size_t n = 0;
+    for (const JitTranslatorUnit::GuestRange& range : _ranges)
+    {
+        ranges[n++] = range;
+    }
+
+    auto addBlock = [&](uintptr_t vIP)
+    {
+        if (!isReported(vIP))
+        {
+            ranges[n++] = { vIP, 1 };
+        }
+    };
+
+    if (_blocks.empty())
+    {
+        addBlock(_virtualIP);
+    }
+    for (const Block_t& block : _blocks)
+    {
+        addBlock(block.vIP);
+    }
+
+    return true;
+}
+
+void JitCodeGenerator::discard()
+{
+    _scheduled.clear();
+    _blocks.clear();
+    _ranges.clear();
+    _blockIP = _virtualIP;
+    _optimized = false;
+}
+
+void JitCodeGenerator::reset(uintptr_t vIP)
+{
+    _virtualIP = vIP;
+    discard();
+}
+
+void JitCodeGenerator::beginBlock(uintptr_t vIP)
+{
+    _blocks.push_back({ vIP, _scheduled.size() });
+    _blockIP = vIP;
+}
+
+bool isDirectBranch(const Instruction& instr)
+{
+    if (instr.operands[0].type != OperandType::IMM)
+        return false;
+
+    if (instr.mnemonic == MnemonicType::I_CALL)
+        return true;
+
+    return isBranchInstruction(convertMnemonic(instr.mnemonic));
+}
+
+bool getInvertedBranch(MnemonicType mnemonic, MnemonicType& inverted)
+{
+    static const MnemonicType pairs[][2] =
+    {
+        { MnemonicType::I_JA, MnemonicType::I_JBE },
+        { MnemonicType::I_JAE, MnemonicType::I_JB },
+        { MnemonicType::I_JE, MnemonicType::I_JNE },
+        { MnemonicType::I_JG, MnemonicType::I_JLE },
+        { MnemonicType::I_JGE, MnemonicType::I_JL },
+        { MnemonicType::I_JO, MnemonicType::I_JNO },
+        { MnemonicType::I_JP, MnemonicType::I_JNP },
+        { MnemonicType::I_JS, MnemonicType::I_JNS },
+    };
+
+    for (const auto& pair : pairs)
+    {
+        if (pair[0] == mnemonic)
+        {
+            inverted = pair[1];
+            return true;
+        }
+        if (pair[1] == mnemonic)
+        {
+            inverted = pair[0];
+            return true;
+        }
+    }
+    return false;
+}
+
+bool JitCodeGenerator::stitchBlock(size_t exitIndex)
+{
+    if (_blocks.empty())
+        return false;
+
+    // Exits are created in order of the direct branches.
+    size_t idx = _blocks.back().begin;
+    size_t branches = 0;
+    for (; idx < _scheduled.size(); idx++)
+    {
+        if (isDirectBranch(_scheduled[idx]) && branches++ == exitIndex)
+            break;
+    }
+
+    if (idx == _scheduled.size())
+        return false;
+
+    Instruction& branch = _scheduled[idx];
+    if (branch.mnemonic == MnemonicType::I_JMP)
+    {
+        // Anything after it is unreachable.
+        _scheduled.erase(_scheduled.begin() + idx, _scheduled.end());
+        return true;
+    }
+
+    if (branch.mnemonic == MnemonicType::I_CALL)
+    {
+        // Would leave the shadow stack unbalanced.
+        return false;
+    }
+
+    // jcc taken; jmp other -> jncc other, falling through to the taken side.
+    if (idx + 2 != _scheduled.size())
+        return false;
+
+    const Instruction& other = _scheduled[idx + 1];
+    if (other.mnemonic != MnemonicType::I_JMP || other.operands[0].type != OperandType::IMM)
+        return false;
+
+    MnemonicType inverted;
+    if (!getInvertedBranch(branch.mnemonic, inverted))
+        return false;
+
+    branch.mnemonic = inverted;
+    branch.operands[0] = other.operands[0];
+    _scheduled.pop_back();
+
+    return true;
+}
+
+// Records the first error, asmjit only reports them through the handler.
+class ErrorRecorder : public asmjit::ErrorHandler
+{
+public:
+    asmjit::Error error = asmjit::kErrorOk;
+
+    virtual void handleError(asmjit::Error err, const char *message, asmjit::BaseEmitter *origin) override
+    {
+        if (error == asmjit::kErrorOk)
+        {
+            error = err;
+        }
+    }
+};
+
+// asmjit state kept per thread between compiles. The holder is soft reset
+// after every unit, which also detaches the emitters and resets their zones,
+// so the memory blocks stay around for the next one.
+struct CompileContext
+{
+    asmjit::CodeHolder holder;
+    asmjit::x86::Assembler assembler;
+    asmjit::x86::Builder builder;
+
+    static CompileContext& get()
+    {
+        static thread_local CompileContext context;
+        return context;
+    }
+};
+
+// Initializes the holder of the thread's compile context for one unit.
+class CompileScope
+{
+    CompileContext& _context;
+
+public:
+    CompileScope(asmjit::JitRuntime *runtime, asmjit::ErrorHandler *errors)
+        : _context(CompileContext::get())
+    {
+        asmjit::CodeHolder& holder = _context.holder;
+        holder.init(runtime->codeInfo());
+        holder.setErrorHandler(errors);
+    }
+
+    ~CompileScope()
+    {
+        _context.holder.reset(asmjit::Globals::kResetSoft);
+    }
+
+    asmjit::CodeHolder& holder()
+    {
+        return _context.holder;
+    }
+
+    asmjit::x86::Assembler& assembler()
+    {
+        _context.holder.attach(&_context.assembler);
+        return _context.assembler;
+    }
+
+    asmjit::x86::Builder& builder()
+    {
+        _context.holder.attach(&_context.builder);
+        return _context.builder;
+    }
+};
+
+bool JitCodeGenerator::compile(CompileTier tier, uintptr_t *execCounter, JitTranslatorUnit::Code& code)
+{
+    asmjit::JitRuntime *runtime = reinterpret_cast<asmjit::JitRuntime *>(_emulator->getRuntime());
+
+    TranslationCache& cache = _emulator->getTranslationCache();
+
+    std::vector<uint8_t> key;
+    if (cache.isOpen())
+    {
+        buildCacheKey(tier, execCounter != nullptr, key);
+        if (loadCached(cache, key, execCounter, code))
+        {
+            discard();
+            return true;
+        }
+    }
+
+    ErrorRecorder errors;
+
+    CompileScope scope(runtime, &errors);
+    asmjit::CodeHolder& holder = scope.holder();
+
+    JitLayout layout;
+    bool generated = generateInto(scope, tier, execCounter, code.exits, layout);
+    if (generated && tier != CompileTier::BASELINE)
+    {
+        scope.builder().finalize();
+    }
+
+    discard();
+
+    UnitArena& arena = _emulator->getUnitArena();
+
+    if (!generated || errors.error != asmjit::kErrorOk)
+    {
+        arena.release(code.exits);
+        return false;
+    }
+
+    void *func = nullptr;
+    if (_emulator->addCode(&func, &holder) != asmjit::kErrorOk)
+    {
+        arena.release(code.exits);
+        return false;
+    }
+
+    const uint8_t *base = reinterpret_cast<const uint8_t*>(func);
+    code.func = reinterpret_cast<JitTranslatorUnit::fnJitFunction>(func);
+    code.chainEntry = base + holder.labelOffset(layout.chainEntry);
+    code.isTrace = layout.isTrace;
+    code.tier = tier;
+    code.codeSize = holder.codeSize();
+
+    const void *returnPath = base + holder.labelOffset(layout.returnPath);
+    for (JitTranslatorUnit::Exit& exit : code.exits)
+    {
+        exit.unlinked = returnPath;
+        exit.target = returnPath;
+    }
+
+    if (!key.empty())
+    {
+        storeCached(cache, key, holder, 0, layout, code);
+    }
+
+    return true;
+}
+
+size_t JitCodeGenerator::compileBatch(CompileTier tier, std::vector<BatchJob_t>& jobs)
+{
+    if (jobs.empty())
+        return 0;
+
+    JitEmulator *emulator = jobs[0].generator->_emulator;
+    asmjit::JitRuntime *runtime = reinterpret_cast<asmjit::JitRuntime *>(emulator->getRuntime());
+
+    TranslationCache& cache = emulator->getTranslationCache();
+    UnitArena& arena = emulator->getUnitArena();
+
+    size_t compiled = 0;
+    std::vector<std::vector<uint8_t>> keys(jobs.size());
+    // Jobs that go into the shared allocation.
+    std::vector<size_t> pending;
+
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        BatchJob_t& job = jobs[i];
+        if (cache.isOpen())
+        {
+            job.generator->buildCacheKey(tier, job.execCounter != nullptr, keys[i]);
+            if (job.generator->loadCached(cache, keys[i], job.execCounter, job.code))
+            {
+                compiled++;
+                continue;
+            }
+        }
+        pending.push_back(i);
+    }
+
+    std::vector<asmjit::Label> starts(jobs.size());
+    std::vector<JitLayout> layouts(jobs.size());
+
+    // A unit that fails to generate leaves its partial code behind, it is
+    // dropped and the others emitted again.
+    while (!pending.empty())
+    {
+        ErrorRecorder errors;
+
+        CompileScope scope(runtime, &errors);
+        asmjit::CodeHolder& holder = scope.holder();
+
+        asmjit::x86::Emitter *emitter = tier == CompileTier::BASELINE
+            ? scope.assembler().as<asmjit::x86::Emitter>()
+            : scope.builder().as<asmjit::x86::Emitter>();
+
+        size_t failed = pending.size();
+        for (size_t n = 0; n < pending.size(); n++)
+        {
+            size_t idx = pending[n];
+            BatchJob_t& job = jobs[idx];
+            arena.release(job.code.exits);
+
+            emitter->align(asmjit::kAlignCode, 16);
+            starts[idx] = emitter->newLabel();
+            emitter->bind(starts[idx]);
+
+            if (!job.generator->generateInto(scope, tier, job.execCounter, job.code.exits, layouts[idx]) || errors.error != asmjit::kErrorOk)
+            {
+                failed = n;
+                break;
+            }
+        }
+
+        if (failed != pending.size())
+        {
+            arena.release(jobs[pending[failed]].code.exits);
+            pending.erase(pending.begin() + failed);
+            continue;
+        }
+
+        if (tier != CompileTier::BASELINE)
+        {
+            scope.builder().finalize();
+        }
+
+        void *func = nullptr;
+        if (errors.error != asmjit::kErrorOk || emulator->addCode(&func, &holder) != asmjit::kErrorOk)
+        {
+            for (size_t idx : pending)
+            {
+                arena.release(jobs[idx].code.exits);
+            }
+            break;
+        }
+
+        const uint8_t *base = reinterpret_cast<const uint8_t*>(func);
+
+        std::vector<void*> funcs;
+        for (size_t n = 0; n < pending.size(); n++)
+        {
+            size_t idx = pending[n];
+            BatchJob_t& job = jobs[idx];
+            const JitLayout& layout = layouts[idx];
+
+            // Padding in front of the next unit is accounted to this one.
+            size_t start = holder.labelOffset(starts[idx]);
+            size_t end = n + 1 < pending.size() ? holder.labelOffset(starts[pending[n + 1]]) : holder.codeSize();
+
+            job.code.func = reinterpret_cast<JitTranslatorUnit::fnJitFunction>(const_cast<uint8_t*>(base + start));
+            job.code.chainEntry = base + holder.labelOffset(layout.chainEntry);
+            job.code.isTrace = layout.isTrace;
+            job.code.tier = tier;
+            job.code.codeSize = end - start;
+
+            const void *returnPath = base + holder.labelOffset(layout.returnPath);
+            for (JitTranslatorUnit::Exit& exit : job.code.exits)
+            {
+                exit.unlinked = returnPath;
+                exit.target = returnPath;
+            }
+
+            if (!keys[idx].empty())
+            {
+                job.generator->storeCached(cache, keys[idx], holder, start, layout, job.code);
+            }
+
+            funcs.push_back(reinterpret_cast<void*>(job.code.func));
+        }
+
+        emulator->shareCode(func, funcs);
+        compiled += pending.size();
+        break;
+    }
+
+    for (BatchJob_t& job : jobs)
+    {
+        job.generator->discard();
+    }
+
+    return compiled;
+}
+
+uint32_t JitCodeGenerator::getHotThreshold(CompileTier tier) const
+{
+    if (tier == CompileTier::BASELINE)
+    {
+        return _emulator->getTierUpThreshold();
+    }
+    return TraceBuilder::k_HotThreshold;
+}
+
+void JitCodeGenerator::buildCacheKey(CompileTier tier, bool profiled, std::vector<uint8_t>& key) const
+{
+    TranslationCache::append(key, (uint8_t)tier);
+    TranslationCache::append(key, (uint32_t)(profiled ? getHotThreshold(tier) : 0));
+    TranslationCache::append(key, (uint64_t)_virtualIP);
+    TranslationCache::append(key, (uint8_t)_emulator->isRegisterPinning());
+
+    TranslationCache::append(key, (uint32_t)_blocks.size());
+    for (const Block_t& block : _blocks)
+    {
+        TranslationCache::append(key, (uint64_t)block.vIP);
+        TranslationCache::append(key, (uint32_t)block.begin);
+    }
+
+    TranslationCache::append(key, (uint32_t)_scheduled.size());
+    for (const Instruction& instr : _scheduled)
+    {
+        TranslationCache::appendInstruction(key, instr);
+    }
+}
+
+bool JitCodeGenerator::loadCached(TranslationCache& cache, const std::vector<uint8_t>& key, uintptr_t *execCounter, JitTranslatorUnit::Code& code)
+{
+    asmjit::JitRuntime *runtime = reinterpret_cast<asmjit::JitRuntime *>(_emulator->getRuntime());
+
+    TranslationCache::Entry entry;
+    if (!cache.lookup(key, entry))
+    {
+        return false;
+    }
+
+    UnitArena& arena = _emulator->getUnitArena();
+
+    // Slots first, the code points into them.
+    if (!arena.allocate(code.exits, entry.exits.size()))
+        return false;
+
+    for (size_t i = 0; i < entry.exits.size(); i++)
+    {
+        JitTranslatorUnit::Exit& exit = code.exits[i];
+        exit.targetIP = entry.exits[i].targetIP;
+        exit.target = nullptr;
+        exit.unlinked = nullptr;
+        exit.hits = 0;
+        exit.isReturnSite = entry.exits[i].isReturnSite;
+    }
+
+    for (const TranslationCache::Reloc& reloc : entry.relocs)
+    {
+        const void *address = resolveAddress(reloc.kind, reloc.index, execCounter, &code.exits);
+        if (!address)
+        {
+            arena.release(code.exits);
+            return false;
+        }
+        memcpy(entry.code.data() + reloc.offset, &address, sizeof(address));
+    }
+
+    ErrorRecorder errors;
+
+    CompileScope scope(runtime, &errors);
+    asmjit::CodeHolder& holder = scope.holder();
+
+    asmjit::x86::Assembler& assembler = scope.assembler();
+    assembler.embed(entry.code.data(), (uint32_t)entry.code.size());
+
+    void *func = nullptr;
+    if (errors.error != asmjit::kErrorOk || _emulator->addCode(&func, &holder) != asmjit::kErrorOk)
+    {
+        arena.release(code.exits);
+        return false;
+    }
+
+    const uint8_t *base = reinterpret_cast<const uint8_t*>(func);
+    code.func = reinterpret_cast<JitTranslatorUnit::fnJitFunction>(func);
+    code.chainEntry = base + entry.chainEntry;
+    code.isTrace = entry.isTrace;
+    code.tier = entry.tier;
+    code.codeSize = entry.code.size();
+
+    for (JitTranslatorUnit::Exit& exit : code.exits)
+    {
+        exit.unlinked = base + entry.returnPath;
+        exit.target = base + entry.returnPath;
+    }
+
+    return true;
+}
+
+void JitCodeGenerator::storeCached(TranslationCache& cache, std::vector<uint8_t>& key, const asmjit::CodeHolder& holder, size_t start, const JitLayout& layout, const JitTranslatorUnit::Code& code)
+{
+    TranslationCache::Entry entry;
+    entry.key = std::move(key);
+    entry.tier = code.tier;
+    entry.isTrace = code.isTrace;
+    entry.chainEntry = (uint32_t)(holder.labelOffset(layout.chainEntry) - start);
+    entry.returnPath = (uint32_t)(holder.labelOffset(layout.returnPath) - start);
+
+    for (const JitTranslatorUnit::Exit& exit : code.exits)
+    {
+        entry.exits.push_back({ exit.targetIP, exit.isReturnSite });
+    }
+
+    const uint8_t *base = reinterpret_cast<const uint8_t*>(code.func);
+    entry.code.assign(base, base + code.codeSize);
+
+    for (const AddressReloc_t& reloc : layout.relocs)
+    {
+        uint32_t offset = (uint32_t)(holder.labelOffset(reloc.end) - start) - sizeof(uintptr_t);
+
+        // Same file contents for the same code no matter where it ran.
+        memset(entry.code.data() + offset, 0, sizeof(uintptr_t));
+        entry.relocs.push_back({ offset, reloc.kind, reloc.index });
+    }
+
+    cache.insert(std::move(entry));
+}
+
+const void* JitCodeGenerator::resolveAddress(AddressKind kind, uint32_t index, uintptr_t *execCounter, ArenaArray<JitTranslatorUnit::Exit> *exits)
+{
+    ShadowStackState& state = _emulator->getShadowStackState();
+    IndirectBranchCache& cache = _emulator->getIndirectBranchCache();
+
+    switch (kind)
+    {
+    case AddressKind::EXEC_COUNTER:
+        return execCounter;
+    case AddressKind::EXIT_HITS:
+        return exits && index < exits->size() ? &(*exits)[index].hits : nullptr;
+    case AddressKind::EXIT_TARGET:
+        return exits && index < exits->size() ? &(*exits)[index].target : nullptr;
+    case AddressKind::SHADOW_EPOCH:
+        return &state.epoch;
+    case AddressKind::SHADOW_HITS:
+        return &state.hits;
+    case AddressKind::SHADOW_MISSES:
+        return &state.misses;
+    case AddressKind::INDIRECT_ENTRIES:
+        return cache.entries();
+    case AddressKind::INDIRECT_HITS:
+        return cache.hitCounter();
+    case AddressKind::INDIRECT_MISSES:
+        return cache.missCounter();
+    default:
+        return nullptr;
+    }
+}
+
+void JitCodeGenerator::emitAddress(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const asmjit::x86::Gp& reg, AddressKind kind, uint32_t index)
+{
+    const void *address = resolveAddress(kind, index, ctx.execCounter, ctx.exitSlots);
+
+    // Always the full pointer sized immediate so a cached copy can be
+    // pointed anywhere.
+    emitter.long_().mov(reg, asmjit::Imm((intptr_t)address));
+
+    asmjit::Label end = emitter.newLabel();
+    emitter.bind(end);
+
+    ctx.layout.relocs.push_back({ end, kind, index });
+}
+
+bool JitCodeGenerator::beginContext(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uintptr_t *execCounter, uint32_t hotThreshold)
+{
+    ctx.layout.chainEntry = emitter.newLabel();
+    ctx.layout.returnPath = emitter.newLabel();
+    ctx.layout.haltPath = emitter.newLabel();
+    ctx.layout.isTrace = !_blocks.empty();
+    ctx.instrCount = (uint32_t)_scheduled.size();
+    ctx.blockIP = _virtualIP;
+
+    // Traces are not traced again.
+    if (!ctx.layout.isTrace && execCounter)
+    {
+        ctx.execCounter = execCounter;
+        ctx.hotThreshold = hotThreshold;
+        ctx.hotPath = emitter.newLabel();
+        ctx.hotResume = emitter.newLabel();
+    }
+
+    ctx.funcDetail.init(asmjit::FuncSignatureT<void, void*>(asmjit::CallConv::kIdHost));
+    ctx.funcFrame.init(ctx.funcDetail);
+
+    // The guest registers of a 32 bit guest, sp is switched per unit.
+    if (_emulator->isRegisterPinning() && emitter.is64Bit())
+    {
+        ctx.pinnedRegs = k_PinnedRegs;
+    }
+
+    return true;
+}
+
+bool JitCodeGenerator::generateBody(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter)
+{
+    size_t blockIndex = 0;
+    for (size_t i = 0; i < _scheduled.size(); i++)
+    {
+        while (blockIndex < _blocks.size() && _blocks[blockIndex].begin == i)
+        {
+            ctx.blockIP = _blocks[blockIndex++].vIP;
+        }
+        ctx.instrIndex = (uint32_t)i + 1;
+
+        if (!generateInstruction(ctx, emitter, _scheduled[i]))
+        {
+            return false;
+        }
+    }
+    // Trailing blocks without instructions.
+    if (!_blocks.empty())
+    {
+        ctx.blockIP = _blocks.back().vIP;
+    }
+
+    return true;
+}
+
+bool JitCodeGenerator::generateStubs(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, ArenaArray<JitTranslatorUnit::Exit>& exits)
+{
+    // Out of line stubs for the branches.
+    if (!generateBranchExits(ctx, emitter, exits))
+    {
+        return false;
+    }
+
+    if (!generateIndirectExits(ctx, emitter, exits))
+    {
+        return false;
+    }
+
+    if (!generateHaltExits(ctx, emitter))
+    {
+        return false;
+    }
+
+    if (!generateHotPath(ctx, emitter))
+    {
+        return false;
+    }
+
+    return true;
+}
+
+bool JitCodeGenerator::generateInto(CompileScope& scope, CompileTier tier, uintptr_t *execCounter, ArenaArray<JitTranslatorUnit::Exit>& exits, JitLayout& layout)
+{
+    if (tier == CompileTier::BASELINE)
+    {
+        return generateBaseline(scope.assembler(), exits, execCounter, layout);
+    }
+
+    return generate(scope.builder(), exits, execCounter, layout);
+}
+
+bool JitCodeGenerator::generate(asmjit::x86::Builder& builder, ArenaArray<JitTranslatorUnit::Exit>& exits, uintptr_t *execCounter, JitLayout& layout)
+{
+    asmjit::x86::Emitter& emitter = *builder.as<asmjit::x86::Emitter>();
+
+    // Rewritten in place, the cache key and baseline sources are taken
+    // before this. Batches emit their units again after a failed one, the
+    // rewritten instructions are kept for that.
+    if (!_optimized)
+    {
+        _emulator->getOptimizer().run(_ir, _scheduled);
+        _optimized = true;
+    }
+
+    GeneratorContext_t ctx;
+    beginContext(ctx, emitter, execCounter, getHotThreshold(CompileTier::OPTIMIZING));
+
+    // Earlier units of a batch come before this one.
+    asmjit::CBNode *nodeBefore = builder.cursor();
+
+    if (!generateBody(ctx, emitter))
+    {
+        return false;
+    }
+
+    // May remove the first or last node of the body, taken again below.
+    _emulator->getOptimizer().runPeephole(builder, nodeBefore ? nodeBefore->next() : builder.firstNode());
+
+    asmjit::CBNode *nodePreGenerated = nodeBefore ? nodeBefore->next() : builder.firstNode();
+    asmjit::CBNode *nodePostGenerated = builder.lastNode();
+
+    if (!analyseContextUsage(ctx, builder, nodePreGenerated, nodePostGenerated))
+    {
+        return false;
+    }
+
+    // Insert before first instruction.
+    builder.setCursor(nodeBefore);
+    if (!generateContextEntry(ctx, emitter))
+    {
+        return false;
+    }
+
+    // Insert after last, straight after the entry without a body.
+    builder.setCursor(nodePostGenerated != nodeBefore ? nodePostGenerated : builder.cursor());
+    if (!generateContextExit(ctx, emitter))
+    {
+        return false;
+    }
+
+    builder.setCursor(builder.lastNode());
+    if (!generateStubs(ctx, emitter, exits))
+    {
+        return false;
+    }
+
+    layout = ctx.layout;
+
+    return true;
+}
+
+bool JitCodeGenerator::generateBaseline(asmjit::x86::Assembler& assembler, ArenaArray<JitTranslatorUnit::Exit>& exits, uintptr_t *execCounter, JitLayout& layout)
+{
+    asmjit::x86::Emitter& emitter = *assembler.as<asmjit::x86::Emitter>();
+
+    // Traces only come from the optimizing tier.
+    if (!_blocks.empty())
+    {
+        return false;
+    }
+
+    GeneratorContext_t ctx;
+    beginContext(ctx, emitter, execCounter, getHotThreshold(CompileTier::BASELINE));
+
+    // Everything is known up front so the code goes out in order.
+    if (!analyseInstructions(ctx, emitter))
+    {
+        return false;
+    }
+
+    if (!generateContextEntry(ctx, emitter))
+    {
+        return false;
+    }
+
+    if (!generateBody(ctx, emitter))
+    {
+        return false;
+    }
+
+    if (!generateContextExit(ctx, emitter))
+    {
+        return false;
+    }
+
+    if (!generateStubs(ctx, emitter, exits))
+    {
+        return false;
+    }
+
+    layout = ctx.layout;
+
+    return true;
+}
+
+
+int32_t getGPRegisterOffset(const asmjit::x86::Reg& reg)
+{
+    if (reg.isGp())
+    {
+        uint32_t idx = reg.id();
+        return (int32_t)offsetof(VContext, gpRegs[idx]);
+    }
+    else
+    {
+        // TODO: Add other reg types.
+    }
+    return 0;
+}
+
+int32_t getEFlagsOffset()
+{
+    return offsetof(VContext, flags);
+}
+
+uintptr_t getBranchTarget(const Operand& op)
+{
+    if (op.size == OperandSize::SIZE_32)
+        return op.imm.val.u32;
+
+    return (uintptr_t)op.imm.val.ptr;
+}
+
+// EFLAGS as asmjit reports them in the special registers.
+const uint32_t k_SpecialFlags = asmjit::x86::kSpecialReg_FLAGS_CF | asmjit::x86::kSpecialReg_FLAGS_PF |
+    asmjit::x86::kSpecialReg_FLAGS_AF | asmjit::x86::kSpecialReg_FLAGS_ZF | asmjit::x86::kSpecialReg_FLAGS_SF |
+    asmjit::x86::kSpecialReg_FLAGS_TF | asmjit::x86::kSpecialReg_FLAGS_IF | asmjit::x86::kSpecialReg_FLAGS_DF |
+    asmjit::x86::kSpecialReg_FLAGS_OF | asmjit::x86::kSpecialReg_FLAGS_AC | asmjit::x86::kSpecialReg_FLAGS_SYS;
+
+const uint32_t k_SpecialStatus = asmjit::x86::kSpecialReg_FLAGS_CF | asmjit::x86::kSpecialReg_FLAGS_PF |
+    asmjit::x86::kSpecialReg_FLAGS_AF | asmjit::x86::kSpecialReg_FLAGS_ZF | asmjit::x86::kSpecialReg_FLAGS_SF |
+    asmjit::x86::kSpecialReg_FLAGS_OF;
+
+bool isExitInstruction(const Instruction& instr, uint32_t instrId)
+{
+    switch (instr.mnemonic)
+    {
+    case MnemonicType::I_HLT:
+    case MnemonicType::I_RET:
+    case MnemonicType::I_CALL:
+    case MnemonicType::I_JMP:
+        return true;
+    }
+    return isBranchInstruction(instrId);
+}
+
+// Flags the instruction always writes, shifts and rotates by zero leave
+// all of them alone.
+uint32_t getFlagsKilled(const Instruction& instr, uint32_t instrId)
+{
+    const auto& instrData = asmjit::x86::InstDB::infoById(instrId);
+    uint32_t written = instrData.executionInfo().specialRegsW() & k_SpecialFlags;
+
+    // Repeated zero times with a zero count, the flags stay as they were.
+    if (instr.prefix == Prefix::REP || instr.prefix == Prefix::REPNE)
+        return 0;
+
+    switch (instrId)
+    {
+    case asmjit::x86::Inst::kIdShl:
+    case asmjit::x86::Inst::kIdShr:
+    case asmjit::x86::Inst::kIdSar:
+    case asmjit::x86::Inst::kIdSal:
+    case asmjit::x86::Inst::kIdRol:
+    case asmjit::x86::Inst::kIdRor:
+    case asmjit::x86::Inst::kIdRcl:
+    case asmjit::x86::Inst::kIdRcr:
+    case asmjit::x86::Inst::kIdShld:
+    case asmjit::x86::Inst::kIdShrd:
+    {
+        // The count is the last operand.
+        const Operand *count = nullptr;
+        for (const Operand& op : instr.operands)
+        {
+            if (op.type != OperandType::NONE)
+                count = &op;
+        }
+        if (!count || count->type != OperandType::IMM || (count->imm.val.u8 & 0x1F) == 0)
+            return 0;
+        break;
+    }
+    }
+
+    return written;
+}
+
+bool isStackInstruction(uint32_t instrId)
+{
+    switch (instrId)
+    {
+    case asmjit::x86::Inst::kIdPush:
+    case asmjit::x86::Inst::kIdPop:
+    case asmjit::x86::Inst::kIdPushf:
+    case asmjit::x86::Inst::kIdPushfd:
+    case asmjit::x86::Inst::kIdPushfq:
+    case asmjit::x86::Inst::kIdPopf:
+    case asmjit::x86::Inst::kIdPopfd:
+    case asmjit::x86::Inst::kIdPopfq:
+    case asmjit::x86::Inst::kIdEnter:
+    case asmjit::x86::Inst::kIdLeave:
+        return true;
+    }
+    return false;
+}
+
+// Fixed registers the instruction uses without naming them, collected over
+// every form of it so whichever one gets encoded is covered.
+uint32_t getImplicitRegs(uint32_t instrId, bool repeated)
+{
+    const uint32_t gpFlags = asmjit::x86::InstDB::kOpGpbLo | asmjit::x86::InstDB::kOpGpbHi |
+        asmjit::x86::InstDB::kOpGpw | asmjit::x86::InstDB::kOpGpd | asmjit::x86::InstDB::kOpGpq;
+
+    const auto& info = asmjit::x86::InstDB::infoById(instrId).commonInfo();
+
+    uint32_t regs = 0;
+    for (auto *sig = info.signatureData(); sig != info.signatureEnd(); sig++)
+    {
+        for (uint32_t i = 0; i < sig->opCount; i++)
+        {
+            const auto& op = asmjit::x86::InstDB::_opSignatureTable[sig->operands[i]];
+            if (!(op.opFlags & asmjit::x86::InstDB::kOpImplicit))
+                continue;
+
+            // Implicit memory operands carry their base, rsi/rdi of string instructions.
+            if (op.opFlags & (gpFlags | asmjit::x86::InstDB::kOpMem))
+            {
+                regs |= op.regMask;
+            }
+        }
+    }
+
+    // The count of rep prefixed string instructions.
+    if (repeated)
+    {
+        regs |= 1u << asmjit::x86::Gp::kIdCx;
+    }
+
+    return regs;
+}
+
+// Guest registers of a unit, collected in the order the code runs.
+struct RegUsage_t
+{
+    // Read before the unit wrote them, loaded on entry.
+    uint32_t read = 0;
+    // Stored back on exit.
+    uint32_t written = 0;
+    // Hold the guest value at this point.
+    uint32_t defined = 0;
+    // Held the guest value at every exit so far.
+    uint32_t definedAtExits = ~0u;
+};
+
+bool isZeroIdiom(uint32_t instrId, const asmjit::Operand *ops, uint32_t opCount)
+{
+    if (instrId != asmjit::x86::Inst::kIdXor && instrId != asmjit::x86::Inst::kIdSub)
+        return false;
+
+    return opCount >= 2 && ops[0].isReg() && ops[0] == ops[1];
+}
+
+// Only the access of the first operand is recorded by the instruction
+// database, and of the second for xchg and xadd, the rest is read. Writes
+// narrower than 32 bits keep the upper part so they read as well.
+void addRegAccess(RegUsage_t& usage, uint32_t instrId, const asmjit::Operand *ops, uint32_t opCount, bool repeated)
+{
+    const auto& info = asmjit::x86::InstDB::infoById(instrId);
+
+    bool zeroIdiom = isZeroIdiom(instrId, ops, opCount);
+
+    uint32_t implicitRegs = getImplicitRegs(instrId, repeated);
+    uint32_t read = implicitRegs;
+    uint32_t written = implicitRegs;
+
+    for (uint32_t n = 0; n < opCount; n++)
+    {
+        const asmjit::Operand& op = ops[n];
+        if (op.isReg())
+        {
+            const asmjit::x86::Reg& reg = op.as<asmjit::x86::Reg>();
+            if (!reg.isGp())
+                continue;
+
+            bool isRead = true;
+            bool isWritten = false;
+            if (n == 0 && !info.hasFlag(asmjit::x86::InstDB::kFlagUseA))
+            {
+                isRead = !info.isUseW();
+                isWritten = !info.isUseR();
+            }
+            else if (n == 0 || (n == 1 && info.isUseXX()))
+            {
+                isWritten = true;
+            }
+
+            if (zeroIdiom)
+            {
+                isRead = false;
+                isWritten = n == 0;
+            }
+
+            uint32_t regMask = 1u << reg.id();
+            if (isWritten)
+            {
+                written |= regMask;
+                if (reg.size() < 4 || reg.isGpbHi())
+                    isRead = true;
+            }
+            if (isRead)
+            {
+                read |= regMask;
+            }
+        }
+        else if (op.isMem())
+        {
+            const asmjit::x86::Mem& mem = op.as<asmjit::x86::Mem>();
+            if (mem.hasBaseReg())
+                read |= 1u << mem.baseId();
+            if (mem.hasIndex())
+                read |= 1u << mem.indexId();
+        }
+    }
+
+    usage.read |= read & ~usage.defined;
+    usage.written |= written;
+    usage.defined |= read | written;
+}
+
+// Registers written after the exit are loaded as well so the exit stores
+// the guest value instead of whatever the host left in them.
+void addExit(RegUsage_t& usage)
+{
+    usage.definedAtExits &= usage.defined;
+}
+
+// The register chained units expect the context in, invalid if passed on the stack.
+asmjit::x86::Gp getContextArgReg(const asmjit::FuncDetail& funcDetail, asmjit::x86::Emitter& emitter, uint32_t pinnedRegs)
+{
+    asmjit::x86::Gp regArg;
+
+    // The argument register is a pinned guest register.
+    if (pinnedRegs)
+    {
+        return emitter.gpz(k_PinnedBase);
+    }
+
+    const asmjit::FuncValue& arg = funcDetail.arg(0);
+    if (arg.isReg())
+    {
+        regArg = emitter.gpz(arg.regId());
+    }
+
+    return regArg;
+}
+
+// Registers that are free once the guest state is stored, pinned guest
+// registers stay live.
+void getFreeRegs(asmjit::x86::Emitter& emitter, const asmjit::x86::Gp& regBase, const asmjit::x86::Gp& regArg, asmjit::x86::Gp *regs, size_t count, uint32_t pinnedRegs)
+{
+    static const uint32_t candidates[] =
+    {
+        asmjit::x86::Gp::kIdAx,
+        asmjit::x86::Gp::kIdCx,
+        asmjit::x86::Gp::kIdDx,
+        asmjit::x86::Gp::kIdBx,
+        asmjit::x86::Gp::kIdSi,
+        asmjit::x86::Gp::kIdDi,
+        asmjit::x86::Gp::kIdR8,
+        asmjit::x86::Gp::kIdR9,
+        asmjit::x86::Gp::kIdR10,
+        asmjit::x86::Gp::kIdR11,
+    };
+
+    size_t n = 0;
+    for (uint32_t id : candidates)
+    {
+        if (n == count)
+            break;
+
+        if (id >= emitter.gpCount() || (pinnedRegs & (1u << id)))
+            continue;
+
+        auto reg = emitter.gpz(id);
+        if (reg == regBase || reg == regArg)
+            continue;
+
+        regs[n++] = reg;
+    }
+}
+
+void pushReturnAddress(asmjit::x86::Emitter& emitter, uintptr_t returnIP)
+{
+    // push takes a sign extended imm32, patch the upper half if that is not enough.
+    if (emitter.gpSize() == 4 || (uint64_t)(int64_t)(int32_t)returnIP == (uint64_t)returnIP)
+    {
+        emitter.push(asmjit::Imm((int32_t)returnIP));
+    }
+    else
+    {
+        emitter.push(asmjit::Imm((int32_t)(uint32_t)returnIP));
+        emitter.mov(asmjit::x86::dword_ptr(emitter.zsp(), 4), asmjit::Imm((int32_t)((uint64_t)returnIP >> 32)));
+    }
+}
+
+bool JitCodeGenerator::generateContextEntry(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter)
+{
+    const auto& regBase = ctx.regContextBase;
+
+    asmjit::FuncArgsAssignment args(&ctx.funcDetail);
+    args.assignAll(regBase);
+
+    uint32_t gpSize = emitter.gpSize();
+
+    emitter.emitProlog(ctx.funcFrame);
+
+    if (ctx.pinnedRegs)
+    {
+        // Chained units keep the pinned registers as they are and pass the
+        // context in the pinned base, units using it for the guest move it.
+        asmjit::x86::Gp regChain = getContextArgReg(ctx.funcDetail, emitter, ctx.pinnedRegs);
+
+        asmjit::FuncArgsAssignment chainArgs(&ctx.funcDetail);
+        chainArgs.assignAll(regChain);
+        emitter.emitArgsAssignment(ctx.funcFrame, chainArgs);
+
+        asmjit::Support::BitWordIterator<uint32_t> itPinned(ctx.pinnedRegs);
+        while (itPinned.hasNext())
+        {
+            const asmjit::X86Gp& reg = emitter.gpz(itPinned.next());
+            emitter.mov(reg, asmjit::X86Mem(regChain, getGPRegisterOffset(reg), gpSize));
+        }
+
+        emitter.bind(ctx.layout.chainEntry);
+
+        if (regBase != regChain)
+        {
+            emitter.mov(regBase, regChain);
+        }
+    }
+    else
+    {
+        emitter.bind(ctx.layout.chainEntry);
+        emitter.emitArgsAssignment(ctx.funcFrame, args);
+    }
+
+    // Guest state is still in the context, anything but the base is free.
+    if (ctx.execCounter)
+    {
+        asmjit::x86::Gp regTemp;
+        getFreeRegs(emitter, regBase, asmjit::x86::Gp(), &regTemp, 1, ctx.pinnedRegs);
+
+        emitAddress(ctx, emitter, regTemp, AddressKind::EXEC_COUNTER);
+        emitter.add(asmjit::X86Mem(regTemp, 0, gpSize), 1);
+        emitter.cmp(asmjit::X86Mem(regTemp, 0, gpSize), ctx.hotThreshold);
+        emitter.je(ctx.hotPath);
+        emitter.bind(ctx.hotResume);
+    }
+
+    // Set flags if input is required, nothing of the guest is loaded yet.
+    if (ctx.flagsLoad)
+    {
+        if (!generateFlagsLoad(ctx, emitter))
+        {
+            return false;
+        }
+    }
+
+    // Write all input registers.
+    for (auto& regIn : ctx.regsRead)
+    {
+        int32_t regOffset = getGPRegisterOffset(regIn);
+
+        if (regIn.isGp())
+        {
+            const asmjit::X86Gp& reg = emitter.gpz(regIn.id());
+            emitter.mov(reg, asmjit::X86Mem(regBase, regOffset, gpSize));
+        }
+        else
+        {
+            // TODO: Add other reg types.
+        }
+    }
+
+    // Switch to the guest stack.
+    if (ctx.usesStack)
+    {
+        const auto& zsp = emitter.zsp();
+
+        emitter.mov(asmjit::X86Mem(regBase, offsetof(VContextInternal, hostStack), gpSize), zsp);
+        emitter.mov(zsp, asmjit::X86Mem(regBase, getGPRegisterOffset(zsp), gpSize));
+    }
+
+    return true;
+}
+
+bool JitCodeGenerator::generateContextExit(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter)
+{
+    // Falling off the end is treated like hlt, nextIP is left at the last block.
+    emitter.bind(ctx.layout.haltPath);
+
+    if (!generateHalt(ctx, emitter, ctx.blockIP, ctx.instrCount, ctx.flags))
+    {
+        return false;
+    }
+
+    // Also entered from other pinned units, the context is in the pinned base.
+    emitter.bind(ctx.layout.returnPath);
+
+    asmjit::x86::Gp regChain = getContextArgReg(ctx.funcDetail, emitter, ctx.pinnedRegs);
+
+    asmjit::Support::BitWordIterator<uint32_t> itPinned(ctx.pinnedRegs);
+    while (itPinned.hasNext())
+    {
+        const asmjit::X86Gp& reg = emitter.gpz(itPinned.next());
+        emitter.mov(asmjit::X86Mem(regChain, getGPRegisterOffset(reg), emitter.gpSize()), reg);
+    }
+
+    emitter.emitEpilog(ctx.funcFrame);
+
+    return true;
+}
+
+bool JitCodeGenerator::generateHalt(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uintptr_t vIP, uint32_t instrCount, const FlagsState_t& flags)
+{
+    const auto& regBase = ctx.regContextBase;
+
+    asmjit::x86::Gp regTemp;
+    getFreeRegs(emitter, regBase, asmjit::x86::Gp(), &regTemp, 1, ctx.pinnedRegs);
+
+    // Halting always returns to the host, so the flags are stored in full.
+    FlagsState_t hostFlags = flags;
+    if (hostFlags.source != FlagsSource::ENTRY)
+    {
+        hostFlags.source = FlagsSource::HOST;
+    }
+
+    if (!generateContextStore(ctx, emitter, hostFlags))
+    {
+        return false;
+    }
+
+    uint32_t gpSize = emitter.gpSize();
+    int32_t nextIPOffset = offsetof(VContext, nextIP);
+    int32_t haltedOffset = offsetof(VContextInternal, halted);
+    int32_t budgetOffset = offsetof(VContextInternal, budget);
+
+    emitter.mov(regTemp, asmjit::Imm((int64_t)vIP));
+    emitter.mov(asmjit::X86Mem(regBase, nextIPOffset, gpSize), regTemp);
+    emitter.mov(asmjit::x86::dword_ptr(regBase, haltedOffset), 1);
+    emitter.sub(asmjit::X86Mem(regBase, budgetOffset, gpSize), instrCount);
+
+    return true;
+}
+
+bool JitCodeGenerator::generateContextStore(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const FlagsState_t& flags)
+{
+    const auto& regBase = ctx.regContextBase;
+
+    uint32_t gpSize = emitter.gpSize();
+
+    // Back to the host stack before anything gets pushed.
+    if (ctx.usesStack)
+    {
+        const auto& zsp = emitter.zsp();
+
+        emitter.mov(asmjit::X86Mem(regBase, getGPRegisterOffset(zsp), gpSize), zsp);
+        emitter.mov(zsp, asmjit::X86Mem(regBase, offsetof(VContextInternal, hostStack), gpSize));
+    }
+
+    // Write all output registers.
+    for (auto& regIn : ctx.regsModified)
+    {
+        int32_t regOffset = getGPRegisterOffset(regIn);
+
+        if (regIn.isGp())
+        {
+            const asmjit::X86Gp& reg = emitter.gpz(regIn.id());
+            emitter.mov(asmjit::X86Mem(regBase, regOffset, gpSize), reg);
+        }
+        else
+        {
+            // TODO: Add other reg types.
+        }
+    }
+
+    if (!generateFlagsStore(ctx, emitter, flags))
+    {
+        return false;
+    }
+
+    // Everything of the guest is stored, pinned units pass the context on
+    // in the pinned base from here.
+    if (ctx.pinnedRegs)
+    {
+        asmjit::x86::Gp regChain = getContextArgReg(ctx.funcDetail, emitter, ctx.pinnedRegs);
+        if (regChain != regBase)
+        {
+            emitter.mov(regChain, regBase);
+        }
+    }
+
+    return true;
+}
+
+bool JitCodeGenerator::generateFlagsLoad(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter)
+{
+    const auto& regBase = ctx.regContextBase;
+
+    asmjit::x86::Gp regTemp;
+    getFreeRegs(emitter, regBase, asmjit::x86::Gp(), &regTemp, 1, ctx.pinnedRegs);
+
+    uint32_t gpSize = emitter.gpSize();
+    asmjit::X86Mem flags(regBase, offsetof(VContext, flags), gpSize);
+    asmjit::X86Mem active = asmjit::x86::dword_ptr(regBase, offsetof(VContextInternal, lazyFlags.active));
+    asmjit::X86Mem dst = asmjit::x86::dword_ptr(regBase, offsetof(VContextInternal, lazyFlags.dst));
+    asmjit::X86Mem src = asmjit::x86::dword_ptr(regBase, offsetof(VContextInternal, lazyFlags.src));
+
+    asmjit::Label stored = emitter.newLabel();
+    asmjit::Label done = emitter.newLabel();
+
+    emitter.cmp(active, 0);
+    emitter.je(stored);
+
+    // Replaying the compare is a lot cheaper than popfd.
+    emitter.mov(regTemp.r32(), dst);
+    emitter.cmp(regTemp.r32(), src);
+
+    if (ctx.flagsLazy)
+    {
+        emitter.jmp(done);
+    }
+    else
+    {
+        // The other bits are needed as well, merge into the context.
+        emitter.pushfd();
+        emitter.pop(regTemp);
+        emitter.and_(regTemp.r32(), k_FlagsStatus);
+        emitter.and_(flags, ~(int32_t)k_FlagsStatus);
+        emitter.or_(flags, regTemp);
+        emitter.mov(active, 0);
+    }
+
+    emitter.bind(stored);
+    emitter.push(flags);
+    emitter.popfd();
+    emitter.bind(done);
+
+    return true;
+}
+
+bool JitCodeGenerator::generateFlagsStore(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const FlagsState_t& flags)
+{
+    const auto& regBase = ctx.regContextBase;
+
+    // Untouched, the context still has them.
+    if (flags.source == FlagsSource::ENTRY)
+    {
+        return true;
+    }
+
+    asmjit::X86Mem active = asmjit::x86::dword_ptr(regBase, offsetof(VContextInternal, lazyFlags.active));
+
+    if (flags.source == FlagsSource::HOST || !ctx.flagsLazy)
+    {
+        asmjit::x86::Gp regTemp;
+        getFreeRegs(emitter, regBase, asmjit::x86::Gp(), &regTemp, 1, ctx.pinnedRegs);
+
+        int32_t flagsOffset = offsetof(VContext, flags);
+
+        emitter.pushfd();
+        emitter.pop(regTemp);
+
+        if (ctx.flagsLazy)
+        {
+            // The other bits are not loaded by the replay.
+            asmjit::X86Mem flagsMem(regBase, flagsOffset, emitter.gpSize());
+
+            emitter.and_(regTemp.r32(), k_FlagsStatus);
+            emitter.and_(flagsMem, ~(int32_t)k_FlagsStatus);
+            emitter.or_(flagsMem, regTemp);
+        }
+        else
+        {
+            emitter.mov(asmjit::x86::dword_ptr(regBase, flagsOffset), regTemp.r32());
+        }
+
+        emitter.mov(active, 0);
+
+        return true;
+    }
+
+    // The guest registers are still in place.
+    asmjit::X86Mem dst = asmjit::x86::dword_ptr(regBase, offsetof(VContextInternal, lazyFlags.dst));
+    asmjit::X86Mem src = asmjit::x86::dword_ptr(regBase, offsetof(VContextInternal, lazyFlags.src));
+
+    emitter.mov(dst, flags.dst.r32());
+
+    switch (flags.source)
+    {
+    case FlagsSource::COMPARE:
+        emitter.emit(asmjit::x86::Inst::kIdMov, src, flags.src);
+        break;
+    case FlagsSource::SUBTRACT:
+        emitter.emit(asmjit::x86::Inst::kIdAdd, dst, flags.src);
+        emitter.emit(asmjit::x86::Inst::kIdMov, src, flags.src);
+        break;
+    case FlagsSource::TEST:
+        emitter.emit(asmjit::x86::Inst::kIdAnd, dst, flags.src);
+        emitter.mov(src, 0);
+        break;
+    case FlagsSource::LOGIC:
+        emitter.mov(src, 0);
+        break;
+    default:
+        return false;
+    }
+
+    emitter.mov(active, 1);
+
+    return true;
+}
+
+void JitCodeGenerator::trackFlags(FlagsState_t& flags, uint32_t instrId, const asmjit::Operand *ops, bool repeated)
+{
+    const auto& instrData = asmjit::x86::InstDB::infoById(instrId);
+    if ((instrData.executionInfo().specialRegsW() & k_SpecialFlags) == 0)
+    {
+        // The operands of the compare have to last until the exit.
+        if (flags.source == FlagsSource::ENTRY || flags.source == FlagsSource::HOST)
+            return;
+
+        uint32_t operandRegs = 1u << flags.dst.id();
+        if (flags.src.isReg())
+        {
+            operandRegs |= 1u << flags.src.id();
+        }
+
+        RegUsage_t usage;
+        addRegAccess(usage, instrId, ops, 4, repeated);
+        if (usage.written & operandRegs)
+        {
+            flags.source = FlagsSource::HOST;
+        }
+        return;
+    }
+
+    flags.source = FlagsSource::HOST;
+
+    auto isGuestGpd = [](const asmjit::Operand& op)
+    {
+        return op.isReg() && op.as<asmjit::x86::Reg>().isGpd() && op.id() != asmjit::x86::Gp::kIdSp;
+    };
+
+    if (!isGuestGpd(ops[0]) || !(isGuestGpd(ops[1]) || ops[1].isImm()))
+        return;
+
+    switch (instrId)
+    {
+    case asmjit::x86::Inst::kIdCmp:
+        flags.source = FlagsSource::COMPARE;
+        break;
+    case asmjit::x86::Inst::kIdSub:
+        // The source is gone as well.
+        if (ops[1].isReg() && ops[1].id() == ops[0].id())
+            return;
+        flags.source = FlagsSource::SUBTRACT;
+        break;
+    case asmjit::x86::Inst::kIdTest:
+        flags.source = FlagsSource::TEST;
+        break;
+    case asmjit::x86::Inst::kIdAnd:
+    case asmjit::x86::Inst::kIdOr:
+    case asmjit::x86::Inst::kIdXor:
+        flags.source = FlagsSource::LOGIC;
+        break;
+    default:
+        return;
+    }
+
+    flags.dst = ops[0].as<asmjit::x86::Gp>();
+    flags.src = ops[1];
+}
+
+bool JitCodeGenerator::generateBudgetCheck(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uint32_t instrCount)
 {
+    const auto& regBase = ctx.regContextBase;
+
+    uint32_t gpSize = emitter.gpSize();
+    int32_t budgetOffset = offsetof(VContextInternal, budget);
+    int32_t interruptOffset = offsetof(VContextInternal, interrupt);
+
+    // Return to the host instead of chaining when out of budget or interrupted,
+    // flags are already stored so they can be clobbered.
+    emitter.sub(asmjit::X86Mem(regBase, budgetOffset, gpSize), instrCount);
+    emitter.jle(ctx.layout.returnPath);
+    emitter.cmp(asmjit::x86::dword_ptr(regBase, interruptOffset), 0);
+    emitter.jne(ctx.layout.returnPath);
+
+    return true;
 }
 
-bool JitCodeGenerator::schedule(const Prefix& prefix, const MnemonicType mnemonic, Operand operands[4])
-{
-    _scheduled.emplace_back(prefix, mnemonic, operands);
+bool JitCodeGenerator::generateBranchExits(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, ArenaArray<JitTranslatorUnit::Exit>& exits)
+{
+    const auto& regBase = ctx.regContextBase;
+
+    // Chained units expect the context in the first argument register, on
+    // targets passing it on the stack the caller's argument is still valid.
+    asmjit::x86::Gp regArg = getContextArgReg(ctx.funcDetail, emitter, ctx.pinnedRegs);
+
+    // Guest state is stored at this point so anything else is free.
+    asmjit::x86::Gp regTemp;
+    getFreeRegs(emitter, regBase, regArg, &regTemp, 1, ctx.pinnedRegs);
+
+    uint32_t gpSize = emitter.gpSize();
+    int32_t nextIPOffset = offsetof(VContext, nextIP);
+
+    // Return sites go after the branches, the stubs embed the slot
+    // addresses so there are no more after this.
+    if (!_emulator->getUnitArena().allocate(exits, ctx.exits.size() + ctx.returnSites.size()))
+        return false;
+    ctx.exitSlots = &exits;
+
+    for (size_t i = 0; i < ctx.returnSites.size(); i++)
+    {
+        JitTranslatorUnit::Exit& exit = exits[ctx.exits.size() + i];
+        exit.targetIP = ctx.returnSites[i];
+        exit.target = nullptr;
+        exit.unlinked = nullptr;
+        exit.hits = 0;
+        exit.isReturnSite = true;
+    }
+
+    for (size_t i = 0; i < ctx.exits.size(); i++)
+    {
+        const BranchExit_t& branch = ctx.exits[i];
+
+        JitTranslatorUnit::Exit& exit = exits[i];
+        exit.targetIP = branch.targetIP;
+        exit.target = nullptr;
+        exit.unlinked = nullptr;
+        exit.hits = 0;
+        exit.isReturnSite = false;
+
+        emitter.bind(branch.label);
+
+        if (!generateContextStore(ctx, emitter, branch.flags))
+        {
+            return false;
+        }
+
+        emitter.mov(regTemp, asmjit::Imm((int64_t)branch.targetIP));
+        emitter.mov(asmjit::X86Mem(regBase, nextIPOffset, gpSize), regTemp);
+
+        emitAddress(ctx, emitter, regTemp, AddressKind::EXIT_HITS, (uint32_t)i);
+        emitter.add(asmjit::X86Mem(regTemp, 0, gpSize), 1);
+
+        if (branch.returnSite != -1)
+        {
+            if (!generateShadowPush(ctx, emitter, (uint32_t)(ctx.exits.size() + branch.returnSite)))
+            {
+                return false;
+            }
+        }
+
+        if (!generateBudgetCheck(ctx, emitter, branch.instrCount))
+        {
+            return false;
+        }
+
+        if (regArg.isValid() && regArg != regBase && !ctx.pinnedRegs)
+        {
+            emitter.mov(regArg, regBase);
+        }
+
+        // Either our own return path or the chain entry of the target.
+        emitAddress(ctx, emitter, regTemp, AddressKind::EXIT_TARGET, (uint32_t)i);
+        emitter.jmp(asmjit::X86Mem(regTemp, 0, gpSize));
+    }
 
     return true;
 }
 
-bool JitCodeGenerator::generate(asmjit::x86::Builder& builder)
+bool JitCodeGenerator::generateIndirectExits(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, ArenaArray<JitTranslatorUnit::Exit>& exits)
 {
-    GeneratorContext_t ctx;
-
-    for (const Instruction& instr : _scheduled)
+    for (const IndirectExit_t& exit : ctx.indirectExits)
     {
-        if (!generateInstruction(ctx, builder, instr))
+        emitter.bind(exit.label);
+
+        // Target first, it may depend on guest registers and the guest stack.
+        if (!generateIndirectTarget(ctx, emitter, exit))
         {
             return false;
         }
-    }
-    _scheduled.clear();
 
-    asmjit::CBNode *nodePreGenerated = builder.firstNode();
-    asmjit::CBNode *nodePostGenerated = builder.lastNode();
+        if (!generateContextStore(ctx, emitter, exit.flags))
+        {
+            return false;
+        }
 
-    ctx.funcDetail.init(asmjit::FuncSignatureT<void, void*>(asmjit::CallConv::kIdHost));
-    ctx.funcFrame.init(ctx.funcDetail);
+        if (exit.kind == IndirectKind::CALL)
+        {
+            if (!generateShadowPush(ctx, emitter, (uint32_t)(ctx.exits.size() + exit.returnSite)))
+            {
+                return false;
+            }
+        }
 
-    if (!analyseContextUsage(ctx, builder, nodePreGenerated, nodePostGenerated))
-    {
-        return false;
-    }
+        if (exit.kind == IndirectKind::RET)
+        {
+            // Falls through to the dispatch below if the prediction was wrong.
+            if (!generateShadowReturn(ctx, emitter, exit.instrCount))
+            {
+                return false;
+            }
+        }
+        else if (!generateBudgetCheck(ctx, emitter, exit.instrCount))
+        {
+            return false;
+        }
 
-    // Insert before first instruction.
-    if (!generateContextEntry(ctx, builder, nullptr))
-    {
-        return false;
+        if (!generateIndirectDispatch(ctx, emitter))
+        {
+            return false;
+        }
     }
 
-    // Insert after last.
-    if (!generateContextExit(ctx, builder, nodePostGenerated))
+    return true;
+}
+
+bool JitCodeGenerator::generateHaltExits(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter)
+{
+    for (const HaltExit_t& exit : ctx.haltExits)
     {
-        return false;
+        emitter.bind(exit.label);
+
+        if (!generateHalt(ctx, emitter, exit.vIP, exit.instrCount, exit.flags))
+        {
+            return false;
+        }
+
+        emitter.jmp(ctx.layout.returnPath);
     }
 
     return true;
 }
 
-
-int32_t getGPRegisterOffset(const asmjit::x86::Reg& reg)
+bool JitCodeGenerator::generateHotPath(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter)
 {
-    if (reg.isGp())
-    {
-        uint32_t idx = reg.id();
-        return (int32_t)offsetof(VContext, gpRegs[idx]);
-    }
-    else
+    if (!ctx.execCounter)
     {
-        // TODO: Add other reg types.
+        return true;
     }
-    return 0;
+
+    const auto& regBase = ctx.regContextBase;
+
+    asmjit::x86::Gp regTemp;
+    getFreeRegs(emitter, regBase, asmjit::x86::Gp(), &regTemp, 1, ctx.pinnedRegs);
+
+    uint32_t gpSize = emitter.gpSize();
+
+    emitter.bind(ctx.hotPath);
+
+    // Nothing of the guest state is loaded yet, hand the unit back to the
+    // dispatcher as if it was never entered.
+    emitter.cmp(asmjit::x86::dword_ptr(regBase, offsetof(VContextInternal, profiling)), 0);
+    emitter.je(ctx.hotResume);
+    emitter.mov(regTemp, asmjit::Imm((int64_t)_virtualIP));
+    emitter.mov(asmjit::X86Mem(regBase, offsetof(VContext, nextIP), gpSize), regTemp);
+    emitter.mov(asmjit::x86::dword_ptr(regBase, offsetof(VContextInternal, hotRequested)), 1);
+    emitter.jmp(ctx.layout.returnPath);
+
+    return true;
 }
 
-int32_t getEFlagsOffset()
+bool JitCodeGenerator::generateShadowPush(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uint32_t returnIndex)
 {
-    return offsetof(VContext, flags);
+    const JitTranslatorUnit::Exit& returnExit = (*ctx.exitSlots)[returnIndex];
+
+    const auto& regBase = ctx.regContextBase;
+    asmjit::x86::Gp regArg = getContextArgReg(ctx.funcDetail, emitter, ctx.pinnedRegs);
+
+    asmjit::x86::Gp regs[2];
+    getFreeRegs(emitter, regBase, regArg, regs, 2, ctx.pinnedRegs);
+
+    const auto& regEntry = regs[0];
+    const auto& regTemp = regs[1];
+
+    uint32_t gpSize = emitter.gpSize();
+    uint32_t entryShift = asmjit::Support::ctz((uint32_t)sizeof(ShadowStackEntry));
+    int32_t topOffset = offsetof(VContextInternal, shadowStack.top);
+    int32_t entriesOffset = offsetof(VContextInternal, shadowStack.entries);
+
+    emitter.mov(regEntry.r32(), asmjit::x86::dword_ptr(regBase, topOffset));
+    emitter.inc(regEntry.r32());
+    emitter.and_(regEntry.r32(), ShadowStack::k_NumEntries - 1);
+    emitter.mov(asmjit::x86::dword_ptr(regBase, topOffset), regEntry.r32());
+    emitter.shl(regEntry.r32(), entryShift);
+    emitter.lea(regEntry, asmjit::X86Mem(regBase, regEntry, 0, entriesOffset));
+
+    emitter.mov(regTemp, asmjit::Imm((int64_t)returnExit.targetIP));
+    emitter.mov(asmjit::X86Mem(regEntry, offsetof(ShadowStackEntry, returnIP), gpSize), regTemp);
+
+    // The slot rather than its value so linking the return site later is picked up.
+    emitAddress(ctx, emitter, regTemp, AddressKind::EXIT_TARGET, returnIndex);
+    emitter.mov(asmjit::X86Mem(regEntry, offsetof(ShadowStackEntry, continuation), gpSize), regTemp);
+
+    emitAddress(ctx, emitter, regTemp, AddressKind::SHADOW_EPOCH);
+    emitter.mov(regTemp, asmjit::X86Mem(regTemp, 0, gpSize));
+    emitter.mov(asmjit::X86Mem(regEntry, offsetof(ShadowStackEntry, epoch), gpSize), regTemp);
+
+    return true;
 }
 
-bool JitCodeGenerator::generateContextEntry(GeneratorContext_t& ctx, asmjit::x86::Builder& builder, asmjit::CBNode *nodePos)
+bool JitCodeGenerator::generateShadowReturn(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uint32_t instrCount)
 {
     const auto& regBase = ctx.regContextBase;
+    asmjit::x86::Gp regArg = getContextArgReg(ctx.funcDetail, emitter, ctx.pinnedRegs);
 
-    builder.setCursor(nodePos);
+    asmjit::x86::Gp regs[3];
+    getFreeRegs(emitter, regBase, regArg, regs, 3, ctx.pinnedRegs);
 
-    asmjit::FuncArgsAssignment args(&ctx.funcDetail);
-    args.assignAll(regBase);
+    const auto& regIndex = regs[0];
+    const auto& regEntry = regs[1];
+    const auto& regTemp = regs[2];
 
-    builder.emitProlog(ctx.funcFrame);
-    builder.emitArgsAssignment(ctx.funcFrame, args);
+    uint32_t gpSize = emitter.gpSize();
+    uint32_t entryShift = asmjit::Support::ctz((uint32_t)sizeof(ShadowStackEntry));
+    int32_t topOffset = offsetof(VContextInternal, shadowStack.top);
+    int32_t entriesOffset = offsetof(VContextInternal, shadowStack.entries);
 
-    uint32_t gpSize = builder.gpSize();
+    // Pop before the budget check so a return to the host keeps the stack balanced.
+    emitter.mov(regIndex.r32(), asmjit::x86::dword_ptr(regBase, topOffset));
+    emitter.lea(regEntry.r32(), asmjit::x86::dword_ptr(regIndex, -1));
+    emitter.and_(regEntry.r32(), ShadowStack::k_NumEntries - 1);
+    emitter.mov(asmjit::x86::dword_ptr(regBase, topOffset), regEntry.r32());
+    emitter.shl(regIndex.r32(), entryShift);
+    emitter.lea(regEntry, asmjit::X86Mem(regBase, regIndex, 0, entriesOffset));
 
-    // Set flags if input is required.
-    // NOTE: We spill eax/rax but its okay since registers are set after.
-    if (ctx.flagsIn != 0)
+    // Leaves the registers alone.
+    if (!generateBudgetCheck(ctx, emitter, instrCount))
     {
-        int32_t flagsOffset = offsetof(VContext, flags);
-
-        builder.push(asmjit::x86::ptr(regBase, flagsOffset));
-        builder.popfd();
+        return false;
     }
 
-    // Write all input registers.
-    for (auto& regIn : ctx.regsRead)
-    {
-        int32_t regOffset = getGPRegisterOffset(regIn);
+    asmjit::Label mispredicted = emitter.newLabel();
 
-        if (regIn.isGp())
-        {
-            const asmjit::X86Gp& reg = builder.gpz(regIn.id());
-            builder.mov(reg, asmjit::X86Mem(regBase, regOffset, gpSize));
-        }
-        else
-        {
-            // TODO: Add other reg types.
-        }
+    emitter.mov(regTemp, asmjit::X86Mem(regBase, offsetof(VContext, nextIP), gpSize));
+    emitter.cmp(asmjit::X86Mem(regEntry, offsetof(ShadowStackEntry, returnIP), gpSize), regTemp);
+    emitter.jne(mispredicted);
+    emitAddress(ctx, emitter, regTemp, AddressKind::SHADOW_EPOCH);
+    emitter.mov(regTemp, asmjit::X86Mem(regTemp, 0, gpSize));
+    emitter.cmp(asmjit::X86Mem(regEntry, offsetof(ShadowStackEntry, epoch), gpSize), regTemp);
+    emitter.jne(mispredicted);
+
+    emitAddress(ctx, emitter, regTemp, AddressKind::SHADOW_HITS);
+    emitter.add(asmjit::X86Mem(regTemp, 0, gpSize), 1);
+
+    // Either the return site's chain entry or the caller's return path.
+    emitter.mov(regTemp, asmjit::X86Mem(regEntry, offsetof(ShadowStackEntry, continuation), gpSize));
+    if (regArg.isValid() && regArg != regBase && !ctx.pinnedRegs)
+    {
+        emitter.mov(regArg, regBase);
     }
+    emitter.jmp(asmjit::X86Mem(regTemp, 0, gpSize));
+
+    emitter.bind(mispredicted);
+    emitAddress(ctx, emitter, regTemp, AddressKind::SHADOW_MISSES);
+    emitter.add(asmjit::X86Mem(regTemp, 0, gpSize), 1);
 
     return true;
 }
 
-bool JitCodeGenerator::generateContextExit(GeneratorContext_t& ctx, asmjit::x86::Builder& builder, asmjit::CBNode *nodePos)
+bool JitCodeGenerator::generateIndirectTarget(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const IndirectExit_t& exit)
 {
-    const auto& zax = builder.zax();
-    const auto& zcx = builder.zcx();
     const auto& regBase = ctx.regContextBase;
+    const auto& zsp = emitter.zsp();
+
+    uint32_t gpSize = emitter.gpSize();
+    asmjit::X86Mem nextIP(regBase, offsetof(VContext, nextIP), gpSize);
 
-    auto regTemp = zax;
-    if (regBase == regTemp)
+    if (exit.kind == IndirectKind::RET)
     {
-        regTemp = zcx;
-    }
+        emitter.pop(nextIP);
 
-    builder.setCursor(nodePos);
+        if (exit.stackAdjust != 0)
+        {
+            emitter.lea(zsp, asmjit::X86Mem(zsp, exit.stackAdjust));
+        }
 
-    uint32_t gpSize = builder.gpSize();
+        return true;
+    }
 
-    if (ctx.flagsOut != 0)
+    asmjit::Operand target = convertOperand(exit.target);
+    if (target.isReg())
     {
-        // Store the flags so we can spill any we want.
-        builder.pushfd();
+        const asmjit::x86::Reg& reg = target.as<asmjit::x86::Reg>();
+        emitter.mov(nextIP, emitter.gpz(reg.id()));
     }
-
-    // Write all output registers.
-    for (auto& regIn : ctx.regsRead)
+    else if (target.isMem())
     {
-        int32_t regOffset = getGPRegisterOffset(regIn);
+        asmjit::x86::Mem& mem = target.as<asmjit::x86::Mem>();
+        mem.setSize(gpSize);
 
-        if (regIn.isGp())
-        {
-            const asmjit::X86Gp& reg = builder.gpz(regIn.id());
-            builder.mov(asmjit::X86Mem(regBase, regOffset, gpSize), reg);
-        }
-        else
+        // No memory to memory move, borrow a register through the scratch slot.
+        auto regTemp = emitter.zax();
+        if (regTemp == regBase)
         {
-            // TODO: Add other reg types.
+            regTemp = emitter.zcx();
         }
+
+        asmjit::X86Mem scratch(regBase, offsetof(VContextInternal, scratch), gpSize);
+
+        emitter.mov(scratch, regTemp);
+        emitter.mov(regTemp, mem);
+        emitter.mov(nextIP, regTemp);
+        emitter.mov(regTemp, scratch);
+    }
+    else
+    {
+        return false;
     }
 
-    // Set flags in vctx.
-    if (ctx.flagsOut != 0)
+    if (exit.kind == IndirectKind::CALL)
     {
-        int32_t flagsOffset = offsetof(VContext, flags);
+        pushReturnAddress(emitter, exit.returnIP);
+    }
+
+    return true;
+}
+
+bool JitCodeGenerator::generateIndirectDispatch(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter)
+{
+    const auto& regBase = ctx.regContextBase;
+    asmjit::x86::Gp regArg = getContextArgReg(ctx.funcDetail, emitter, ctx.pinnedRegs);
+
+    asmjit::x86::Gp regs[3];
+    getFreeRegs(emitter, regBase, regArg, regs, 3, ctx.pinnedRegs);
+
+    const auto& regIP = regs[0];
+    const auto& regEntry = regs[1];
+    const auto& regTemp = regs[2];
+
+    uint32_t gpSize = emitter.gpSize();
+    uint32_t entryShift = asmjit::Support::ctz((uint32_t)sizeof(IndirectBranchCache::Entry));
 
-        builder.pop(regTemp);
-        builder.mov(asmjit::x86::dword_ptr(regBase, flagsOffset), regTemp.r32());
+    asmjit::Label miss = emitter.newLabel();
+
+    // Same hash as IndirectBranchCache::indexOf.
+    emitter.mov(regIP, asmjit::X86Mem(regBase, offsetof(VContext, nextIP), gpSize));
+    emitter.mov(regEntry, regIP);
+    emitter.shr(regEntry, 12);
+    emitter.xor_(regEntry, regIP);
+    emitter.and_(regEntry, IndirectBranchCache::k_NumEntries - 1);
+    emitter.shl(regEntry, entryShift);
+    emitAddress(ctx, emitter, regTemp, AddressKind::INDIRECT_ENTRIES);
+    emitter.add(regEntry, regTemp);
+
+    emitter.cmp(asmjit::X86Mem(regEntry, offsetof(IndirectBranchCache::Entry, vIP), gpSize), regIP);
+    emitter.jne(miss);
+
+    emitAddress(ctx, emitter, regTemp, AddressKind::INDIRECT_HITS);
+    emitter.add(asmjit::X86Mem(regTemp, 0, gpSize), 1);
+
+    emitter.mov(regTemp, asmjit::X86Mem(regEntry, offsetof(IndirectBranchCache::Entry, code), gpSize));
+    if (regArg.isValid() && regArg != regBase && !ctx.pinnedRegs)
+    {
+        emitter.mov(regArg, regBase);
     }
+    emitter.jmp(regTemp);
 
-    builder.emitEpilog(ctx.funcFrame);
+    // Let the dispatcher look it up and fill the entry.
+    emitter.bind(miss);
+    emitAddress(ctx, emitter, regTemp, AddressKind::INDIRECT_MISSES);
+    emitter.add(asmjit::X86Mem(regTemp, 0, gpSize), 1);
+    emitter.jmp(ctx.layout.returnPath);
 
     return true;
 }
 
-bool JitCodeGenerator::generateInstruction(GeneratorContext_t& ctx, asmjit::x86::Builder& builder, const Instruction& instr)
+bool JitCodeGenerator::generateInstruction(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, const Instruction& instr)
 {
     uint32_t instrId = convertMnemonic(instr.mnemonic);
 
@@ -177,95 +1929,338 @@ bool JitCodeGenerator::generateInstruction(GeneratorContext_t& ctx, asmjit::x86:
     const asmjit::Operand op2 = convertOperand(instr.operands[2]);
     const asmjit::Operand op3 = convertOperand(instr.operands[3]);
 
+    // Also what the optimizer leaves of removed instructions, they still
+    // count for the budget.
+    if (instr.mnemonic == MnemonicType::I_NOP)
+    {
+        return true;
+    }
+
+    if (instr.mnemonic == MnemonicType::I_HLT)
+    {
+        HaltExit_t exit;
+        exit.vIP = ctx.blockIP;
+        exit.instrCount = ctx.instrIndex;
+        exit.label = emitter.newLabel();
+        exit.flags = ctx.flags;
+        ctx.haltExits.push_back(exit);
+
+        emitter.jmp(exit.label);
+
+        return true;
+    }
+
+    if (instr.mnemonic == MnemonicType::I_RET)
+    {
+        IndirectExit_t exit;
+        exit.kind = IndirectKind::RET;
+        exit.target = {};
+        exit.returnIP = 0;
+        exit.stackAdjust = instr.operands[0].type == OperandType::IMM ? instr.operands[0].imm.val.u16 : 0;
+        exit.instrCount = ctx.instrIndex;
+        exit.label = emitter.newLabel();
+        exit.flags = ctx.flags;
+        ctx.indirectExits.push_back(exit);
+
+        emitter.jmp(exit.label);
+
+        return true;
+    }
+
+    if (instr.mnemonic == MnemonicType::I_CALL && instr.operands[0].type == OperandType::IMM)
+    {
+        uintptr_t returnIP = getBranchTarget(instr.operands[1]);
+        pushReturnAddress(emitter, returnIP);
+
+        BranchExit_t exit;
+        exit.targetIP = getBranchTarget(instr.operands[0]);
+        exit.instrCount = ctx.instrIndex;
+        exit.label = emitter.newLabel();
+        exit.flags = ctx.flags;
+        exit.returnSite = (int32_t)ctx.returnSites.size();
+        ctx.exits.push_back(exit);
+        ctx.returnSites.push_back(returnIP);
+
+        emitter.jmp(exit.label);
+
+        return true;
+    }
+
+    if (instr.mnemonic == MnemonicType::I_CALL || (instr.mnemonic == MnemonicType::I_JMP && instr.operands[0].type != OperandType::IMM))
+    {
+        IndirectExit_t exit;
+        exit.kind = instr.mnemonic == MnemonicType::I_CALL ? IndirectKind::CALL : IndirectKind::JMP;
+        exit.target = instr.operands[0];
+        exit.returnIP = instr.mnemonic == MnemonicType::I_CALL ? getBranchTarget(instr.operands[1]) : 0;
+        exit.stackAdjust = 0;
+        exit.instrCount = ctx.instrIndex;
+        exit.label = emitter.newLabel();
+        exit.flags = ctx.flags;
+        if (exit.kind == IndirectKind::CALL)
+        {
+            exit.returnSite = (int32_t)ctx.returnSites.size();
+            ctx.returnSites.push_back(exit.returnIP);
+        }
+        ctx.indirectExits.push_back(exit);
+
+        emitter.jmp(exit.label);
+
+        return true;
+    }
+
+    if (isBranchInstruction(instrId) && instr.operands[0].type == OperandType::IMM)
+    {
+        BranchExit_t exit;
+        exit.targetIP = getBranchTarget(instr.operands[0]);
+        exit.instrCount = ctx.instrIndex;
+        exit.label = emitter.newLabel();
+        exit.flags = ctx.flags;
+        ctx.exits.push_back(exit);
+
+        emitter.emit(instrId, exit.label);
+
+        return true;
+    }
+
+    // Unmapped, asmjit would emit nothing for it.
+    if (instrId == asmjit::x86::Inst::kIdNone)
+    {
+        return false;
+    }
+
+    bool repeated = instr.prefix == Prefix::REP || instr.prefix == Prefix::REPNE;
+    const asmjit::Operand ops[4] = { op0, op1, op2, op3 };
+    trackFlags(ctx.flags, instrId, ops, repeated);
+
     if (instr.prefix == Prefix::LOCK)
-        builder.lock();
+        emitter.lock();
     else if (instr.prefix == Prefix::REP)
-        builder.rep();
+        emitter.rep();
     else if (instr.prefix == Prefix::REPNE)
-        builder.repne();
+        emitter.repne();
 
-    builder.emit(instrId, op0, op1, op2, op3);
+    emitter.emit(instrId, op0, op1, op2, op3);
 
     return true;
 }
 
 bool JitCodeGenerator::analyseContextUsage(GeneratorContext_t& ctx, asmjit::x86::Builder& builder, asmjit::CBNode *nodeStart, asmjit::CBNode *nodeEnd)
 {
-    asmjit::CBNode *node = nodeStart;
+    RegUsage_t usage;
 
+    asmjit::CBNode *node = nodeStart;
     while (node != nullptr)
     {
         if (node->isInst())
         {
             asmjit::CBInst *inst = node->as<asmjit::CBInst>();
-            asmjit::Operand *ops = inst->operands();
 
             const auto& instrData = asmjit::x86::InstDB::infoById(inst->id());
             ctx.flagsIn |= instrData.executionInfo().specialRegsR();
             ctx.flagsOut |= instrData.executionInfo().specialRegsW();
 
-            for (size_t n = 0; n < inst->opCount(); n++)
+            if (isStackInstruction(inst->id()))
+            {
+                ctx.usesStack = true;
+            }
+
+            // Branches in the body only ever jump to exit stubs.
+            if (inst->id() == asmjit::x86::Inst::kIdJmp || isBranchInstruction(inst->id()))
             {
-                asmjit::Operand& op = ops[n];
-                if (op.isReg())
-                {
-                    asmjit::x86::Reg& reg = static_cast<asmjit::x86::Reg&>(op);
-
-                    uint32_t regMask = 1u << reg.id();
-                    //if (!(ctx.funcFrame.dirtyRegs(reg.group()) & regId))
-                    {
-                        // FIXME: This is currently not correct, look if asmjit has infos about operand access.
-                        ctx.regsRead.insert(reg.clone());
-                        ctx.regsModified.insert(reg.clone());
-
-                        ctx.funcFrame.addDirtyReg(reg);
-                    }
-                }
-                else if (op.isMem())
-                {
-                    asmjit::x86::Mem& mem = static_cast<asmjit::x86::Mem&>(op);
-
-                    if (mem.hasBase())
-                    {
-                        uint32_t regId = mem.baseId();
-                        uint32_t regMask = 1u << regId;
-                        //if (!(ctx.funcFrame.dirtyRegs(asmjit::x86::Reg::kGroupGp) & regMask))
-                        {
-                            ctx.regsRead.insert(builder.gpz(regId));
-                            ctx.funcFrame.addDirtyRegs(asmjit::x86::Reg::kGroupGp, regMask);
-                        }
-                    }
-                    if (mem.hasIndex())
-                    {
-                        uint32_t regId = mem.indexId();
-                        uint32_t regMask = 1u << regId;
-                        //if (!(ctx.funcFrame.dirtyRegs(asmjit::x86::Reg::kGroupGp) & regMask))
-                        {
-                            ctx.regsRead.insert(builder.gpz(regId));
-                            ctx.funcFrame.addDirtyRegs(asmjit::x86::Reg::kGroupGp, regMask);
-                        }
-                    }
-                }
+                addExit(usage);
             }
+
+            bool repeated = (inst->instOptions() & (asmjit::x86::Inst::kOptionRep | asmjit::x86::Inst::kOptionRepne)) != 0;
+            addRegAccess(usage, inst->id(), inst->operands(), inst->opCount(), repeated);
         }
         node = node->next();
     }
 
+    // Operands of indirect exits are only evaluated in the out of line stubs.
+    for (const IndirectExit_t& exit : ctx.indirectExits)
+    {
+        if (exit.kind != IndirectKind::JMP)
+        {
+            ctx.usesStack = true;
+        }
+
+        const Operand& target = exit.target;
+        if (target.type == OperandType::REG)
+        {
+            usage.read |= 1u << target.reg.localId();
+        }
+        else if (target.type == OperandType::MEMORY)
+        {
+            if (target.mem.regBase != RegisterIndex::NONE)
+                usage.read |= 1u << getLocalRegisterId(target.mem.regBase);
+            if (target.mem.regIndex != RegisterIndex::NONE)
+                usage.read |= 1u << getLocalRegisterId(target.mem.regIndex);
+        }
+    }
+
+    analyseFlags(ctx);
+    addContextRegs(ctx, *builder.as<asmjit::x86::Emitter>(), usage.read | (usage.written & ~usage.definedAtExits), usage.written);
+
+    return selectContextBase(ctx, *builder.as<asmjit::x86::Emitter>());
+}
+
+bool JitCodeGenerator::analyseInstructions(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter)
+{
+    // Same rules as analyseContextUsage, the operands of indirect exits are
+    // part of the instructions here.
+    RegUsage_t usage;
+    for (const Instruction& instr : _scheduled)
+    {
+        uint32_t instrId = convertMnemonic(instr.mnemonic);
+
+        const auto& instrData = asmjit::x86::InstDB::infoById(instrId);
+        ctx.flagsIn |= instrData.executionInfo().specialRegsR();
+        ctx.flagsOut |= instrData.executionInfo().specialRegsW();
+
+        if (instr.mnemonic == MnemonicType::I_CALL || instr.mnemonic == MnemonicType::I_RET ||
+            isStackInstruction(instrId))
+        {
+            ctx.usesStack = true;
+        }
+
+        if (isExitInstruction(instr, instrId))
+        {
+            addExit(usage);
+        }
+
+        asmjit::Operand ops[4];
+        for (size_t n = 0; n < 4; n++)
+        {
+            ops[n] = convertOperand(instr.operands[n]);
+        }
+
+        bool repeated = instr.prefix == Prefix::REP || instr.prefix == Prefix::REPNE;
+        addRegAccess(usage, instrId, ops, 4, repeated);
+    }
+
+    analyseFlags(ctx);
+    addContextRegs(ctx, emitter, usage.read | (usage.written & ~usage.definedAtExits), usage.written);
+
+    return selectContextBase(ctx, emitter);
+}
+
+void JitCodeGenerator::analyseFlags(GeneratorContext_t& ctx)
+{
+    // Anything besides the status flags needs all of EFLAGS in the host.
+    ctx.flagsLazy = ((ctx.flagsIn | ctx.flagsOut) & k_SpecialFlags & ~k_SpecialStatus) == 0;
+
+    // Flags pushfd stores at an exit, nothing is stored before the first
+    // write and compares are stored without the host flags.
+    const uint32_t hostStore = ctx.flagsLazy ? k_SpecialStatus : k_SpecialFlags;
+    auto getExitUse = [&](const FlagsState_t& flags, bool halt)
+    {
+        if (flags.source == FlagsSource::ENTRY)
+            return 0u;
+        if (halt || flags.source == FlagsSource::HOST || !ctx.flagsLazy)
+            return hostStore;
+        return 0u;
+    };
+
+    // Same walk as generateBody, exits see the flags as generateInstruction
+    // records them.
+    std::vector<uint32_t>& exitUses = _flagsScratch;
+    exitUses.assign(_scheduled.size() + 1, 0);
+
+    FlagsState_t flags;
+    for (size_t i = 0; i < _scheduled.size(); i++)
+    {
+        const Instruction& instr = _scheduled[i];
+        uint32_t instrId = convertMnemonic(instr.mnemonic);
+
+        if (isExitInstruction(instr, instrId))
+        {
+            exitUses[i] = getExitUse(flags, instr.mnemonic == MnemonicType::I_HLT);
+            continue;
+        }
+
+        asmjit::Operand ops[4];
+        for (size_t n = 0; n < 4; n++)
+        {
+            ops[n] = convertOperand(instr.operands[n]);
+        }
+
+        bool repeated = instr.prefix == Prefix::REP || instr.prefix == Prefix::REPNE;
+        trackFlags(flags, instrId, ops, repeated);
+    }
+    // Falling off the end halts.
+    exitUses[_scheduled.size()] = getExitUse(flags, true);
+
+    // Backwards, a flag is live if it is read or stored before the next
+    // instruction that always writes it.
+    uint32_t live = exitUses[_scheduled.size()];
+    for (size_t i = _scheduled.size(); i-- > 0;)
+    {
+        const Instruction& instr = _scheduled[i];
+        uint32_t instrId = convertMnemonic(instr.mnemonic);
+
+        const auto& instrData = asmjit::x86::InstDB::infoById(instrId);
+
+        live &= ~getFlagsKilled(instr, instrId);
+        live |= instrData.executionInfo().specialRegsR() & k_SpecialFlags;
+        live |= exitUses[i];
+    }
+
+    ctx.flagsLoad = live != 0;
+}
+
+void JitCodeGenerator::addContextRegs(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter, uint32_t regsRead, uint32_t regsModified)
+{
+    const uint32_t spMask = 1u << asmjit::x86::Gp::kIdSp;
+
+    // Guest stack pointer is switched in and out separately.
+    if ((regsRead | regsModified) & spMask)
+    {
+        ctx.usesStack = true;
+        regsRead &= ~spMask;
+        regsModified &= ~spMask;
+    }
+
+    // Already in place.
+    regsRead &= ~ctx.pinnedRegs;
+    regsModified &= ~ctx.pinnedRegs;
+
+    asmjit::Support::BitWordIterator<uint32_t> itRead(regsRead);
+    while (itRead.hasNext())
+    {
+        ctx.regsRead.insert(emitter.gpz(itRead.next()));
+    }
+
+    asmjit::Support::BitWordIterator<uint32_t> itModified(regsModified);
+    while (itModified.hasNext())
+    {
+        ctx.regsModified.insert(emitter.gpz(itModified.next()));
+    }
+
+    ctx.funcFrame.addDirtyRegs(asmjit::x86::Reg::kGroupGp, regsRead | regsModified | ctx.pinnedRegs);
+}
+
+bool JitCodeGenerator::selectContextBase(GeneratorContext_t& ctx, asmjit::x86::Emitter& emitter)
+{
     const auto& rsp = asmjit::x86::rsp;
     const auto& rbp = asmjit::x86::rbp;
 
     uint32_t dirtyRegs = ctx.funcFrame.dirtyRegs(asmjit::x86::Reg::kGroupGp);
 
-    uint32_t count = builder.gpCount();
-    for (uint32_t i = 0; i < count; i++)
+    // Chained units with pinned registers pass the context in the same
+    // register, it is only taken if the guest leaves it alone.
+    uint32_t count = emitter.gpCount();
+    uint32_t first = ctx.pinnedRegs ? k_PinnedBase : 0;
+    for (uint32_t n = 0; n < count; n++)
     {
+        uint32_t i = (first + n) % count;
+
         if (i == rsp.id() || i == rbp.id())
         {
             // Can not touch stack.
             continue;
         }
 
-        auto reg = builder.gpz(i);
+        auto reg = emitter.gpz(i);
         auto mask = 1u << i;
 
         if ((dirtyRegs & mask) == 0)
@@ -279,9 +2274,15 @@ bool JitCodeGenerator::analyseContextUsage(GeneratorContext_t& ctx, asmjit::x86:
         }
     }
 
+    // All units save the same registers so chained units can share the
+    // frame of whichever unit was entered from the host.
+    uint32_t frameMask = asmjit::Support::lsbMask<uint32_t>(count) & ~(1u << rsp.id());
+    ctx.funcFrame.addDirtyRegs(asmjit::x86::Reg::kGroupGp, frameMask);
+
     ctx.funcFrame.finalize();
 
-    return true;
+    // Every register is taken by the guest.
+    return ctx.regContextBase.isValid();
 }
 
 }
@@ -1,34 +1,191 @@
 #include "jitemulator.h"
 #include "jitcodegenerator.h"
+#include "tracebuilder.h"
+
+#include <algorithm>
+#include <memory>
 
 namespace x86box {
 
 JitEmulator::JitEmulator()
+    : _translator(nullptr),
+    _instructionBudget(0),
+    _tierUpThreshold(k_DefaultTierUpThreshold),
+    _nextSerial(0),
+    _compilePool(this),
+    _codeBytes(0),
+    _codeCacheLimit(0),
+    _evictThreshold(0),
+    _useClock(0),
+    _evictedUnits(0),
+    _codeWrites(0),
+    _threadSafe(false),
+    _pinRegisters(false)
 {
 }
 
 JitEmulator::~JitEmulator()
 {
+    _compilePool.shutdown();
+    installCompiled();
+    releaseAllUnits();
+    _reclaimer.drain();
+    _translationCache.close();
+    _writeWatch.disable();
+}
+
+asmjit::Error JitEmulator::addCode(void **func, asmjit::CodeHolder *code)
+{
+    std::lock_guard<std::mutex> lock(_runtimeLock);
+    return _runtime.add(func, code);
 }
 
-TranslatorUnit* JitEmulator::findUnit(uintptr_t vIP)
+void JitEmulator::shareCode(void *base, const std::vector<void*>& funcs)
 {
-    auto itr = _units.find(vIP);
-    if (itr != _units.end())
+    std::lock_guard<std::mutex> lock(_runtimeLock);
+
+    for (void *func : funcs)
     {
-        return itr->second.get();
+        _sharedFuncs[func] = base;
+    }
+    _sharedRefs[base] += funcs.size();
+}
+
+void JitEmulator::retireCode(void *func, ArenaArray<JitTranslatorUnit::Exit>& exits)
+{
+    if (!_threadSafe)
+    {
+        releaseCode(func);
+        _unitArena.release(exits);
+        return;
     }
-    return nullptr;
+
+    // The stubs jump through the exit slots, they go with the code.
+    ArenaArray<JitTranslatorUnit::Exit> slots = exits;
+    exits = ArenaArray<JitTranslatorUnit::Exit>();
+
+    _reclaimer.retire([this, func, slots]() mutable
+    {
+        releaseCode(func);
+        _unitArena.release(slots);
+    });
 }
 
-TranslatorUnit* JitEmulator::createUnit(uintptr_t vIP)
+void JitEmulator::releaseCode(void *func)
 {
-    TranslatorUnit* unit = findUnit(vIP);
+    std::lock_guard<std::mutex> lock(_runtimeLock);
+
+    auto itr = _sharedFuncs.find(func);
+    if (itr == _sharedFuncs.end())
+    {
+        _runtime.release(func);
+        return;
+    }
+
+    void *base = itr->second;
+    _sharedFuncs.erase(itr);
+
+    auto refs = _sharedRefs.find(base);
+    if (--refs->second == 0)
+    {
+        _sharedRefs.erase(refs);
+        _runtime.release(base);
+    }
+}
+
+JitCodeGenerator* JitEmulator::acquireGenerator(uintptr_t vIP)
+{
+    if (_generators.empty())
+    {
+        return new JitCodeGenerator(this, vIP);
+    }
+
+    JitCodeGenerator *generator = _generators.back().release();
+    _generators.pop_back();
+
+    generator->reset(vIP);
+    return generator;
+}
+
+void JitEmulator::releaseGenerator(JitCodeGenerator *generator)
+{
+    generator->discard();
+    _generators.emplace_back(generator);
+}
+
+void JitEmulator::onCodeReady()
+{
+    std::lock_guard<std::mutex> lock(_activeLock);
+    for (VContextInternal *ctx : _activeContexts)
+    {
+        ctx->interrupt |= k_InterruptInstall;
+    }
+}
+
+void JitEmulator::setActive(VContextInternal *ctx, bool active)
+{
+    std::lock_guard<std::mutex> lock(_activeLock);
+
+    if (active)
+    {
+        _activeContexts.push_back(ctx);
+    }
+    else
+    {
+        _activeContexts.erase(std::remove(_activeContexts.begin(), _activeContexts.end(), ctx), _activeContexts.end());
+    }
+
+    // Any thread can invalidate the written pages for all of them.
+    _writeWatch.setInterrupt(_activeContexts.empty() ? nullptr : &_activeContexts.front()->interrupt);
+}
+
+std::unique_lock<std::recursive_mutex> JitEmulator::lockUnits()
+{
+    if (!_threadSafe)
+    {
+        return std::unique_lock<std::recursive_mutex>();
+    }
+
+    return std::unique_lock<std::recursive_mutex>(_unitsLock);
+}
+
+JitTranslatorUnit* JitEmulator::findUnit(uintptr_t vIP)
+{
+    // The dispatch cache holds plain pairs another thread could see torn.
+    if (_threadSafe)
+    {
+        return _units.find(vIP);
+    }
+
+    JitTranslatorUnit *unit = _dispatchCache.lookup(vIP);
+    if (unit)
+    {
+        return unit;
+    }
+
+    unit = _units.find(vIP);
+    if (unit)
+    {
+        _dispatchCache.insert(vIP, unit);
+    }
+    return unit;
+}
+
+JitTranslatorUnit* JitEmulator::createUnit(uintptr_t vIP)
+{
+    std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+    JitTranslatorUnit* unit = findUnit(vIP);
     if(unit)
         return unit;
 
-    auto it = _units.emplace(vIP, std::make_unique<TranslatorUnit>(this, vIP));
-    return (*it.first).second.get();
+    unit = _units.emplace(vIP, this);
+    if (unit && !_threadSafe)
+    {
+        _dispatchCache.insert(vIP, unit);
+    }
+
+    return unit;
 }
 
 void JitEmulator::releaseUnit(TranslatorUnit *unit)
@@ -36,12 +193,815 @@ void JitEmulator::releaseUnit(TranslatorUnit *unit)
     if(!unit)
         return;
 
+    std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+    _dispatchCache.invalidate(unit->getVirtualIP());
+    _indirectCache.invalidate(unit->getVirtualIP());
+
+    // Unlinked right away, the table may keep the unit itself around until
+    // no thread can be inside it.
+    unit->reset();
     _units.erase(unit->getVirtualIP());
 }
 
 void JitEmulator::releaseAllUnits()
 {
+    std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+    if (_threadSafe)
+    {
+        std::vector<JitTranslatorUnit*> units;
+        _units.forEach([&units](JitTranslatorUnit *unit)
+        {
+            units.push_back(unit);
+        });
+
+        for (JitTranslatorUnit *unit : units)
+        {
+            releaseUnit(unit);
+        }
+        return;
+    }
+
+    _dispatchCache.flush();
+    _indirectCache.flush();
+    _shadowStackState.epoch++;
+    _exitsByTarget.clear();
+    _rangeIndex.clear();
     _units.clear();
 }
 
+size_t JitEmulator::invalidateRange(uintptr_t start, size_t size)
+{
+    std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+    std::vector<JitTranslatorUnit*> units;
+    _rangeIndex.query(start, size, units);
+
+    for (JitTranslatorUnit *unit : units)
+    {
+        releaseUnit(unit);
+    }
+
+    return units.size();
+}
+
+size_t JitEmulator::generateBatch(const BatchEntry *entries, size_t count)
+{
+    std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+    CompileTier tier = _tierUpThreshold != 0 ? CompileTier::BASELINE : CompileTier::OPTIMIZING;
+
+    std::vector<JitTranslatorUnit*> units;
+    // Units the host created before are only reset on failure, it still
+    // holds them.
+    std::vector<bool> created;
+    std::vector<JitCodeGenerator::BatchJob_t> jobs;
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const BatchEntry& entry = entries[i];
+
+        ITranslator *translator = entry.translator ? entry.translator : _translator;
+        if (!translator)
+            continue;
+
+        // Also skips repeated entries, they are pending by now.
+        JitTranslatorUnit *unit = findUnit(entry.vIP);
+        if (unit && (unit->isGenerated() || unit->isPending()))
+            continue;
+
+        bool isNew = unit == nullptr;
+        unit = createUnit(entry.vIP);
+        if (!unit)
+            continue;
+
+        JitCodeGenerator *generator = acquireGenerator(entry.vIP);
+        if (!unit->prepare(translator, generator))
+        {
+            releaseGenerator(generator);
+            if (isNew)
+                releaseUnit(unit);
+            continue;
+        }
+
+        JitCodeGenerator::BatchJob_t job;
+        job.generator = generator;
+        job.execCounter = unit->getExecutionCounter();
+        jobs.push_back(std::move(job));
+
+        units.push_back(unit);
+        created.push_back(isNew);
+    }
+
+    if (jobs.empty())
+        return 0;
+
+    JitCodeGenerator::compileBatch(tier, jobs);
+
+    size_t generated = 0;
+    for (size_t i = 0; i < jobs.size(); i++)
+    {
+        releaseGenerator(jobs[i].generator);
+
+        if (!jobs[i].code.func)
+        {
+            if (created[i])
+                releaseUnit(units[i]);
+            else
+                units[i]->reset();
+            continue;
+        }
+
+        units[i]->install(jobs[i].code);
+        generated++;
+    }
+
+    return generated;
+}
+
+void JitEmulator::linkUnit(JitTranslatorUnit *unit)
+{
+    _codeBytes += unit->getCodeSize();
+
+    // Outgoing, link against targets that already have code.
+    for (JitTranslatorUnit::Exit& exit : unit->getExits())
+    {
+        _exitsByTarget[exit.targetIP].push_back(&exit);
+
+        JitTranslatorUnit *target = _units.find(exit.targetIP);
+        if (target && target->isGenerated())
+        {
+            exit.target = target->getChainEntry();
+        }
+    }
+
+    // Incoming, units that were waiting for this one.
+    auto itr = _exitsByTarget.find(unit->getVirtualIP());
+    if (itr != _exitsByTarget.end())
+    {
+        for (JitTranslatorUnit::Exit *exit : itr->second)
+        {
+            exit->target = unit->getChainEntry();
+        }
+    }
+}
+
+void JitEmulator::indexUnit(JitTranslatorUnit *unit)
+{
+    for (const JitTranslatorUnit::GuestRange& range : unit->getGuestRanges())
+    {
+        _rangeIndex.insert(range.start, range.size, unit);
+
+        if (_writeWatch.isEnabled())
+        {
+            _writeWatch.watch(range.start, range.size);
+        }
+    }
+}
+
+void JitEmulator::unindexUnit(JitTranslatorUnit *unit)
+{
+    for (const JitTranslatorUnit::GuestRange& range : unit->getGuestRanges())
+    {
+        _rangeIndex.remove(range.start, unit);
+    }
+
+    if (!_writeWatch.isEnabled())
+        return;
+
+    // Pages no other unit is on go back to how they were.
+    size_t ps = WriteWatch::pageSize();
+    for (const JitTranslatorUnit::GuestRange& range : unit->getGuestRanges())
+    {
+        if (range.size == 0)
+            continue;
+
+        uintptr_t first = range.start & ~(uintptr_t)(ps - 1);
+        uintptr_t last = (range.start + range.size - 1) & ~(uintptr_t)(ps - 1);
+        for (uintptr_t page = first; ; page += ps)
+        {
+            if (!_rangeIndex.overlaps(page, ps))
+            {
+                _writeWatch.unwatch(page);
+            }
+
+            if (page == last)
+                break;
+        }
+    }
+}
+
+void JitEmulator::unlinkUnit(JitTranslatorUnit *unit)
+{
+    _codeBytes -= unit->getCodeSize();
+    // Back under the limit, the next growth past it sweeps again.
+    if (_codeBytes <= _codeCacheLimit)
+    {
+        _evictThreshold = _codeCacheLimit;
+    }
+
+    // Shadow stack entries may point into this unit or through its exits.
+    _shadowStackState.epoch++;
+
+    // Incoming exits fall back to returning to the host.
+    auto itr = _exitsByTarget.find(unit->getVirtualIP());
+    if (itr != _exitsByTarget.end())
+    {
+        for (JitTranslatorUnit::Exit *exit : itr->second)
+        {
+            exit->target = exit->unlinked;
+        }
+    }
+
+    // Outgoing exits are going away with the unit.
+    for (JitTranslatorUnit::Exit& exit : unit->getExits())
+    {
+        auto itrTarget = _exitsByTarget.find(exit.targetIP);
+        if (itrTarget == _exitsByTarget.end())
+        {
+            continue;
+        }
+
+        auto& list = itrTarget->second;
+        list.erase(std::remove(list.begin(), list.end(), &exit), list.end());
+
+        if (list.empty())
+        {
+            _exitsByTarget.erase(itrTarget);
+        }
+    }
+}
+
+void JitEmulator::setTranslator(ITranslator *translator)
+{
+    std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+    // The previous one may go away, its baseline units stay baseline.
+    ITranslator *previous = _translator;
+    if (previous && previous != translator)
+    {
+        _units.forEach([previous](JitTranslatorUnit *unit)
+        {
+            if (unit->getTranslator() == previous)
+            {
+                unit->forgetTranslator();
+            }
+        });
+    }
+
+    _translator = translator;
+}
+
+void JitEmulator::setInstructionBudget(uint64_t budget)
+{
+    _instructionBudget = budget;
+}
+
+void JitEmulator::setTierUpThreshold(uint32_t count)
+{
+    _tierUpThreshold = count;
+}
+
+void JitEmulator::setCompileThreads(uint32_t count)
+{
+    _compilePool.setThreadCount(count);
+}
+
+bool JitEmulator::setTranslationCache(const char *path)
+{
+    if (!path)
+    {
+        _translationCache.close();
+        return true;
+    }
+
+    // Cached code bakes in these, anything else is covered by the version.
+    uint64_t layout[] =
+    {
+        sizeof(VContext),
+        sizeof(VContextInternal),
+        offsetof(VContextInternal, shadowStack),
+        ShadowStack::k_NumEntries,
+        sizeof(ShadowStackEntry),
+        IndirectBranchCache::k_NumEntries,
+        sizeof(IndirectBranchCache::Entry),
+    };
+    uint64_t fingerprint = TranslationCache::hash(reinterpret_cast<const uint8_t*>(layout), sizeof(layout));
+
+    return _translationCache.open(path, fingerprint);
+}
+
+bool JitEmulator::flushTranslationCache()
+{
+    return _translationCache.save();
+}
+
+void JitEmulator::setCodeCacheLimit(size_t bytes)
+{
+    _codeCacheLimit = bytes;
+    _evictThreshold = bytes;
+}
+
+bool JitEmulator::setCodeWriteDetection(bool enable)
+{
+    if (!enable)
+    {
+        _writeWatch.disable();
+        return true;
+    }
+
+    if (_writeWatch.isEnabled())
+        return true;
+
+    if (!_writeWatch.enable(k_InterruptCodeWrite))
+        return false;
+
+    // Code translated before this was not watched.
+    _units.forEach([this](JitTranslatorUnit *unit)
+    {
+        for (const JitTranslatorUnit::GuestRange& range : unit->getGuestRanges())
+        {
+            _writeWatch.watch(range.start, range.size);
+        }
+    });
+
+    return true;
+}
+
+void JitEmulator::setThreadSafe(bool enable)
+{
+    if (enable == _threadSafe)
+        return;
+
+    _threadSafe = enable;
+
+    // Neither cache is used by concurrent threads.
+    _dispatchCache.flush();
+    _indirectCache.flush();
+
+    if (!enable)
+    {
+        _reclaimer.drain();
+    }
+    _units.setReclaimer(enable ? &_reclaimer : nullptr);
+}
+
+bool JitEmulator::setRegisterPinning(bool enable)
+{
+    // Not enough registers left for the base and temporaries.
+    if (enable && sizeof(void*) != 8)
+        return false;
+
+    if (enable == _pinRegisters)
+        return true;
+
+    // Pinned and unpinned units can not chain into each other.
+    releaseAllUnits();
+    _pinRegisters = enable;
+
+    return true;
+}
+
+void JitEmulator::processCodeWrites()
+{
+    std::vector<uintptr_t> pages;
+    _writeWatch.takeWrites(pages);
+
+    for (uintptr_t page : pages)
+    {
+        invalidateRange(page, WriteWatch::pageSize());
+    }
+
+    _codeWrites += pages.size();
+}
+
+void JitEmulator::evictUnits(JitTranslatorUnit *keep)
+{
+    if (_codeCacheLimit == 0 || _codeBytes <= _evictThreshold)
+        return;
+
+    // Paired with the last use as it was now, other threads keep marking
+    // units while this sorts.
+    std::vector<std::pair<uint64_t, JitTranslatorUnit*>> candidates;
+    _units.forEach([&](JitTranslatorUnit *unit)
+    {
+        // Chained entries never reach the dispatcher, catch them here.
+        if (unit->sampleActivity())
+        {
+            unit->markUsed(_useClock.load(std::memory_order_relaxed));
+        }
+
+        if (unit != keep && unit->isGenerated() && !unit->isPending())
+        {
+            candidates.emplace_back(unit->getLastUse(), unit);
+        }
+    });
+
+    // Oldest on top, only as many are ordered as get evicted.
+    auto newer = [](const std::pair<uint64_t, JitTranslatorUnit*>& a, const std::pair<uint64_t, JitTranslatorUnit*>& b)
+    {
+        return a.first > b.first;
+    };
+    std::make_heap(candidates.begin(), candidates.end(), newer);
+
+    // Some headroom so the next compiles do not sweep again right away.
+    size_t headroom = _codeCacheLimit / 4;
+    size_t target = _codeCacheLimit - headroom;
+
+    while (!candidates.empty() && _codeBytes > target)
+    {
+        std::pop_heap(candidates.begin(), candidates.end(), newer);
+        releaseUnit(candidates.back().second);
+        candidates.pop_back();
+        _evictedUnits++;
+    }
+
+    // What could not go is in use, wait for the same headroom before trying
+    // again rather than sweeping on every dispatch.
+    _evictThreshold = std::max(_codeCacheLimit, _codeBytes + headroom);
+}
+
+JitTranslatorUnit* JitEmulator::compileUnit(uintptr_t vIP)
+{
+    if (!_translator)
+        return nullptr;
+
+    CompileTier tier = _tierUpThreshold != 0 ? CompileTier::BASELINE : CompileTier::OPTIMIZING;
+
+    JitTranslatorUnit *unit = createUnit(vIP);
+    if (!unit)
+        return nullptr;
+
+    if (!unit->generate(_translator, tier))
+    {
+        releaseUnit(unit);
+        return nullptr;
+    }
+
+    return unit;
+}
+
+void JitEmulator::requestTierUp(JitTranslatorUnit *unit)
+{
+    ITranslator *translator = unit->getTranslator();
+    if (!translator)
+        return;
+
+    // Translated again, baseline units do not keep their instructions.
+    JitCodeGenerator *generator = acquireGenerator(unit->getVirtualIP());
+    if (!translator->process(generator))
+    {
+        releaseGenerator(generator);
+        return;
+    }
+
+    CompilePool::Job job;
+    job.unit = unit;
+    job.vIP = unit->getVirtualIP();
+    job.serial = unit->getSerial();
+    job.tier = CompileTier::OPTIMIZING;
+    job.execCounter = unit->getExecutionCounter();
+    job.source = generator->getScheduled();
+    releaseGenerator(generator);
+
+    _compilePool.enqueue(std::move(job));
+}
+
+void JitEmulator::prefetchSuccessors(JitTranslatorUnit *unit)
+{
+    if (!_translator || _compilePool.getThreadCount() == 0)
+        return;
+
+    CompileTier tier = _tierUpThreshold != 0 ? CompileTier::BASELINE : CompileTier::OPTIMIZING;
+
+    for (const JitTranslatorUnit::Exit& exit : unit->getExits())
+    {
+        if (_units.find(exit.targetIP))
+            continue;
+
+        // Translation stays on this thread, only the compile is handed off.
+        JitTranslatorUnit *successor = createUnit(exit.targetIP);
+        if (!successor)
+            continue;
+
+        JitCodeGenerator *generator = acquireGenerator(exit.targetIP);
+        if (!successor->prepare(_translator, generator))
+        {
+            releaseGenerator(generator);
+            releaseUnit(successor);
+            continue;
+        }
+
+        CompilePool::Job job;
+        job.unit = successor;
+        job.vIP = exit.targetIP;
+        job.serial = successor->getSerial();
+        job.tier = tier;
+        job.execCounter = successor->getExecutionCounter();
+        job.source = generator->getScheduled();
+        releaseGenerator(generator);
+
+        _compilePool.enqueue(std::move(job));
+    }
+}
+
+void JitEmulator::installCompiled()
+{
+    std::vector<CompilePool::Result> results;
+    _compilePool.takeResults(results);
+
+    for (CompilePool::Result& result : results)
+    {
+        // Dropped if the unit was released or regenerated meanwhile.
+        JitTranslatorUnit *unit = findUnit(result.vIP);
+        if (unit != result.unit || unit->getSerial() != result.serial)
+        {
+            if (result.code.func)
+            {
+                releaseCode(reinterpret_cast<void*>(result.code.func));
+                _unitArena.release(result.code.exits);
+            }
+            continue;
+        }
+
+        if (!result.compiled)
+        {
+            // A failed tier-up keeps the baseline code, a failed prefetch
+            // is compiled again once it is reached.
+            if (unit->isPending())
+            {
+                releaseUnit(unit);
+            }
+            continue;
+        }
+
+        _indirectCache.invalidate(result.vIP);
+        unit->install(result.code);
+    }
+}
+
+JitTranslatorUnit* JitEmulator::waitForUnit(uintptr_t vIP)
+{
+    while (true)
+    {
+        installCompiled();
+
+        JitTranslatorUnit *unit = findUnit(vIP);
+        if (!unit || !unit->isPending())
+            return unit;
+
+        if (!_compilePool.waitForResults())
+            return unit;
+    }
+}
+
+JitTranslatorUnit* JitEmulator::buildTrace(uintptr_t vIP)
+{
+    JitTranslatorUnit *head = findUnit(vIP);
+    if (!head || !_translator)
+        return head;
+
+    TraceBuilder trace(this, _translator);
+    if (!trace.select(head))
+    {
+        // Only mark it so it stops asking.
+        trace.truncate(1);
+    }
+
+    // The blocks inside stay as they are for the side entries.
+    releaseUnit(head);
+
+    JitTranslatorUnit *unit = createUnit(vIP);
+    if (!unit->generate(&trace))
+    {
+        trace.truncate(1);
+        if (!unit->generate(&trace))
+        {
+            releaseUnit(unit);
+            return nullptr;
+        }
+    }
+
+    return unit;
+}
+
+ExitInfo JitEmulator::run(VContext& ctx, IMemoryHandler *memoryHandler)
+{
+    VContextInternal& _ctx = *reinterpret_cast<VContextInternal*>(&ctx);
+    _ctx.memoryHandler = memoryHandler;
+    _ctx.halted = 0;
+    _ctx.profiling = 1;
+    _ctx.hotRequested = 0;
+    // The host owns VContext::flags between runs.
+    _ctx.lazyFlags.active = 0;
+
+    Reclaimer::Participant participant;
+    if (_threadSafe)
+    {
+        _reclaimer.enter(participant);
+    }
+
+    setActive(&_ctx, true);
+    _writeWatch.prepareThread();
+    {
+        std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+        // Written by the host since the last run.
+        if (_writeWatch.hasWrites())
+        {
+            processCodeWrites();
+        }
+        installCompiled();
+    }
+    // The context may not be zeroed, entries are trusted once the epoch matches.
+    memset(&_ctx.shadowStack, 0, sizeof(_ctx.shadowStack));
+
+    intptr_t budget = INTPTR_MAX;
+    if (_instructionBudget != 0 && _instructionBudget < (uint64_t)INTPTR_MAX)
+    {
+        budget = (intptr_t)_instructionBudget;
+    }
+    _ctx.budget = budget;
+
+    ExitInfo info = {};
+
+    // Write faults may be dispatched on the guest stack.
+    uintptr_t guestStack = (uintptr_t)ctx.gpRegs[(size_t)RegisterIndex::GP_REG4].val.ptr;
+    if (!_writeWatch.hasStackReserve(guestStack))
+    {
+        info.reason = ExitReason::STACK_RESERVE;
+    }
+
+    while (info.reason == ExitReason::NONE)
+    {
+        // Holds no unit or code of the previous iteration past this point.
+        if (_threadSafe)
+        {
+            _reclaimer.quiescent(participant);
+        }
+
+        uint32_t interrupt = _ctx.interrupt;
+        if (interrupt & (k_InterruptCodeWrite | k_InterruptInstall))
+        {
+            std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+            if (interrupt & k_InterruptCodeWrite)
+            {
+                _ctx.interrupt &= ~k_InterruptCodeWrite;
+                processCodeWrites();
+            }
+
+            if (interrupt & k_InterruptInstall)
+            {
+                _ctx.interrupt &= ~k_InterruptInstall;
+                installCompiled();
+            }
+        }
+
+        if (interrupt & k_InterruptStop)
+        {
+            _ctx.interrupt &= ~k_InterruptStop;
+            info.reason = ExitReason::STOP_REQUEST;
+            break;
+        }
+
+        if (_ctx.budget <= 0)
+        {
+            info.reason = ExitReason::BUDGET;
+            break;
+        }
+
+        uintptr_t vIP = ctx.nextIP;
+
+        JitTranslatorUnit *unit = findUnit(vIP);
+        JitTranslatorUnit::fnJitFunction func = unit ? unit->getFunction() : nullptr;
+
+        if (!func)
+        {
+            std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+            // Another thread may have compiled it meanwhile.
+            unit = findUnit(vIP);
+            if (unit && unit->isPending())
+            {
+                // Only block once execution actually needs it.
+                unit = waitForUnit(vIP);
+                if (unit && unit->isGenerated())
+                {
+                    prefetchSuccessors(unit);
+                }
+            }
+
+            if (!unit || !unit->isGenerated())
+            {
+                unit = compileUnit(vIP);
+                if (!unit)
+                {
+                    info.reason = ExitReason::UNMAPPED;
+                    break;
+                }
+                prefetchSuccessors(unit);
+            }
+
+            func = unit->getFunction();
+            _reclaimer.collect();
+        }
+
+        unit->markUsed(_useClock.fetch_add(1, std::memory_order_relaxed) + 1);
+
+        if (_codeCacheLimit != 0 && _codeBytes.load(std::memory_order_relaxed) > _evictThreshold.load(std::memory_order_relaxed))
+        {
+            std::unique_lock<std::recursive_mutex> lock = lockUnits();
+            evictUnits(unit);
+        }
+
+        // Indirect exits that miss end up here, next time they stay in the JIT.
+        if (!_threadSafe)
+        {
+            _indirectCache.insert(vIP, unit->getChainEntry());
+        }
+
+        // Runs until an exit that is not chained.
+        func(ctx);
+
+        // A hot unit returned before running anything.
+        if (_ctx.hotRequested)
+        {
+            _ctx.hotRequested = 0;
+
+            std::unique_lock<std::recursive_mutex> lock = lockUnits();
+
+            JitTranslatorUnit *hot = findUnit(ctx.nextIP);
+            if (hot && hot->getTier() == CompileTier::BASELINE)
+            {
+                requestTierUp(hot);
+            }
+            else
+            {
+                buildTrace(ctx.nextIP);
+            }
+            continue;
+        }
+
+        if (_ctx.halted)
+        {
+            info.reason = ExitReason::HALT;
+            break;
+        }
+    }
+
+    setActive(&_ctx, false);
+
+    if (_threadSafe)
+    {
+        std::unique_lock<std::recursive_mutex> lock = lockUnits();
+        _reclaimer.leave(participant);
+        _reclaimer.collect();
+    }
+
+    materializeFlags(ctx.flags, _ctx.lazyFlags);
+
+    info.vIP = ctx.nextIP;
+    info.instructions = (uint64_t)(budget - _ctx.budget);
+
+    return info;
+}
+
+void JitEmulator::requestStop(VContext& ctx)
+{
+    VContextInternal& _ctx = *reinterpret_cast<VContextInternal*>(&ctx);
+    _ctx.interrupt |= k_InterruptStop;
+}
+
+Statistics JitEmulator::getStatistics() const
+{
+    Statistics stats = {};
+    stats.dispatchHits = _dispatchCache.hits();
+    stats.dispatchMisses = _dispatchCache.misses();
+    stats.indirectHits = _indirectCache.hits();
+    stats.indirectMisses = _indirectCache.misses();
+    stats.returnHits = _shadowStackState.hits;
+    stats.returnMisses = _shadowStackState.misses;
+    stats.translationCacheHits = _translationCache.hits();
+    stats.translationCacheMisses = _translationCache.misses();
+    stats.codeBytes = _codeBytes;
+    stats.evictedUnits = _evictedUnits;
+    stats.codeWrites = _codeWrites;
+    _optimizer.getStatistics(stats);
+    return stats;
+}
+
+void JitEmulator::resetStatistics()
+{
+    _dispatchCache.resetStatistics();
+    _indirectCache.resetStatistics();
+    _shadowStackState.hits = 0;
+    _shadowStackState.misses = 0;
+    _translationCache.resetStatistics();
+    _evictedUnits = 0;
+    _codeWrites = 0;
+    _optimizer.resetStatistics();
+}
+
 } // x86box
@@ -0,0 +1,253 @@
+#include "jittranslatorunit.h"
+#include "jitcodegenerator.h"
+#include "jitemulator.h"
+
+namespace x86box {
+
+// Borrows a generator from the emulator for one translation, units only
+// keep what the generator produced.
+class PooledGenerator
+{
+    JitEmulator *_emulator;
+    JitCodeGenerator *_generator;
+
+public:
+    PooledGenerator(JitEmulator *emulator, uintptr_t vIP)
+        : _emulator(emulator),
+        _generator(emulator->acquireGenerator(vIP))
+    {
+    }
+
+    ~PooledGenerator()
+    {
+        _emulator->releaseGenerator(_generator);
+    }
+
+    JitCodeGenerator* operator->() const
+    {
+        return _generator;
+    }
+
+    JitCodeGenerator* get() const
+    {
+        return _generator;
+    }
+};
+
+JitTranslatorUnit::JitTranslatorUnit(IEmulator* emulator, uintptr_t vIP)
+    : _parent(emulator),
+    _virtualIP(vIP),
+    _func(nullptr),
+    _chainEntry(nullptr),
+    _execCount(0),
+    _isTrace(false),
+    _tier(CompileTier::OPTIMIZING),
+    _serial(0),
+    _translator(nullptr),
+    _pending(false),
+    _codeSize(0),
+    _lastUse(0),
+    _lastActivity(0)
+{
+}
+
+JitTranslatorUnit::~JitTranslatorUnit()
+{
+    reset();
+}
+
+bool JitTranslatorUnit::generate(ITranslator *translator, CompileTier tier)
+{
+    if (_func || _pending)
+    {
+        reset();
+    }
+
+    PooledGenerator generator(static_cast<JitEmulator*>(_parent), _virtualIP);
+    if (!translator->process(generator.get()))
+    {
+        generator->discard();
+        return false;
+    }
+
+    UnitArena& arena = static_cast<JitEmulator*>(_parent)->getUnitArena();
+
+    // Compiling resets the generator.
+    ArenaArray<GuestRange> ranges;
+    if (!generator->getGuestRanges(ranges))
+    {
+        generator->discard();
+        return false;
+    }
+
+    Code code;
+    if (!generator->compile(tier, &_execCount, code))
+    {
+        arena.release(ranges);
+        return false;
+    }
+
+    _translator = translator;
+    install(code);
+    setGuestRanges(ranges);
+
+    return true;
+}
+
+bool JitTranslatorUnit::prepare(ITranslator *translator, JitCodeGenerator *generator)
+{
+    if (_func || _pending)
+    {
+        reset();
+    }
+
+    ArenaArray<GuestRange> ranges;
+    if (!translator->process(generator) || !generator->getGuestRanges(ranges))
+    {
+        generator->discard();
+        return false;
+    }
+
+    _translator = translator;
+    _serial = static_cast<JitEmulator*>(_parent)->nextSerial();
+    _pending = true;
+
+    // Indexed right away so a write can drop it before the code arrives.
+    setGuestRanges(ranges);
+
+    return true;
+}
+
+void JitTranslatorUnit::install(Code& code)
+{
+    JitEmulator *emulator = static_cast<JitEmulator*>(_parent);
+
+    if (_func)
+    {
+        emulator->unlinkUnit(this);
+        emulator->retireCode(reinterpret_cast<void*>(_func.load()), _exits);
+    }
+
+    _chainEntry = code.chainEntry;
+    _exits = code.exits;
+    code.exits = ArenaArray<Exit>();
+    _isTrace = code.isTrace;
+    _tier = code.tier;
+    _codeSize = code.codeSize;
+    _execCount = 0;
+    _lastActivity = 0;
+    _serial = emulator->nextSerial();
+    _pending = false;
+    // Last, other threads run the unit as soon as they see it.
+    _func.store(code.func, std::memory_order_release);
+
+    if (_tier != CompileTier::BASELINE)
+    {
+        _translator = nullptr;
+    }
+
+    emulator->linkUnit(this);
+}
+
+void JitTranslatorUnit::setGuestRanges(ArenaArray<GuestRange>& ranges)
+{
+    JitEmulator *emulator = static_cast<JitEmulator*>(_parent);
+
+    if (!_ranges.empty())
+    {
+        emulator->unindexUnit(this);
+    }
+    emulator->getUnitArena().release(_ranges);
+
+    _ranges = ranges;
+    ranges = ArenaArray<GuestRange>();
+    emulator->indexUnit(this);
+}
+
+bool JitTranslatorUnit::sampleActivity()
+{
+    uintptr_t activity = _execCount;
+    for (const Exit& exit : _exits)
+    {
+        activity += exit.hits;
+    }
+
+    if (activity == _lastActivity)
+    {
+        return false;
+    }
+
+    _lastActivity = activity;
+    return true;
+}
+
+bool JitTranslatorUnit::isGenerated() const
+{
+    return _func != nullptr;
+}
+
+bool JitTranslatorUnit::execute(VContext& ctx, IMemoryHandler *memoryHandler)
+{
+    VContextInternal& _ctx = *reinterpret_cast<VContextInternal*>(&ctx);
+    _ctx.memoryHandler = memoryHandler;
+    _ctx.budget = INTPTR_MAX;
+    _ctx.interrupt.store(0, std::memory_order_relaxed);
+    _ctx.halted = 0;
+    _ctx.profiling = 0;
+    _ctx.hotRequested = 0;
+    _ctx.lazyFlags.active = 0;
+    WriteWatch& writeWatch = static_cast<JitEmulator*>(_parent)->getWriteWatch();
+    writeWatch.prepareThread();
+    if (!writeWatch.hasStackReserve((uintptr_t)ctx.gpRegs[(size_t)RegisterIndex::GP_REG4].val.ptr))
+    {
+        return false;
+    }
+
+    // Predicted returns only hold where the guest left off, entering anywhere
+    // else starts this context over. Other contexts keep theirs.
+    if (ctx.nextIP != _virtualIP)
+    {
+        memset(&_ctx.shadowStack, 0, sizeof(_ctx.shadowStack));
+    }
+
+    fnJitFunction func = _func;
+    if (!func)
+    {
+        return false;
+    }
+
+    func(ctx);
+
+    materializeFlags(ctx.flags, _ctx.lazyFlags);
+
+    return true;
+}
+
+void JitTranslatorUnit::reset()
+{
+    JitEmulator *emulator = static_cast<JitEmulator*>(_parent);
+
+    if (_func)
+    {
+        emulator->unlinkUnit(this);
+
+        emulator->retireCode(reinterpret_cast<void*>(_func.load()), _exits);
+        _func = nullptr;
+        _chainEntry = nullptr;
+        _isTrace = false;
+        _codeSize = 0;
+    }
+
+    if (!_ranges.empty())
+    {
+        emulator->unindexUnit(this);
+        emulator->getUnitArena().release(_ranges);
+    }
+
+    // Whatever is still in flight no longer matches.
+    _translator = nullptr;
+    _serial = 0;
+    _pending = false;
+}
+
+} // x86box
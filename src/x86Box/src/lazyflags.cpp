@@ -0,0 +1,39 @@
+#include "lazyflags.h"
+
+namespace x86box {
+
+void materializeFlags(uintptr_t& flags, LazyFlags& lazy)
+{
+    if (!lazy.active)
+        return;
+
+    uint32_t dst = lazy.dst;
+    uint32_t src = lazy.src;
+    uint32_t res = dst - src;
+
+    uint32_t status = 0;
+    if (dst < src)
+        status |= k_FlagCF;
+
+    // Set for an even number of bits in the low byte.
+    uint32_t parity = res & 0xFF;
+    parity ^= parity >> 4;
+    parity ^= parity >> 2;
+    parity ^= parity >> 1;
+    if ((parity & 1) == 0)
+        status |= k_FlagPF;
+
+    if ((dst ^ src ^ res) & 0x10)
+        status |= k_FlagAF;
+    if (res == 0)
+        status |= k_FlagZF;
+    if (res & 0x80000000u)
+        status |= k_FlagSF;
+    if ((dst ^ src) & (dst ^ res) & 0x80000000u)
+        status |= k_FlagOF;
+
+    flags = (flags & ~(uintptr_t)k_FlagsStatus) | status;
+    lazy.active = 0;
+}
+
+}
@@ -0,0 +1,349 @@
+#include "optimizer.h"
+#include "peephole.h"
+
+#include <chrono>
+
+namespace x86box {
+
+const uint32_t k_RegSpId = 4;
+
+bool isConstMove(const Instruction& instr)
+{
+    return instr.mnemonic == MnemonicType::I_MOV && instr.operands[1].type == OperandType::IMM;
+}
+
+// Shorter than the move it would fold into.
+bool isZeroIdiom(const Instruction& instr)
+{
+    if (instr.mnemonic != MnemonicType::I_XOR && instr.mnemonic != MnemonicType::I_SUB)
+        return false;
+
+    int32_t reg = IRUnit::getRegId(instr.operands[0]);
+    return reg != -1 && reg == IRUnit::getRegId(instr.operands[1]);
+}
+
+// Loads of a value that is still in a register become moves from it.
+size_t eliminateLoads(IRUnit& ir)
+{
+    size_t changes = 0;
+    for (size_t i = 0; i < ir.size(); i++)
+    {
+        const IRUnit::Inst& inst = ir.inst(i);
+        Instruction& instr = ir.instr(i);
+
+        if (!(inst.effects & IRUnit::k_EffectModeled) || instr.mnemonic != MnemonicType::I_MOV)
+            continue;
+
+        const Operand& dst = instr.operands[0];
+        int32_t dstReg = IRUnit::getRegId(dst);
+        if (dstReg == -1 || instr.operands[1].type != OperandType::MEMORY || inst.def == 0)
+            continue;
+
+        int32_t holder = ir.findRegister(i, inst.def, true);
+        if (holder == -1)
+            continue;
+
+        if (holder == dstReg)
+            ir.remove(i);
+        else
+            instr.operands[1] = IRUnit::makeReg((uint32_t)holder, dst.size);
+
+        changes++;
+    }
+
+    return changes;
+}
+
+// Folds instructions with a known result into moves, and known registers
+// used as sources into immediates.
+size_t propagateConstants(IRUnit& ir)
+{
+    size_t changes = 0;
+    for (size_t i = 0; i < ir.size(); i++)
+    {
+        const IRUnit::Inst& inst = ir.inst(i);
+        Instruction& instr = ir.instr(i);
+
+        if (!(inst.effects & IRUnit::k_EffectModeled))
+            continue;
+
+        Operand& dst = instr.operands[0];
+        Operand& src = instr.operands[1];
+        int32_t dstReg = IRUnit::getRegId(dst);
+
+        // Only if nothing reads the flags it would have written.
+        bool flagsFree = !(inst.effects & IRUnit::k_EffectFlagsWrite) || !inst.flagsLiveOut;
+        if (dstReg != -1 && dst.size == OperandSize::SIZE_32 && inst.def != 0 && ir.value(inst.def).isConst &&
+            instr.mnemonic != MnemonicType::I_LEA && !isConstMove(instr) && !isZeroIdiom(instr) && flagsFree)
+        {
+            instr.mnemonic = MnemonicType::I_MOV;
+            src = IRUnit::makeImm(ir.value(inst.def).constant, OperandSize::SIZE_32);
+            changes++;
+            continue;
+        }
+
+        int32_t srcReg = IRUnit::getRegId(src);
+        if (srcReg == -1 || srcReg == dstReg || !ir.value(inst.in[srcReg]).isConst)
+            continue;
+
+        uint32_t constant = ir.value(inst.in[srcReg]).constant;
+
+        switch (instr.mnemonic)
+        {
+        case MnemonicType::I_MOV:
+        case MnemonicType::I_ADD:
+        case MnemonicType::I_SUB:
+        case MnemonicType::I_AND:
+        case MnemonicType::I_XOR:
+        case MnemonicType::I_CMP:
+        case MnemonicType::I_TEST:
+            if (dst.size == OperandSize::SIZE_32 && src.size == OperandSize::SIZE_32)
+            {
+                src = IRUnit::makeImm(constant, OperandSize::SIZE_32);
+                changes++;
+            }
+            break;
+        case MnemonicType::I_SHL:
+        case MnemonicType::I_SHR:
+            // Same masking of the count either way.
+            src = IRUnit::makeImm(constant & 0xFF, OperandSize::SIZE_8);
+            changes++;
+            break;
+        }
+    }
+
+    return changes;
+}
+
+// Reads of a copy go to the register the value came from, so the copy can
+// become dead.
+size_t propagateCopies(IRUnit& ir)
+{
+    size_t changes = 0;
+    for (size_t i = 0; i < ir.size(); i++)
+    {
+        const IRUnit::Inst& inst = ir.inst(i);
+        Instruction& instr = ir.instr(i);
+
+        if (!(inst.effects & IRUnit::k_EffectModeled))
+            continue;
+
+        // Register that held v first if it still does, -1 otherwise.
+        auto findHome = [&](int32_t reg, bool exact) -> int32_t
+        {
+            uint32_t v = inst.in[reg];
+            const IRUnit::Value& value = ir.value(v);
+            uint32_t home = exact ? value.home : ir.value(value.root).home;
+            if (home >= IRUnit::k_NumRegs || home == (uint32_t)reg || home == k_RegSpId)
+                return -1;
+
+            bool held = exact ? inst.in[home] == v : ir.value(inst.in[home]).root == value.root;
+            return held ? (int32_t)home : -1;
+        };
+
+        auto forwardAddress = [&](Operand& op)
+        {
+            if (op.type != OperandType::MEMORY)
+                return;
+
+            // Address registers are used in full, the fields only fit up to r14.
+            auto forward = [&](RegisterIndex reg) -> RegisterIndex
+            {
+                if (reg < RegisterIndex::GP_REG0 || reg > RegisterIndex::GP_REG15)
+                    return reg;
+
+                int32_t home = findHome((int32_t)getLocalRegisterId(reg), true);
+                if (home == -1 || home >= 15)
+                    return reg;
+
+                changes++;
+                return (RegisterIndex)((uint32_t)RegisterIndex::GP_REG0 + home);
+            };
+
+            op.mem.regBase = forward(op.mem.regBase);
+            op.mem.regIndex = forward(op.mem.regIndex);
+        };
+
+        auto forwardReg = [&](Operand& op)
+        {
+            int32_t reg = IRUnit::getRegId(op);
+            if (reg == -1)
+                return;
+
+            // Lower halves are enough for 32 bit reads.
+            bool exact;
+            if (op.size == OperandSize::SIZE_32)
+                exact = false;
+            else if (op.size == OperandSize::SIZE_64 || op.size == OperandSize::SIZE_AUTO)
+                exact = true;
+            else
+                return;
+
+            int32_t home = findHome(reg, exact);
+            if (home == -1)
+                return;
+
+            op.reg.reg = (RegisterIndex)((uint32_t)RegisterIndex::GP_REG0 + home);
+            changes++;
+        };
+
+        Operand& dst = instr.operands[0];
+        Operand& src = instr.operands[1];
+
+        forwardAddress(dst);
+        if (instr.mnemonic != MnemonicType::I_LEA)
+            forwardAddress(src);
+
+        switch (instr.mnemonic)
+        {
+        case MnemonicType::I_MOV:
+        case MnemonicType::I_ADD:
+        case MnemonicType::I_SUB:
+        case MnemonicType::I_AND:
+        case MnemonicType::I_XOR:
+            // Zero idioms and the like read the destination.
+            if (IRUnit::getRegId(src) != IRUnit::getRegId(dst))
+                forwardReg(src);
+            break;
+        case MnemonicType::I_CMP:
+        case MnemonicType::I_TEST:
+            forwardReg(dst);
+            forwardReg(src);
+            break;
+        }
+    }
+
+    return changes;
+}
+
+size_t eliminateDeadCode(IRUnit& ir)
+{
+    size_t changes = 0;
+
+    // Backwards so chains of dead instructions go at once.
+    uint32_t live = IRUnit::k_AllRegs;
+    bool flags = true;
+
+    for (size_t i = ir.size(); i-- > 0;)
+    {
+        const IRUnit::Inst& inst = ir.inst(i);
+        Instruction& instr = ir.instr(i);
+
+        if (inst.effects & IRUnit::k_EffectExit)
+        {
+            live = IRUnit::k_AllRegs;
+            flags = true;
+            continue;
+        }
+
+        bool removable = false;
+        int32_t dstReg = IRUnit::getRegId(instr.operands[0]);
+
+        switch (instr.mnemonic)
+        {
+        case MnemonicType::I_MOV:
+        case MnemonicType::I_LEA:
+        case MnemonicType::I_ADD:
+        case MnemonicType::I_SUB:
+        case MnemonicType::I_AND:
+        case MnemonicType::I_XOR:
+        case MnemonicType::I_NOT:
+        case MnemonicType::I_NEG:
+        case MnemonicType::I_SHL:
+        case MnemonicType::I_SHR:
+        {
+            const uint8_t kept = IRUnit::k_EffectMemRead | IRUnit::k_EffectMemWrite;
+            if (!(inst.effects & IRUnit::k_EffectModeled) || (inst.effects & kept) || dstReg == -1)
+                break;
+
+            if ((inst.effects & IRUnit::k_EffectFlagsWrite) && flags)
+                break;
+
+            // Dead result, or the value is already in place.
+            bool noop = inst.def != 0 && inst.def == inst.in[dstReg];
+            removable = !(live & (1u << dstReg)) || noop;
+            break;
+        }
+        }
+
+        if (removable)
+        {
+            ir.remove(i);
+            changes++;
+            continue;
+        }
+
+        live = (live & ~inst.defs) | inst.uses;
+        if (inst.effects & IRUnit::k_EffectFlagsKill)
+            flags = false;
+        if (inst.effects & IRUnit::k_EffectFlagsRead)
+            flags = true;
+    }
+
+    return changes;
+}
+
+// Same order as OptimizerPass.
+static const Optimizer::fnPass passes[] =
+{
+    eliminateLoads,
+    propagateConstants,
+    propagateCopies,
+    eliminateDeadCode,
+};
+static_assert(sizeof(passes) / sizeof(passes[0]) == Optimizer::k_NumIRPasses, "Missing optimizer pass");
+
+Optimizer::Optimizer()
+{
+    resetStatistics();
+}
+
+void Optimizer::run(IRUnit& ir, std::vector<Instruction>& instrs)
+{
+    if (instrs.empty())
+        return;
+
+    for (size_t n = 0; n < k_NumIRPasses; n++)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        // Every pass sees the values as left by the one before.
+        ir.analyse(instrs);
+        size_t changes = passes[n](ir);
+
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        _passTime[n] += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+        _passChanges[n] += changes;
+    }
+}
+
+void Optimizer::runPeephole(asmjit::x86::Builder& builder, asmjit::CBNode *node)
+{
+    auto start = std::chrono::steady_clock::now();
+
+    size_t changes = optimizeNodes(builder, node);
+
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    _passTime[(size_t)OptimizerPass::PEEPHOLE] += (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    _passChanges[(size_t)OptimizerPass::PEEPHOLE] += changes;
+}
+
+void Optimizer::getStatistics(Statistics& stats) const
+{
+    for (size_t n = 0; n < k_NumPasses; n++)
+    {
+        stats.passTime[n] = _passTime[n];
+        stats.passChanges[n] = _passChanges[n];
+    }
+}
+
+void Optimizer::resetStatistics()
+{
+    for (size_t n = 0; n < k_NumPasses; n++)
+    {
+        _passTime[n] = 0;
+        _passChanges[n] = 0;
+    }
+}
+
+}
@@ -0,0 +1,275 @@
+#include "peephole.h"
+
+namespace x86box {
+
+using asmjit::x86::Inst;
+
+// Prefixed or forced into a longer encoding, kept as emitted.
+const uint32_t k_KeepOptions = Inst::kOptionLock | Inst::kOptionRep | Inst::kOptionRepne |
+    Inst::kOptionXAcquire | Inst::kOptionXRelease | Inst::kOptionLongForm;
+
+asmjit::CBInst* getPlainInst(asmjit::CBNode *node)
+{
+    if (!node->isInst())
+        return nullptr;
+
+    asmjit::CBInst *inst = node->as<asmjit::CBInst>();
+    if (inst->instOptions() & k_KeepOptions)
+        return nullptr;
+
+    return inst;
+}
+
+// General purpose register that can be encoded next to any other.
+bool isPlainGp(const asmjit::Operand& op)
+{
+    if (!op.isReg())
+        return false;
+
+    const asmjit::x86::Reg& reg = op.as<asmjit::x86::Reg>();
+    return reg.isGp() && !reg.isGpbHi();
+}
+
+bool usesAddressReg(const asmjit::x86::Mem& mem, uint32_t id)
+{
+    return (mem.hasBaseReg() && mem.baseId() == id) || (mem.hasIndex() && mem.indexId() == id);
+}
+
+// Bits of register id that can be set after inst, 0 if it was not written
+// as a whole. Writes of 32 bits clear the upper half.
+uint32_t getWrittenBits(const asmjit::CBInst *inst, uint32_t id)
+{
+    if (inst == nullptr || inst->opCount() < 1)
+        return 0;
+
+    const asmjit::Operand& dst = inst->opType(0);
+    if (!isPlainGp(dst) || dst.id() != id || dst.size() < 4)
+        return 0;
+
+    const asmjit::Operand& src = inst->opType(1);
+    uint32_t width = dst.size() * 8;
+
+    switch (inst->id())
+    {
+    case Inst::kIdMovzx:
+        return src.size() * 8;
+    case Inst::kIdMov:
+    case Inst::kIdAnd:
+        if (src.isImm() && dst.size() == 4)
+        {
+            uint32_t val = src.as<asmjit::Imm>().u32();
+            return val <= 0xFF ? 8 : val <= 0xFFFF ? 16 : 32;
+        }
+        return width;
+    case Inst::kIdMovsx:
+    case Inst::kIdLea:
+    case Inst::kIdAdd:
+    case Inst::kIdSub:
+    case Inst::kIdOr:
+    case Inst::kIdXor:
+    case Inst::kIdAdc:
+    case Inst::kIdSbb:
+    case Inst::kIdNot:
+    case Inst::kIdNeg:
+    case Inst::kIdInc:
+    case Inst::kIdDec:
+        return width;
+    case Inst::kIdImul:
+        // The single operand form writes edx:eax instead.
+        return inst->opCount() >= 2 ? width : 0;
+    }
+
+    return 0;
+}
+
+// Self moves, and zero extensions of what the previous instruction already
+// left zero extended.
+bool isRedundant(const asmjit::CBInst *prev, const asmjit::CBInst *inst)
+{
+    if (inst->opCount() != 2)
+        return false;
+
+    const asmjit::Operand& dst = inst->opType(0);
+    const asmjit::Operand& src = inst->opType(1);
+    if (!isPlainGp(dst) || !isPlainGp(src) || dst.id() != src.id())
+        return false;
+
+    uint32_t written = getWrittenBits(prev, dst.id());
+
+    if (inst->id() == Inst::kIdMov)
+    {
+        // Only the 32 bit form changes the register, it clears the upper half.
+        return dst.size() != 4 || (written != 0 && written <= 32);
+    }
+
+    if (inst->id() == Inst::kIdMovzx && dst.size() >= 4)
+    {
+        return written != 0 && written <= src.size() * 8;
+    }
+
+    return false;
+}
+
+// A load from the address the previous instruction loaded from or stored to
+// takes the value from its register instead.
+bool forwardLoad(const asmjit::CBInst *prev, asmjit::CBInst *inst)
+{
+    if (prev->id() != Inst::kIdMov || inst->id() != Inst::kIdMov || prev->opCount() != 2 || inst->opCount() != 2)
+        return false;
+
+    const asmjit::Operand& dst = inst->opType(0);
+    const asmjit::Operand& src = inst->opType(1);
+    if (!isPlainGp(dst) || !src.isMem())
+        return false;
+
+    const asmjit::Operand *holder;
+    if (prev->opType(1) == src && isPlainGp(prev->opType(0)))
+    {
+        holder = &prev->opType(0);
+
+        // Changed the address.
+        if (usesAddressReg(src.as<asmjit::x86::Mem>(), holder->id()))
+            return false;
+    }
+    else if (prev->opType(0) == src && isPlainGp(prev->opType(1)))
+    {
+        holder = &prev->opType(1);
+    }
+    else
+    {
+        return false;
+    }
+
+    if (holder->size() != dst.size())
+        return false;
+
+    inst->setOp(1, *holder);
+    return true;
+}
+
+// Folds the address computed by lea into the memory operand of the next
+// instruction when that one overwrites the register again.
+bool mergeLea(const asmjit::CBInst *prev, asmjit::CBInst *inst)
+{
+    if (prev->id() != Inst::kIdLea || prev->opCount() != 2 || inst->opCount() != 2)
+        return false;
+
+    switch (inst->id())
+    {
+    case Inst::kIdMov:
+    case Inst::kIdMovzx:
+    case Inst::kIdMovsx:
+    case Inst::kIdMovsxd:
+    case Inst::kIdLea:
+        break;
+    default:
+        return false;
+    }
+
+    const asmjit::x86::Reg& reg = prev->opType(0).as<asmjit::x86::Reg>();
+    const asmjit::x86::Mem& addr = prev->opType(1).as<asmjit::x86::Mem>();
+    const asmjit::Operand& dst = inst->opType(0);
+
+    if (!isPlainGp(dst) || dst.id() != reg.id() || dst.size() < 4 || !inst->opType(1).isMem())
+        return false;
+
+    // Same address size everywhere, the sums wrap the same way.
+    const asmjit::x86::Mem& mem = inst->opType(1).as<asmjit::x86::Mem>();
+    if (!addr.hasBaseReg() || addr.baseType() != reg.type() || (addr.hasIndex() && addr.indexType() != reg.type()))
+        return false;
+    if (!mem.hasBaseReg() || mem.baseType() != reg.type() || (mem.hasIndex() && mem.indexType() != reg.type()))
+        return false;
+
+    int64_t disp = (int64_t)addr.offsetLo32() + mem.offsetLo32();
+    if (disp != (int32_t)disp)
+        return false;
+
+    bool isBase = mem.baseId() == reg.id();
+    bool isIndex = mem.hasIndex() && mem.indexId() == reg.id();
+
+    asmjit::x86::Mem merged = mem;
+    if (isBase && !isIndex && !mem.hasIndex())
+    {
+        merged._setBase(addr.baseType(), addr.baseId());
+        if (addr.hasIndex())
+            merged.setIndex(asmjit::x86::Reg::fromTypeAndId(addr.indexType(), addr.indexId()), addr.shift());
+    }
+    else if (isBase && !isIndex && !addr.hasIndex())
+    {
+        merged._setBase(addr.baseType(), addr.baseId());
+    }
+    else if (isIndex && !isBase && mem.shift() == 0 && !addr.hasIndex())
+    {
+        // Sp can not be an index, it takes the base slot then.
+        if (addr.baseId() != asmjit::x86::Gp::kIdSp)
+        {
+            merged._setIndex(addr.baseType(), addr.baseId());
+        }
+        else if (mem.baseId() != asmjit::x86::Gp::kIdSp)
+        {
+            merged._setIndex(mem.baseType(), mem.baseId());
+            merged._setBase(addr.baseType(), addr.baseId());
+        }
+        else
+        {
+            return false;
+        }
+    }
+    else
+    {
+        return false;
+    }
+    merged.setOffsetLo32((int32_t)disp);
+
+    inst->setOp(1, merged);
+    return true;
+}
+
+size_t optimizeNodes(asmjit::x86::Builder& builder, asmjit::CBNode *node)
+{
+    size_t changes = 0;
+
+    asmjit::CBInst *prev = nullptr;
+    while (node != nullptr)
+    {
+        asmjit::CBNode *next = node->next();
+
+        asmjit::CBInst *inst = getPlainInst(node);
+        if (inst == nullptr)
+        {
+            prev = nullptr;
+        }
+        else if (isRedundant(prev, inst))
+        {
+            builder.removeNode(inst);
+            changes++;
+        }
+        else
+        {
+            if (prev != nullptr && forwardLoad(prev, inst))
+            {
+                changes++;
+
+                // Reloading into the same register.
+                if (isRedundant(prev, inst))
+                {
+                    builder.removeNode(inst);
+                    node = next;
+                    continue;
+                }
+            }
+            else if (prev != nullptr && mergeLea(prev, inst))
+            {
+                builder.removeNode(prev);
+                changes++;
+            }
+            prev = inst;
+        }
+
+        node = next;
+    }
+
+    return changes;
+}
+
+}
@@ -0,0 +1,78 @@
+#include "reclaimer.h"
+
+#include <algorithm>
+
+namespace x86box {
+
+Reclaimer::Reclaimer()
+    : _epoch(1)
+{
+}
+
+Reclaimer::~Reclaimer()
+{
+    drain();
+}
+
+void Reclaimer::enter(Participant& participant)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    participant.epoch.store(_epoch.load());
+    _participants.push_back(&participant);
+}
+
+void Reclaimer::leave(Participant& participant)
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    _participants.erase(std::remove(_participants.begin(), _participants.end(), &participant), _participants.end());
+}
+
+void Reclaimer::retire(std::function<void()> free)
+{
+    // Participants that read the new epoch also see the object unlinked.
+    uint64_t epoch = _epoch.fetch_add(1);
+    _retired.push_back({ epoch, std::move(free) });
+}
+
+size_t Reclaimer::collect()
+{
+    if (_retired.empty())
+        return 0;
+
+    uint64_t safe = UINT64_MAX;
+    {
+        std::lock_guard<std::mutex> lock(_lock);
+        for (Participant *participant : _participants)
+        {
+            safe = std::min(safe, participant->epoch.load(std::memory_order_acquire));
+        }
+    }
+
+    // Retired in epoch order.
+    size_t count = 0;
+    while (!_retired.empty() && _retired.front().epoch < safe)
+    {
+        std::function<void()> free = std::move(_retired.front().free);
+        _retired.pop_front();
+
+        free();
+        count++;
+    }
+
+    return count;
+}
+
+void Reclaimer::drain()
+{
+    while (!_retired.empty())
+    {
+        std::function<void()> free = std::move(_retired.front().free);
+        _retired.pop_front();
+
+        free();
+    }
+}
+
+}
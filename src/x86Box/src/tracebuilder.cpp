@@ -0,0 +1,119 @@
+#include "tracebuilder.h"
+#include "jitcodegenerator.h"
+#include "jitemulator.h"
+
+namespace x86box {
+
+TraceBuilder::TraceBuilder(JitEmulator *emulator, ITranslator *translator)
+    : _emulator(emulator),
+    _translator(translator)
+{
+}
+
+// The exit taken on most entries, -1 if none is dominant.
+int32_t getHottestExit(JitTranslatorUnit *unit)
+{
+    const auto& exits = unit->getExits();
+
+    int32_t best = -1;
+    uintptr_t bestHits = 0;
+    for (size_t i = 0; i < exits.size(); i++)
+    {
+        const JitTranslatorUnit::Exit& exit = exits[i];
+        if (exit.isReturnSite)
+            continue;
+
+        if (exit.hits > bestHits)
+        {
+            best = (int32_t)i;
+            bestHits = exit.hits;
+        }
+    }
+
+    // Not worth stitching if the unit mostly leaves elsewhere.
+    if (bestHits * 2 < unit->getExecutionCount())
+    {
+        return -1;
+    }
+
+    return best;
+}
+
+bool TraceBuilder::select(JitTranslatorUnit *head)
+{
+    _path.clear();
+
+    JitTranslatorUnit *unit = head;
+    while (unit != nullptr && !unit->isTrace())
+    {
+        Step step;
+        step.vIP = unit->getVirtualIP();
+        step.exitIndex = -1;
+        _path.push_back(step);
+
+        if (_path.size() == k_MaxBlocks)
+            break;
+
+        int32_t exitIndex = getHottestExit(unit);
+        if (exitIndex == -1)
+            break;
+
+        uintptr_t nextIP = unit->getExits()[exitIndex].targetIP;
+
+        // Loops stay chained through the exit.
+        bool visited = false;
+        for (const Step& prev : _path)
+        {
+            if (prev.vIP == nextIP)
+            {
+                visited = true;
+                break;
+            }
+        }
+        if (visited)
+            break;
+
+        // Only blocks that ran so far, their exits match the ones stitched.
+        // Traces are not pulled into another one, the branch stays an exit.
+        unit = _emulator->findUnit(nextIP);
+        if (unit == nullptr || !unit->isGenerated() || unit->isTrace())
+            break;
+
+        _path.back().exitIndex = exitIndex;
+    }
+
+    return _path.size() > 1;
+}
+
+void TraceBuilder::truncate(size_t count)
+{
+    if (count >= _path.size())
+        return;
+
+    _path.resize(count);
+    _path.back().exitIndex = -1;
+}
+
+bool TraceBuilder::process(ICodeGenerator *gen)
+{
+    JitCodeGenerator *generator = static_cast<JitCodeGenerator*>(gen);
+
+    for (const Step& step : _path)
+    {
+        generator->beginBlock(step.vIP);
+
+        if (!_translator->process(gen))
+        {
+            return false;
+        }
+
+        if (step.exitIndex == -1 || !generator->stitchBlock((size_t)step.exitIndex))
+        {
+            break;
+        }
+    }
+
+    return true;
+}
+
+}
@@ -0,0 +1,382 @@
+#include "translationcache.h"
+
+#include <string.h>
+
+namespace x86box {
+
+static const char k_Magic[8] = { 'X', '8', '6', 'B', 'O', 'X', 'T', 'C' };
+
+#pragma pack(push, 1)
+
+struct CacheFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t pointerSize;
+    uint64_t fingerprint;
+    uint32_t count;
+    // Of everything after the header.
+    uint64_t checksum;
+};
+
+#pragma pack(pop)
+
+// Bounds checked reads from the loaded file.
+class CacheReader
+{
+    const std::vector<uint8_t>& _data;
+    size_t _pos;
+
+public:
+    CacheReader(const std::vector<uint8_t>& data)
+        : _data(data),
+        _pos(0)
+    {
+    }
+
+    bool read(void *dst, size_t size)
+    {
+        if (size > _data.size() - _pos)
+            return false;
+
+        memcpy(dst, _data.data() + _pos, size);
+        _pos += size;
+        return true;
+    }
+
+    template<typename T>
+    bool read(T& value)
+    {
+        return read(&value, sizeof(T));
+    }
+
+    bool readBytes(std::vector<uint8_t>& dst)
+    {
+        uint32_t size;
+        if (!read(size) || size > _data.size() - _pos)
+            return false;
+
+        dst.assign(_data.begin() + _pos, _data.begin() + _pos + size);
+        _pos += size;
+        return true;
+    }
+
+    bool atEnd() const
+    {
+        return _pos == _data.size();
+    }
+};
+
+static void writeBytes(std::vector<uint8_t>& out, const std::vector<uint8_t>& bytes)
+{
+    TranslationCache::append(out, (uint32_t)bytes.size());
+    out.insert(out.end(), bytes.begin(), bytes.end());
+}
+
+static bool readEntry(CacheReader& reader, TranslationCache::Entry& entry)
+{
+    uint8_t tier, isTrace;
+    uint32_t exitCount, relocCount;
+
+    if (!reader.readBytes(entry.key) ||
+        !reader.read(tier) ||
+        !reader.read(isTrace) ||
+        !reader.read(entry.chainEntry) ||
+        !reader.read(entry.returnPath) ||
+        !reader.read(exitCount))
+        return false;
+
+    if (tier > (uint8_t)CompileTier::OPTIMIZING)
+        return false;
+
+    entry.tier = (CompileTier)tier;
+    entry.isTrace = isTrace != 0;
+
+    for (uint32_t i = 0; i < exitCount; i++)
+    {
+        uint64_t targetIP;
+        uint8_t isReturnSite;
+        if (!reader.read(targetIP) || !reader.read(isReturnSite))
+            return false;
+
+        entry.exits.push_back({ (uintptr_t)targetIP, isReturnSite != 0 });
+    }
+
+    if (!reader.read(relocCount))
+        return false;
+
+    for (uint32_t i = 0; i < relocCount; i++)
+    {
+        TranslationCache::Reloc reloc;
+        if (!reader.read(reloc.offset) || !reader.read(reloc.kind) || !reader.read(reloc.index))
+            return false;
+
+        entry.relocs.push_back(reloc);
+    }
+
+    if (!reader.readBytes(entry.code))
+        return false;
+
+    // Never hand out code that would be patched or entered out of bounds.
+    if (entry.chainEntry >= entry.code.size() || entry.returnPath >= entry.code.size())
+        return false;
+
+    for (const TranslationCache::Reloc& reloc : entry.relocs)
+    {
+        if (reloc.kind >= AddressKind::COUNT)
+            return false;
+
+        if (reloc.offset > entry.code.size() || entry.code.size() - reloc.offset < sizeof(uintptr_t))
+            return false;
+
+        bool perExit = reloc.kind == AddressKind::EXIT_HITS || reloc.kind == AddressKind::EXIT_TARGET;
+        if (perExit && reloc.index >= entry.exits.size())
+            return false;
+    }
+
+    return true;
+}
+
+static void writeEntry(std::vector<uint8_t>& out, const TranslationCache::Entry& entry)
+{
+    writeBytes(out, entry.key);
+    TranslationCache::append(out, (uint8_t)entry.tier);
+    TranslationCache::append(out, (uint8_t)entry.isTrace);
+    TranslationCache::append(out, entry.chainEntry);
+    TranslationCache::append(out, entry.returnPath);
+
+    TranslationCache::append(out, (uint32_t)entry.exits.size());
+    for (const TranslationCache::CachedExit& exit : entry.exits)
+    {
+        TranslationCache::append(out, (uint64_t)exit.targetIP);
+        TranslationCache::append(out, (uint8_t)exit.isReturnSite);
+    }
+
+    TranslationCache::append(out, (uint32_t)entry.relocs.size());
+    for (const TranslationCache::Reloc& reloc : entry.relocs)
+    {
+        TranslationCache::append(out, reloc.offset);
+        TranslationCache::append(out, reloc.kind);
+        TranslationCache::append(out, reloc.index);
+    }
+
+    writeBytes(out, entry.code);
+}
+
+TranslationCache::TranslationCache()
+    : _fingerprint(0),
+    _dirty(false),
+    _hits(0),
+    _misses(0)
+{
+}
+
+TranslationCache::~TranslationCache()
+{
+    close();
+}
+
+bool TranslationCache::open(const char *path, uint64_t fingerprint)
+{
+    close();
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    _path = path;
+    _fingerprint = fingerprint;
+
+    return load();
+}
+
+void TranslationCache::close()
+{
+    save();
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    _path.clear();
+    _entries.clear();
+    _dirty = false;
+}
+
+bool TranslationCache::isOpen()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    return !_path.empty();
+}
+
+bool TranslationCache::load()
+{
+    FILE *fp = fopen(_path.c_str(), "rb");
+    if (!fp)
+        return true;
+
+    std::vector<uint8_t> data;
+    uint8_t buf[0x4000];
+    size_t read;
+    while ((read = fread(buf, 1, sizeof(buf), fp)) != 0)
+    {
+        data.insert(data.end(), buf, buf + read);
+    }
+    fclose(fp);
+
+    CacheReader reader(data);
+
+    CacheFileHeader header;
+    if (!reader.read(header) ||
+        memcmp(header.magic, k_Magic, sizeof(k_Magic)) != 0 ||
+        header.version != k_Version ||
+        header.pointerSize != sizeof(uintptr_t) ||
+        header.fingerprint != _fingerprint ||
+        header.checksum != hash(data.data() + sizeof(header), data.size() - sizeof(header)))
+    {
+        return false;
+    }
+
+    std::unordered_map<uint64_t, Entry> entries;
+    for (uint32_t i = 0; i < header.count; i++)
+    {
+        Entry entry;
+        if (!readEntry(reader, entry))
+            return false;
+
+        uint64_t keyHash = hash(entry.key.data(), entry.key.size());
+        entries[keyHash] = std::move(entry);
+    }
+
+    if (!reader.atEnd())
+        return false;
+
+    _entries = std::move(entries);
+
+    return true;
+}
+
+bool TranslationCache::save()
+{
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (_path.empty() || !_dirty)
+        return true;
+
+    CacheFileHeader header;
+    memcpy(header.magic, k_Magic, sizeof(k_Magic));
+    header.version = k_Version;
+    header.pointerSize = sizeof(uintptr_t);
+    header.fingerprint = _fingerprint;
+    header.count = (uint32_t)_entries.size();
+
+    std::vector<uint8_t> out(sizeof(header));
+    for (const auto& it : _entries)
+    {
+        writeEntry(out, it.second);
+    }
+
+    header.checksum = hash(out.data() + sizeof(header), out.size() - sizeof(header));
+    memcpy(out.data(), &header, sizeof(header));
+
+    // Readers in other processes either see the old or the new file.
+    std::string tempPath = _path + ".tmp";
+
+    FILE *fp = fopen(tempPath.c_str(), "wb");
+    if (!fp)
+        return false;
+
+    bool written = fwrite(out.data(), 1, out.size(), fp) == out.size();
+    if (fclose(fp) != 0 || !written)
+    {
+        remove(tempPath.c_str());
+        return false;
+    }
+
+    // rename does not replace existing files on Windows.
+    remove(_path.c_str());
+    if (rename(tempPath.c_str(), _path.c_str()) != 0)
+    {
+        remove(tempPath.c_str());
+        return false;
+    }
+
+    _dirty = false;
+
+    return true;
+}
+
+bool TranslationCache::lookup(const std::vector<uint8_t>& key, Entry& entry)
+{
+    uint64_t keyHash = hash(key.data(), key.size());
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    auto it = _entries.find(keyHash);
+    if (it == _entries.end() || it->second.key != key)
+    {
+        _misses++;
+        return false;
+    }
+
+    _hits++;
+    entry = it->second;
+
+    return true;
+}
+
+void TranslationCache::insert(Entry&& entry)
+{
+    uint64_t keyHash = hash(entry.key.data(), entry.key.size());
+
+    std::lock_guard<std::mutex> lock(_lock);
+
+    if (_path.empty())
+        return;
+
+    _entries[keyHash] = std::move(entry);
+    _dirty = true;
+}
+
+void TranslationCache::appendInstruction(std::vector<uint8_t>& key, const Instruction& instr)
+{
+    append(key, instr.prefix);
+    append(key, (uint32_t)instr.mnemonic);
+
+    for (const Operand& op : instr.operands)
+    {
+        append(key, (uint8_t)op.type);
+        append(key, (uint8_t)op.size);
+
+        switch (op.type)
+        {
+        case OperandType::REG:
+            append(key, op.reg.reg);
+            append(key, op.reg.pos);
+            break;
+        case OperandType::IMM:
+            append(key, (uint64_t)(uintptr_t)op.imm.val.ptr);
+            break;
+        case OperandType::MEMORY:
+            append(key, op.mem.addressSize);
+            append(key, (uint8_t)op.mem.segment);
+            append(key, (uint8_t)op.mem.scale);
+            append(key, (uint8_t)op.mem.regBase);
+            append(key, (uint8_t)op.mem.regIndex);
+            append(key, op.mem.disp.u32);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+uint64_t TranslationCache::hash(const uint8_t *data, size_t size)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < size; i++)
+    {
+        h ^= data[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+}
@@ -0,0 +1,577 @@
+#include "writewatch.h"
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <mutex>
+#include <thread>
+
+namespace x86box {
+
+// Page addresses are aligned, so neither clashes with one.
+static const uintptr_t k_SlotEmpty = 0;
+static const uintptr_t k_SlotRemoved = 2;
+static const uintptr_t k_SlotWritten = 1;
+
+static std::atomic<WriteWatch*> s_watches[WriteWatch::k_MaxWatches];
+// Faults being handled, a watch going away waits for them.
+static std::atomic<uint32_t> s_activeHandlers;
+static std::mutex s_registryLock;
+static bool s_handlerInstalled = false;
+
+static bool isPage(uintptr_t slot)
+{
+    return slot != k_SlotEmpty && slot != k_SlotRemoved;
+}
+
+// Protection of the mapping page is in and where that ends, false if it
+// is not mapped.
+static bool queryProtection(uintptr_t page, uint32_t& protection, uintptr_t& end)
+{
+#ifdef _WIN32
+    MEMORY_BASIC_INFORMATION info;
+    if (VirtualQuery(reinterpret_cast<void*>(page), &info, sizeof(info)) == 0 || info.State != MEM_COMMIT)
+        return false;
+
+    protection = info.Protect;
+    end = (uintptr_t)info.BaseAddress + info.RegionSize;
+    return true;
+#else
+    FILE *maps = fopen("/proc/self/maps", "r");
+    if (!maps)
+        return false;
+
+    bool found = false;
+    char line[512];
+    while (fgets(line, sizeof(line), maps))
+    {
+        unsigned long long mapStart, mapEnd;
+        char perms[5];
+        if (sscanf(line, "%llx-%llx %4s", &mapStart, &mapEnd, perms) != 3)
+            continue;
+
+        if (page < mapStart || page >= mapEnd)
+            continue;
+
+        protection = (perms[0] == 'r' ? PROT_READ : 0) | (perms[1] == 'w' ? PROT_WRITE : 0) | (perms[2] == 'x' ? PROT_EXEC : 0);
+        end = (uintptr_t)mapEnd;
+        found = true;
+        break;
+    }
+
+    fclose(maps);
+    return found;
+#endif
+}
+
+// Same access without writes, false if the page could not be written to begin with.
+static bool getReadOnly(uint32_t protection, uint32_t& readOnly)
+{
+#ifdef _WIN32
+    uint32_t modifiers = protection & ~0xFFu;
+    switch (protection & 0xFF)
+    {
+    case PAGE_READWRITE:
+    case PAGE_WRITECOPY:
+        readOnly = PAGE_READONLY | modifiers;
+        return true;
+    case PAGE_EXECUTE_READWRITE:
+    case PAGE_EXECUTE_WRITECOPY:
+        readOnly = PAGE_EXECUTE_READ | modifiers;
+        return true;
+    }
+    return false;
+#else
+    readOnly = protection & ~(uint32_t)PROT_WRITE;
+    return (protection & PROT_WRITE) != 0;
+#endif
+}
+
+static bool protectPage(uintptr_t page, uint32_t protection)
+{
+#ifdef _WIN32
+    DWORD oldProtect;
+    return VirtualProtect(reinterpret_cast<void*>(page), WriteWatch::pageSize(), protection, &oldProtect) != 0;
+#else
+    return mprotect(reinterpret_cast<void*>(page), WriteWatch::pageSize(), (int)protection) == 0;
+#endif
+}
+
+static void waitForHandlers()
+{
+    while (s_activeHandlers.load() != 0)
+    {
+        std::this_thread::yield();
+    }
+}
+
+// Every watch gets to see the fault, the same page may be watched twice.
+static bool dispatchFault(uintptr_t address)
+{
+    s_activeHandlers++;
+
+    bool handled = false;
+    for (std::atomic<WriteWatch*>& slot : s_watches)
+    {
+        WriteWatch *watch = slot.load();
+        if (watch && watch->onWrite(address))
+        {
+            handled = true;
+        }
+    }
+
+    s_activeHandlers--;
+
+    return handled;
+}
+
+#ifdef _WIN32
+
+static LONG CALLBACK onException(PEXCEPTION_POINTERS info)
+{
+    const EXCEPTION_RECORD *record = info->ExceptionRecord;
+
+    if (record->ExceptionCode != EXCEPTION_ACCESS_VIOLATION || record->NumberParameters < 2)
+        return EXCEPTION_CONTINUE_SEARCH;
+
+    // Only writes, reads of watched pages never fault.
+    if (record->ExceptionInformation[0] != 1)
+        return EXCEPTION_CONTINUE_SEARCH;
+
+    if (!dispatchFault((uintptr_t)record->ExceptionInformation[1]))
+        return EXCEPTION_CONTINUE_SEARCH;
+
+    return EXCEPTION_CONTINUE_EXECUTION;
+}
+
+static bool installHandler()
+{
+    return AddVectoredExceptionHandler(1, onException) != nullptr;
+}
+
+#else
+
+// The unit switched the stack to the guest's, the handler runs on this one.
+class AltStack
+{
+    std::unique_ptr<uint8_t[]> _stack;
+    bool _ready = false;
+
+public:
+    ~AltStack()
+    {
+        if (_stack)
+        {
+            stack_t ss = {};
+            ss.ss_flags = SS_DISABLE;
+            sigaltstack(&ss, nullptr);
+        }
+    }
+
+    bool install()
+    {
+        if (_ready)
+            return true;
+
+        // One the host set up is fine as well.
+        stack_t current;
+        if (sigaltstack(nullptr, &current) == 0 && !(current.ss_flags & SS_DISABLE))
+        {
+            _ready = true;
+            return true;
+        }
+
+        size_t size = std::max<size_t>((size_t)SIGSTKSZ, 64 * 1024);
+        _stack.reset(new uint8_t[size]);
+
+        stack_t ss = {};
+        ss.ss_sp = _stack.get();
+        ss.ss_size = size;
+        if (sigaltstack(&ss, nullptr) != 0)
+        {
+            _stack.reset();
+            return false;
+        }
+
+        _ready = true;
+        return true;
+    }
+};
+
+static thread_local AltStack s_altStack;
+
+static struct sigaction s_previousAction;
+
+static void onSegv(int sig, siginfo_t *info, void *context)
+{
+    if (dispatchFault((uintptr_t)info->si_addr))
+        return;
+
+    // Not ours, hand it to whoever was installed before.
+    if (s_previousAction.sa_flags & SA_SIGINFO)
+    {
+        s_previousAction.sa_sigaction(sig, info, context);
+        return;
+    }
+
+    if (s_previousAction.sa_handler != SIG_DFL && s_previousAction.sa_handler != SIG_IGN)
+    {
+        s_previousAction.sa_handler(sig);
+        return;
+    }
+
+    // Faults again on return, this time with the default action.
+    signal(sig, SIG_DFL);
+}
+
+static bool installHandler()
+{
+    struct sigaction action = {};
+    action.sa_sigaction = onSegv;
+    action.sa_flags = SA_SIGINFO | SA_NODEFER | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+
+    return sigaction(SIGSEGV, &action, &s_previousAction) == 0;
+}
+
+#endif
+
+WriteWatch::WriteWatch()
+    : _interrupt(nullptr),
+    _written(0),
+    _interruptBit(0)
+{
+}
+
+WriteWatch::~WriteWatch()
+{
+    disable();
+}
+
+size_t WriteWatch::pageSize()
+{
+#ifdef _WIN32
+    static const size_t size = []()
+    {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        return (size_t)info.dwPageSize;
+    }();
+#else
+    static const size_t size = (size_t)sysconf(_SC_PAGESIZE);
+#endif
+    return size;
+}
+
+bool WriteWatch::enable(uint32_t interruptBit)
+{
+    if (_pages)
+        return true;
+
+    // Initialized here, the handler must not be the first to ask.
+    pageSize();
+
+    std::lock_guard<std::mutex> lock(s_registryLock);
+
+    if (!s_handlerInstalled)
+    {
+        if (!installHandler())
+            return false;
+
+        s_handlerInstalled = true;
+    }
+
+    for (std::atomic<WriteWatch*>& slot : s_watches)
+    {
+        if (slot.load() != nullptr)
+            continue;
+
+        _pages.reset(new std::atomic<uintptr_t>[k_MaxPages]);
+        _protections.reset(new uint32_t[k_MaxPages]);
+        for (size_t i = 0; i < k_MaxPages; i++)
+        {
+            _pages[i].store(k_SlotEmpty);
+            _protections[i] = 0;
+        }
+        _interruptBit = interruptBit;
+        _written = 0;
+
+        slot.store(this);
+        prepareThread();
+        return true;
+    }
+
+    return false;
+}
+
+void WriteWatch::disable()
+{
+    if (!_pages)
+        return;
+
+    // Still registered, a write racing with this is claimed either way.
+    for (size_t i = 0; i < k_MaxPages; i++)
+    {
+        uintptr_t slot = _pages[i].load();
+        if (isPage(slot))
+        {
+            protectPage(slot & ~k_SlotWritten, _protections[i]);
+        }
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(s_registryLock);
+        for (std::atomic<WriteWatch*>& slot : s_watches)
+        {
+            if (slot.load() == this)
+            {
+                slot.store(nullptr);
+            }
+        }
+    }
+
+    waitForHandlers();
+
+    _pages.reset();
+    _protections.reset();
+    _written = 0;
+}
+
+bool WriteWatch::prepareThread()
+{
+    if (!_pages)
+        return true;
+
+#ifdef _WIN32
+    // Exceptions are dispatched on the faulting stack, there is no other.
+    return true;
+#else
+    return s_altStack.install();
+#endif
+}
+
+bool WriteWatch::hasStackReserve(uintptr_t sp) const
+{
+    if (!_pages)
+        return true;
+
+#ifdef _WIN32
+    // The kernel copies the exception record and the context there before
+    // the handler runs, a guard page or a hole terminates the process.
+    if (sp < k_StackReserve)
+        return false;
+
+    uintptr_t address = sp - k_StackReserve;
+    while (address < sp)
+    {
+        uint32_t protection;
+        uintptr_t end;
+        if (!queryProtection(address, protection, end))
+            return false;
+
+        uint32_t readOnly;
+        if ((protection & PAGE_GUARD) || !getReadOnly(protection, readOnly))
+            return false;
+
+        address = end;
+    }
+    return true;
+#else
+    // The handler runs on its own stack.
+    return true;
+#endif
+}
+
+bool WriteWatch::insert(uintptr_t page, uint32_t protection, uint32_t readOnly)
+{
+    size_t mask = k_MaxPages - 1;
+    size_t idx = (size_t)(page / pageSize()) & mask;
+
+    for (size_t i = 0; i < k_MaxPages; i++, idx = (idx + 1) & mask)
+    {
+        uintptr_t slot = _pages[idx].load();
+        if (isPage(slot))
+            continue;
+
+        // Visible before the protection so the handler finds it.
+        _protections[idx] = protection;
+        _pages[idx].store(page, std::memory_order_release);
+        if (!protectPage(page, readOnly))
+        {
+            release(idx);
+            return false;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+void WriteWatch::unwatch(uintptr_t page)
+{
+    if (!_pages)
+        return;
+
+    size_t idx = find(page);
+    if (idx == k_MaxPages)
+        return;
+
+    // A write flagged meanwhile has nothing left to invalidate.
+    release(idx);
+    protectPage(page, _protections[idx]);
+
+    // A fault that found the slot is done with it before it is reused.
+    waitForHandlers();
+}
+
+size_t WriteWatch::find(uintptr_t page) const
+{
+    size_t mask = k_MaxPages - 1;
+    size_t idx = (size_t)(page / pageSize()) & mask;
+
+    for (size_t i = 0; i < k_MaxPages; i++, idx = (idx + 1) & mask)
+    {
+        uintptr_t slot = _pages[idx].load(std::memory_order_acquire);
+        if (slot == k_SlotEmpty)
+            break;
+
+        if (isPage(slot) && (slot & ~k_SlotWritten) == page)
+            return idx;
+    }
+
+    return k_MaxPages;
+}
+
+// Probes stop at the first empty slot, a removed one only has to stay where
+// a page further on is reached through it. That is not the case once the
+// next slot is empty, then the removed slots in front of it go as well.
+void WriteWatch::release(size_t idx)
+{
+    size_t mask = k_MaxPages - 1;
+
+    if (_pages[(idx + 1) & mask].load() != k_SlotEmpty)
+    {
+        _pages[idx].store(k_SlotRemoved);
+        return;
+    }
+
+    do
+    {
+        _pages[idx].store(k_SlotEmpty);
+        idx = (idx - 1) & mask;
+    } while (_pages[idx].load() == k_SlotRemoved);
+}
+
+bool WriteWatch::watch(uintptr_t start, size_t size)
+{
+    if (!_pages || size == 0)
+        return true;
+
+    size_t ps = pageSize();
+    uintptr_t first = start & ~(uintptr_t)(ps - 1);
+    uintptr_t last = (size - 1 > UINTPTR_MAX - start ? UINTPTR_MAX : start + size - 1) & ~(uintptr_t)(ps - 1);
+
+    bool watched = true;
+    uintptr_t regionEnd = 0;
+    uint32_t protection = 0;
+    bool mapped = false;
+
+    for (uintptr_t page = first; ; page += ps)
+    {
+        // Either protected already or written and waiting for takeWrites.
+        if (find(page) == k_MaxPages)
+        {
+            // Looked up once per mapping the range touches.
+            if (page >= regionEnd)
+            {
+                mapped = queryProtection(page, protection, regionEnd);
+                if (!mapped)
+                {
+                    regionEnd = page + ps;
+                }
+            }
+
+            // Pages that can not be written to need no watching.
+            uint32_t readOnly;
+            if (!mapped)
+            {
+                watched = false;
+            }
+            else if (getReadOnly(protection, readOnly))
+            {
+                watched &= insert(page, protection, readOnly);
+            }
+        }
+
+        if (page == last)
+            break;
+    }
+
+    return watched;
+}
+
+void WriteWatch::setInterrupt(std::atomic<uint32_t> *interrupt)
+{
+    std::atomic<uint32_t> *previous = _interrupt.exchange(interrupt);
+
+    // The previous context may go away once run returns.
+    if (previous && previous != interrupt)
+    {
+        waitForHandlers();
+    }
+}
+
+bool WriteWatch::onWrite(uintptr_t address)
+{
+    uintptr_t page = address & ~(uintptr_t)(pageSize() - 1);
+
+    size_t idx = find(page);
+    if (idx == k_MaxPages)
+        return false;
+
+    // Already flagged if another thread got here first.
+    uintptr_t expected = page;
+    _pages[idx].compare_exchange_strong(expected, page | k_SlotWritten);
+
+    protectPage(page, _protections[idx]);
+    _written++;
+
+    std::atomic<uint32_t> *interrupt = _interrupt.load();
+    if (interrupt)
+    {
+        interrupt->fetch_or(_interruptBit);
+    }
+
+    return true;
+}
+
+void WriteWatch::takeWrites(std::vector<uintptr_t>& pages)
+{
+    if (!_pages || _written.exchange(0) == 0)
+        return;
+
+    for (size_t i = 0; i < k_MaxPages; i++)
+    {
+        uintptr_t slot = _pages[i].load();
+        if (!isPage(slot) || !(slot & k_SlotWritten))
+            continue;
+
+        if (_pages[i].compare_exchange_strong(slot, k_SlotRemoved))
+        {
+            release(i);
+            pages.push_back(slot & ~k_SlotWritten);
+        }
+    }
+}
+
+}